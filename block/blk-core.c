@@ -512,9 +512,12 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 	if (err)
 		goto fail_id;
 
-	if (blk_throtl_init(q))
+	if (wbt_init(q))
 		goto fail_bdi;
 
+	if (blk_throtl_init(q))
+		goto fail_wbt;
+
 	setup_timer(&q->backing_dev_info.laptop_mode_wb_timer,
 		    laptop_mode_timer_fn, (unsigned long) q);
 	setup_timer(&q->timeout, blk_rq_timed_out_timer, (unsigned long) q);
@@ -538,6 +541,8 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 
 	return q;
 
+fail_wbt:
+	wbt_exit(q);
 fail_bdi:
 	bdi_destroy(&q->backing_dev_info);
 fail_id:
@@ -1207,6 +1212,7 @@ void __blk_put_request(struct request_queue *q, struct request *req)
 	if (unlikely(--req->ref_count))
 		return;
 
+	wbt_done(q, req);
 	elv_completed_request(q, req);
 
 	/* this is a bio leak */
@@ -1398,6 +1404,7 @@ void blk_queue_bio(struct request_queue *q, struct bio *bio)
 	int el_ret, rw_flags, where = ELEVATOR_INSERT_SORT;
 	struct request *req;
 	unsigned int request_count = 0;
+	bool wb_acct;
 
 	/*
 	 * low level driver can indicate that it wants pages above a
@@ -1448,12 +1455,20 @@ get_rq:
 	if (sync)
 		rw_flags |= REQ_SYNC;
 
+	/*
+	 * Buffered writeback may have to wait for earlier writeback to
+	 * complete first.  Drops the queue lock if it sleeps.
+	 */
+	wb_acct = wbt_wait(q, bio);
+
 	/*
 	 * Grab a free request. This is might sleep but can not fail.
 	 * Returns with the queue unlocked.
 	 */
 	req = get_request_wait(q, rw_flags, bio);
 	if (unlikely(!req)) {
+		if (wb_acct)
+			wbt_dec(q);
 		bio_endio(bio, -ENODEV);	/* @q is dead */
 		goto out_unlock;
 	}
@@ -1465,6 +1480,8 @@ get_rq:
 	 * often, and the elevators are able to handle it.
 	 */
 	init_request_from_bio(req, bio);
+	if (wb_acct)
+		req->cmd_flags |= REQ_WBT;
 
 	if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags))
 		req->cpu = raw_smp_processor_id();
@@ -2135,6 +2152,7 @@ void blk_start_request(struct request *req)
 
 	BUG_ON(test_bit(REQ_ATOM_COMPLETE, &req->atomic_flags));
 	blk_add_timer(req);
+	wbt_issue(req->q, req);
 }
 EXPORT_SYMBOL(blk_start_request);
 
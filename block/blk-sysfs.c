@@ -275,6 +275,26 @@ queue_rq_affinity_store(struct request_queue *q, const char *page, size_t count)
 	return ret;
 }
 
+#ifdef CONFIG_BLK_WBT
+static ssize_t queue_wb_lat_show(struct request_queue *q, char *page)
+{
+	return sprintf(page, "%llu\n", (unsigned long long)wbt_get_lat(q));
+}
+
+static ssize_t
+queue_wb_lat_store(struct request_queue *q, const char *page, size_t count)
+{
+	unsigned long usec;
+	ssize_t ret = queue_var_store(&usec, page, count);
+
+	if (ret < 0)
+		return ret;
+
+	wbt_set_lat(q, usec);
+	return ret;
+}
+#endif
+
 static struct queue_sysfs_entry queue_requests_entry = {
 	.attr = {.name = "nr_requests", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_requests_show,
@@ -389,6 +409,14 @@ static struct queue_sysfs_entry queue_random_entry = {
 	.store = queue_store_random,
 };
 
+#ifdef CONFIG_BLK_WBT
+static struct queue_sysfs_entry queue_wb_lat_entry = {
+	.attr = {.name = "wbt_lat_usec", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_wb_lat_show,
+	.store = queue_wb_lat_store,
+};
+#endif
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -489,6 +517,7 @@ static void blk_release_queue(struct kobject *kobj)
 	}
 
 	blk_throtl_exit(q);
+	wbt_exit(q);
 
 	if (rl->rq_pool)
 		mempool_destroy(rl->rq_pool);
@@ -535,11 +564,26 @@ int blk_register_queue(struct gendisk *disk)
 		return ret;
 	}
 
+#ifdef CONFIG_BLK_WBT
+	/* bio based queues never go through blk_queue_bio() to be throttled */
+	if (q->request_fn) {
+		ret = sysfs_create_file(&q->kobj, &queue_wb_lat_entry.attr);
+		if (ret) {
+			kobject_del(&q->kobj);
+			blk_trace_remove_sysfs(dev);
+			kobject_put(&dev->kobj);
+			return ret;
+		}
+	}
+#endif
+
 	kobject_uevent(&q->kobj, KOBJ_ADD);
 
 	if (!q->request_fn)
 		return 0;
 
+	wbt_enable_default(q);
+
 	ret = elv_register_queue(q);
 	if (ret) {
 		kobject_uevent(&q->kobj, KOBJ_REMOVE);
@@ -0,0 +1,250 @@
+/*
+ * Buffered writeback throttling
+ *
+ * balance_dirty_pages() and the flusher threads queue writeback as fast
+ * as pages get dirtied, and a read that comes in behind a few hundred of
+ * those writes waits for all of them.  Here the number of buffered
+ * writeback requests a queue holds at once is limited, and the limit is
+ * halved for every window in which even the fastest read took longer
+ * than wbt_lat_usec, then brought back one step per window once reads
+ * are fast again.  Sync writes, which fsync() and O_DIRECT issue and
+ * somebody waits for, are never held back.
+ */
+
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include "blk.h"
+
+/* Writeback requests allowed in a queue while reads are fast enough */
+static unsigned int wbt_depth = 16;
+
+/* Halving more often than this would not leave a single request */
+#define WBT_MAX_STEP		4
+
+/* Default read latency targets */
+#define WBT_NONROT_LAT_USEC	2000
+#define WBT_ROT_LAT_USEC	75000
+
+/* Reads are judged, and the limit moved, every 100ms */
+static unsigned long wbt_window = HZ/10;
+
+/*
+ * All of this is protected by the queue lock.
+ */
+struct rq_wb {
+	struct request_queue	*q;
+
+	/* read latency target, 0 turns throttling off */
+	u64			min_lat_nsec;
+
+	/* writeback requests allocated and not yet freed */
+	unsigned int		inflight;
+	unsigned int		limit;
+	unsigned int		scale_step;
+	wait_queue_head_t	wait;
+
+	/* reads completed in the current window */
+	struct timer_list	window_timer;
+	unsigned int		nr_reads;
+	u64			min_read_nsec;
+};
+
+static inline bool wbt_enabled(struct rq_wb *rwb)
+{
+	return rwb && rwb->min_lat_nsec;
+}
+
+static inline u64 wbt_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+/*
+ * Only writeback nobody waits for on the spot.  A write that is sync,
+ * flushes or goes straight to the media is already latency sensitive.
+ */
+static inline bool wbt_should_track(struct bio *bio)
+{
+	const unsigned long rw = bio->bi_rw;
+
+	return (rw & REQ_WRITE) &&
+		!(rw & (REQ_SYNC | REQ_FLUSH | REQ_FUA | REQ_DISCARD |
+			REQ_SANITIZE));
+}
+
+static void wbt_calc_limit(struct rq_wb *rwb)
+{
+	rwb->limit = max(wbt_depth >> rwb->scale_step, 1U);
+	wake_up_all(&rwb->wait);
+}
+
+static void wbt_window_fn(unsigned long data)
+{
+	struct rq_wb *rwb = (struct rq_wb *)data;
+	struct request_queue *q = rwb->q;
+	unsigned long flags;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+
+	if (rwb->nr_reads && rwb->min_read_nsec > rwb->min_lat_nsec) {
+		if (rwb->scale_step < WBT_MAX_STEP) {
+			rwb->scale_step++;
+			wbt_calc_limit(rwb);
+		}
+	} else if (rwb->scale_step) {
+		rwb->scale_step--;
+		wbt_calc_limit(rwb);
+	}
+	rwb->nr_reads = 0;
+	rwb->min_read_nsec = ULLONG_MAX;
+
+	if (wbt_enabled(rwb) && (rwb->inflight || rwb->scale_step))
+		mod_timer(&rwb->window_timer, jiffies + wbt_window);
+
+	spin_unlock_irqrestore(q->queue_lock, flags);
+}
+
+/**
+ * wbt_wait - wait for room for a writeback request
+ * @q: the request queue
+ * @bio: the bio a request is about to be allocated for
+ *
+ * Writeback sleeps here while the queue holds as many writeback
+ * requests as the current limit allows.  Must be called with the queue
+ * lock held, which is dropped while sleeping.
+ *
+ * Returns true if the request for @bio is to be counted, in which case
+ * the caller marks it REQ_WBT, or calls wbt_dec() if it gets none.
+ */
+bool wbt_wait(struct request_queue *q, struct bio *bio)
+{
+	struct rq_wb *rwb = q->rq_wb;
+	DEFINE_WAIT(wait);
+
+	if (!wbt_enabled(rwb) || !wbt_should_track(bio))
+		return false;
+
+	if (!timer_pending(&rwb->window_timer))
+		mod_timer(&rwb->window_timer, jiffies + wbt_window);
+
+	while (rwb->inflight >= rwb->limit && wbt_enabled(rwb)) {
+		prepare_to_wait_exclusive(&rwb->wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		spin_unlock_irq(q->queue_lock);
+		io_schedule();
+		spin_lock_irq(q->queue_lock);
+	}
+	finish_wait(&rwb->wait, &wait);
+
+	rwb->inflight++;
+	return true;
+}
+
+/*
+ * Queue lock must be held
+ */
+void wbt_dec(struct request_queue *q)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	if (WARN_ON_ONCE(!rwb->inflight))
+		return;
+	rwb->inflight--;
+	if (rwb->inflight < rwb->limit && waitqueue_active(&rwb->wait))
+		wake_up(&rwb->wait);
+}
+
+/*
+ * Called when @rq goes to the driver, queue lock held.  Reads are timed
+ * from here, so that only the time the device takes counts, not the time
+ * spent in the io scheduler.
+ */
+void wbt_issue(struct request_queue *q, struct request *rq)
+{
+	if (wbt_enabled(q->rq_wb) && rq->cmd_type == REQ_TYPE_FS &&
+	    rq_data_dir(rq) == READ)
+		rq->wbt_issue_ns = wbt_now();
+}
+
+/*
+ * Called when @rq is freed, queue lock held.
+ */
+void wbt_done(struct request_queue *q, struct request *rq)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	if (rq->cmd_flags & REQ_WBT) {
+		rq->cmd_flags &= ~REQ_WBT;
+		wbt_dec(q);
+	} else if (rq->wbt_issue_ns) {
+		u64 lat = wbt_now() - rq->wbt_issue_ns;
+
+		rq->wbt_issue_ns = 0;
+		rwb->nr_reads++;
+		if (lat < rwb->min_read_nsec)
+			rwb->min_read_nsec = lat;
+	}
+}
+
+u64 wbt_get_lat(struct request_queue *q)
+{
+	return div_u64(q->rq_wb->min_lat_nsec, NSEC_PER_USEC);
+}
+
+void wbt_set_lat(struct request_queue *q, u64 usec)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	spin_lock_irq(q->queue_lock);
+	rwb->min_lat_nsec = usec * NSEC_PER_USEC;
+	rwb->scale_step = 0;
+	wbt_calc_limit(rwb);
+	spin_unlock_irq(q->queue_lock);
+}
+
+/*
+ * Only request based queues go through blk_queue_bio(), and whether the
+ * device is rotational is only known once the driver registers the disk.
+ */
+void wbt_enable_default(struct request_queue *q)
+{
+	if (!q->request_fn)
+		return;
+
+	wbt_set_lat(q, blk_queue_nonrot(q) ? WBT_NONROT_LAT_USEC :
+					     WBT_ROT_LAT_USEC);
+}
+
+int wbt_init(struct request_queue *q)
+{
+	struct rq_wb *rwb;
+
+	rwb = kzalloc_node(sizeof(*rwb), GFP_KERNEL, q->node);
+	if (!rwb)
+		return -ENOMEM;
+
+	rwb->q = q;
+	rwb->limit = wbt_depth;
+	rwb->min_read_nsec = ULLONG_MAX;
+	init_waitqueue_head(&rwb->wait);
+	setup_timer(&rwb->window_timer, wbt_window_fn, (unsigned long)rwb);
+
+	q->rq_wb = rwb;
+	return 0;
+}
+
+void wbt_exit(struct request_queue *q)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	if (!rwb)
+		return;
+
+	del_timer_sync(&rwb->window_timer);
+	q->rq_wb = NULL;
+	kfree(rwb);
+}
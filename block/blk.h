@@ -245,4 +245,27 @@ static inline void blk_throtl_exit(struct request_queue *q) { }
 static inline void blk_throtl_release(struct request_queue *q) { }
 #endif /* CONFIG_BLK_DEV_THROTTLING */
 
+#ifdef CONFIG_BLK_WBT
+extern bool wbt_wait(struct request_queue *q, struct bio *bio);
+extern void wbt_dec(struct request_queue *q);
+extern void wbt_issue(struct request_queue *q, struct request *rq);
+extern void wbt_done(struct request_queue *q, struct request *rq);
+extern u64 wbt_get_lat(struct request_queue *q);
+extern void wbt_set_lat(struct request_queue *q, u64 usec);
+extern void wbt_enable_default(struct request_queue *q);
+extern int wbt_init(struct request_queue *q);
+extern void wbt_exit(struct request_queue *q);
+#else /* CONFIG_BLK_WBT */
+static inline bool wbt_wait(struct request_queue *q, struct bio *bio)
+{
+	return false;
+}
+static inline void wbt_dec(struct request_queue *q) { }
+static inline void wbt_issue(struct request_queue *q, struct request *rq) { }
+static inline void wbt_done(struct request_queue *q, struct request *rq) { }
+static inline void wbt_enable_default(struct request_queue *q) { }
+static inline int wbt_init(struct request_queue *q) { return 0; }
+static inline void wbt_exit(struct request_queue *q) { }
+#endif /* CONFIG_BLK_WBT */
+
 #endif /* BLK_INTERNAL_H */
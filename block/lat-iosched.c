@@ -0,0 +1,603 @@
+/*
+ * LAT (latency targeting) I/O scheduler.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/* See Documentation/block/lat-iosched.txt */
+
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/elevator.h>
+#include <linux/bio.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/init.h>
+#include <linux/ktime.h>
+
+/*
+ * enum lat_class - what a request is measured and queued as
+ *
+ * All reads are sync.  Async writes are writeback, which is what
+ * background I/O amounts to on a phone, and the only class that is
+ * throttled.
+ */
+enum lat_class {
+	LAT_READ = 0,
+	LAT_SYNC_WRITE,
+	LAT_ASYNC_WRITE,
+	LAT_NR_CLASSES,
+};
+
+/*
+ * Completion times are kept in log-linear buckets, four per power of
+ * two, which is within 25% everywhere and covers up to 2^25us.
+ */
+#define LAT_BUCKETS		96
+/* The window slides by a quarter at a time */
+#define LAT_SLOTS		4
+
+/* Default values */
+#define LAT_READ_TARGET_US	5000
+#define LAT_SYNC_WRITE_TARGET_US 50000
+#define LAT_PERCENTILE		90
+#define LAT_WINDOW_MS		400
+#define LAT_ASYNC_DEPTH_MAX	16
+#define LAT_SYNC_WRITE_EXPIRE	(HZ / 2)
+#define LAT_ASYNC_WRITE_EXPIRE	(5 * HZ)
+
+/**
+ * struct lat_slot - completion times of one slot of the window
+ * @hist:	per class histogram, see lat_bucket()
+ * @max_us:	per class worst completion time
+ */
+struct lat_slot {
+	unsigned int		hist[LAT_NR_CLASSES][LAT_BUCKETS];
+	u32			max_us[LAT_NR_CLASSES];
+};
+
+/**
+ * struct lat_data - per queue scheduler data
+ * @q:			the queue, for the sysfs code to lock
+ * @fifo:		queued requests of each class, oldest first
+ * @inflight:		requests of each class the driver has started
+ * @slot:		the sliding window
+ * @cur_slot:		slot completions are currently counted in
+ * @slot_start:		jiffies at which the current slot began
+ * @async_depth:	async writes that may be in flight right now
+ * @throttled:		slots at whose end async_depth was cut
+ * @target_us:		completion time the percentile of a class should
+ *			stay under, 0 for none
+ * @percentile:		percentile the targets apply to
+ * @window_ms:		length of the window
+ * @async_depth_max:	async_depth when targets are met
+ * @fifo_expire:	time after which a write goes ahead of reads
+ */
+struct lat_data {
+	struct request_queue	*q;
+	struct list_head	fifo[LAT_NR_CLASSES];
+	unsigned int		inflight[LAT_NR_CLASSES];
+
+	struct lat_slot		slot[LAT_SLOTS];
+	unsigned int		cur_slot;
+	unsigned long		slot_start;
+
+	unsigned int		async_depth;
+	unsigned long		throttled;
+
+	int			target_us[LAT_NR_CLASSES];
+	int			percentile;
+	int			window_ms;
+	int			async_depth_max;
+	int			fifo_expire[LAT_NR_CLASSES];
+};
+
+static inline enum lat_class lat_class(struct request *rq)
+{
+	if (rq_data_dir(rq) == READ)
+		return LAT_READ;
+	return rq_is_sync(rq) ? LAT_SYNC_WRITE : LAT_ASYNC_WRITE;
+}
+
+/* Wraps every 71 minutes, which differences do not mind */
+static inline u32 lat_now_us(void)
+{
+	return (u32)ktime_to_us(ktime_get());
+}
+
+static inline u32 lat_start_us(struct request *rq)
+{
+	return (u32)(unsigned long)rq->elv.priv[0];
+}
+
+static inline void lat_set_start_us(struct request *rq, u32 us)
+{
+	rq->elv.priv[0] = (void *)(unsigned long)us;
+}
+
+static unsigned int lat_bucket(u32 us)
+{
+	unsigned int b;
+
+	if (us < 4)
+		return us;
+	b = fls(us) - 1;
+	if (b > LAT_BUCKETS / 4)
+		return LAT_BUCKETS - 1;
+	return (b - 1) * 4 + ((us >> (b - 2)) & 3);
+}
+
+/* Lowest completion time that falls in bucket idx */
+static u32 lat_bucket_us(unsigned int idx)
+{
+	if (idx < 4)
+		return idx;
+	return (4 + idx % 4) << (idx / 4 - 1);
+}
+
+/*
+ * Completion time that pct percent of the class's requests in the
+ * window stayed under, rounded up to the end of its bucket.  Returns 0
+ * when the window is empty.
+ */
+static u32 lat_percentile(struct lat_data *ld, enum lat_class class,
+			  unsigned int pct, unsigned int *nr)
+{
+	unsigned int total = 0, seen = 0, want, i, s;
+	u32 max = 0;
+
+	for (s = 0; s < LAT_SLOTS; s++) {
+		for (i = 0; i < LAT_BUCKETS; i++)
+			total += ld->slot[s].hist[class][i];
+		max = max(max, ld->slot[s].max_us[class]);
+	}
+	if (nr)
+		*nr = total;
+	if (!total)
+		return 0;
+
+	want = DIV_ROUND_UP(total * pct, 100);
+	for (i = 0; i < LAT_BUCKETS - 1; i++) {
+		for (s = 0; s < LAT_SLOTS; s++)
+			seen += ld->slot[s].hist[class][i];
+		if (seen >= want)
+			return min(lat_bucket_us(i + 1) - 1, max);
+	}
+	return max;
+}
+
+/*
+ * Runs at the end of every slot, in the spirit of a token bucket whose
+ * size is the async depth.  When a class misses its target over the
+ * window, and missed it in the slot just ended too, the async writes
+ * allowed in flight are halved; otherwise they grow back by one.
+ */
+static void lat_adjust(struct lat_data *ld)
+{
+	struct lat_slot *last = &ld->slot[ld->cur_slot];
+	bool over = false, fresh = false;
+	enum lat_class class;
+
+	for (class = LAT_READ; class < LAT_ASYNC_WRITE; class++) {
+		u32 target = ld->target_us[class];
+
+		if (!target)
+			continue;
+		if (lat_percentile(ld, class, ld->percentile, NULL) > target) {
+			over = true;
+			if (last->max_us[class] > target)
+				fresh = true;
+		}
+	}
+
+	if (over && fresh) {
+		ld->async_depth = max(ld->async_depth / 2, 1U);
+		ld->throttled++;
+	} else if (!over && ld->async_depth < ld->async_depth_max) {
+		ld->async_depth++;
+	}
+}
+
+/* Moves the window on to now */
+static void lat_slide(struct lat_data *ld)
+{
+	unsigned long slot_len = max(msecs_to_jiffies(ld->window_ms) /
+				     LAT_SLOTS, 1UL);
+
+	if (time_after_eq(jiffies, ld->slot_start + LAT_SLOTS * slot_len)) {
+		/* idle for a whole window: nothing to go by */
+		memset(ld->slot, 0, sizeof(ld->slot));
+		ld->cur_slot = 0;
+		ld->slot_start = jiffies;
+		ld->async_depth = ld->async_depth_max;
+		return;
+	}
+
+	while (time_after_eq(jiffies, ld->slot_start + slot_len)) {
+		lat_adjust(ld);
+		ld->cur_slot = (ld->cur_slot + 1) % LAT_SLOTS;
+		memset(&ld->slot[ld->cur_slot], 0, sizeof(struct lat_slot));
+		ld->slot_start += slot_len;
+	}
+}
+
+static inline bool lat_async_allowed(struct lat_data *ld)
+{
+	return ld->inflight[LAT_ASYNC_WRITE] < ld->async_depth;
+}
+
+static void lat_add_request(struct request_queue *q, struct request *rq)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+	enum lat_class class = lat_class(rq);
+
+	lat_slide(ld);
+	lat_set_start_us(rq, lat_now_us());
+	rq_set_fifo_time(rq, jiffies + ld->fifo_expire[class]);
+	list_add_tail(&rq->queuelist, &ld->fifo[class]);
+}
+
+static void lat_merged_requests(struct request_queue *q, struct request *rq,
+				struct request *next)
+{
+	/*
+	 * rq takes over the place of next in the fifo if next is older,
+	 * and its start time so the wait is measured from the first bio.
+	 */
+	if (!list_empty(&rq->queuelist) && !list_empty(&next->queuelist)) {
+		if (time_before(rq_fifo_time(next), rq_fifo_time(rq))) {
+			list_move(&rq->queuelist, &next->queuelist);
+			rq_set_fifo_time(rq, rq_fifo_time(next));
+		}
+	}
+	if ((s32)(lat_start_us(next) - lat_start_us(rq)) < 0)
+		lat_set_start_us(rq, lat_start_us(next));
+
+	rq_fifo_clear(next);
+}
+
+static struct request *lat_expired_request(struct lat_data *ld,
+					   enum lat_class class)
+{
+	struct request *rq;
+
+	if (list_empty(&ld->fifo[class]))
+		return NULL;
+
+	rq = rq_entry_fifo(ld->fifo[class].next);
+	if (time_after_eq(jiffies, rq_fifo_time(rq)))
+		return rq;
+	return NULL;
+}
+
+static void lat_dispatch_request(struct lat_data *ld, struct request *rq)
+{
+	rq_fifo_clear(rq);
+	elv_dispatch_add_tail(ld->q, rq);
+}
+
+/*
+ * Reads before sync writes before async writes, with writes that have
+ * waited past their expiry going first.  Async writes are held back
+ * whenever async_depth of them are in flight.
+ */
+static int lat_dispatch_requests(struct request_queue *q, int force)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+	struct request *rq = NULL;
+	enum lat_class class;
+
+	if (unlikely(force)) {
+		int dispatched = 0;
+
+		for (class = LAT_READ; class < LAT_NR_CLASSES; class++)
+			while (!list_empty(&ld->fifo[class])) {
+				rq = rq_entry_fifo(ld->fifo[class].next);
+				lat_dispatch_request(ld, rq);
+				dispatched++;
+			}
+		return dispatched;
+	}
+
+	rq = lat_expired_request(ld, LAT_SYNC_WRITE);
+	if (!rq && lat_async_allowed(ld))
+		rq = lat_expired_request(ld, LAT_ASYNC_WRITE);
+
+	for (class = LAT_READ; !rq && class < LAT_NR_CLASSES; class++) {
+		if (class == LAT_ASYNC_WRITE && !lat_async_allowed(ld))
+			break;
+		if (!list_empty(&ld->fifo[class]))
+			rq = rq_entry_fifo(ld->fifo[class].next);
+	}
+	if (!rq)
+		return 0;
+
+	lat_dispatch_request(ld, rq);
+	return 1;
+}
+
+static void lat_activate_request(struct request_queue *q, struct request *rq)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+
+	ld->inflight[lat_class(rq)]++;
+}
+
+static void lat_deactivate_request(struct request_queue *q,
+				   struct request *rq)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+	enum lat_class class = lat_class(rq);
+
+	if (ld->inflight[class])
+		ld->inflight[class]--;
+}
+
+static void lat_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+	enum lat_class class = lat_class(rq);
+	u32 us = lat_now_us() - lat_start_us(rq);
+	struct lat_slot *slot;
+
+	if (ld->inflight[class])
+		ld->inflight[class]--;
+
+	lat_slide(ld);
+	slot = &ld->slot[ld->cur_slot];
+	slot->hist[class][lat_bucket(us)]++;
+	if (us > slot->max_us[class])
+		slot->max_us[class] = us;
+
+	/*
+	 * Held back async writes were not dispatched when the driver last
+	 * asked, and it may not ask again on its own.
+	 */
+	if (class == LAT_ASYNC_WRITE &&
+	    ld->inflight[class] + 1 == ld->async_depth &&
+	    !list_empty(&ld->fifo[class]))
+		blk_run_queue_async(q);
+}
+
+static struct request *lat_former_request(struct request_queue *q,
+					  struct request *rq)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+
+	if (rq->queuelist.prev == &ld->fifo[lat_class(rq)])
+		return NULL;
+	return list_entry(rq->queuelist.prev, struct request, queuelist);
+}
+
+static struct request *lat_latter_request(struct request_queue *q,
+					  struct request *rq)
+{
+	struct lat_data *ld = q->elevator->elevator_data;
+
+	if (rq->queuelist.next == &ld->fifo[lat_class(rq)])
+		return NULL;
+	return list_entry(rq->queuelist.next, struct request, queuelist);
+}
+
+static void *lat_init_queue(struct request_queue *q)
+{
+	struct lat_data *ld;
+	enum lat_class class;
+
+	ld = kmalloc_node(sizeof(*ld), GFP_KERNEL | __GFP_ZERO, q->node);
+	if (!ld)
+		return NULL;
+
+	ld->q = q;
+	for (class = LAT_READ; class < LAT_NR_CLASSES; class++)
+		INIT_LIST_HEAD(&ld->fifo[class]);
+	ld->slot_start = jiffies;
+
+	ld->target_us[LAT_READ] = LAT_READ_TARGET_US;
+	ld->target_us[LAT_SYNC_WRITE] = LAT_SYNC_WRITE_TARGET_US;
+	ld->percentile = LAT_PERCENTILE;
+	ld->window_ms = LAT_WINDOW_MS;
+	ld->async_depth_max = LAT_ASYNC_DEPTH_MAX;
+	ld->async_depth = ld->async_depth_max;
+	ld->fifo_expire[LAT_SYNC_WRITE] = LAT_SYNC_WRITE_EXPIRE;
+	ld->fifo_expire[LAT_ASYNC_WRITE] = LAT_ASYNC_WRITE_EXPIRE;
+
+	return ld;
+}
+
+static void lat_exit_queue(struct elevator_queue *e)
+{
+	struct lat_data *ld = e->elevator_data;
+	enum lat_class class;
+
+	for (class = LAT_READ; class < LAT_NR_CLASSES; class++)
+		BUG_ON(!list_empty(&ld->fifo[class]));
+
+	kfree(ld);
+}
+
+/*
+ * sysfs code
+ */
+
+static ssize_t lat_var_show(int var, char *page)
+{
+	return sprintf(page, "%d\n", var);
+}
+
+static ssize_t lat_var_store(int *var, const char *page, size_t count)
+{
+	char *p = (char *)page;
+
+	*var = simple_strtol(p, &p, 10);
+	return count;
+}
+
+#define SHOW_FUNCTION(__FUNC, __VAR, __CONV)				\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct lat_data *ld = e->elevator_data;				\
+	int __data = __VAR;						\
+	if (__CONV)							\
+		__data = jiffies_to_msecs(__data);			\
+	return lat_var_show(__data, (page));				\
+}
+SHOW_FUNCTION(lat_read_target_us_show, ld->target_us[LAT_READ], 0);
+SHOW_FUNCTION(lat_sync_write_target_us_show,
+	      ld->target_us[LAT_SYNC_WRITE], 0);
+SHOW_FUNCTION(lat_target_percentile_show, ld->percentile, 0);
+SHOW_FUNCTION(lat_window_ms_show, ld->window_ms, 0);
+SHOW_FUNCTION(lat_async_depth_max_show, ld->async_depth_max, 0);
+SHOW_FUNCTION(lat_sync_write_expire_show, ld->fifo_expire[LAT_SYNC_WRITE], 1);
+SHOW_FUNCTION(lat_async_write_expire_show,
+	      ld->fifo_expire[LAT_ASYNC_WRITE], 1);
+SHOW_FUNCTION(lat_async_depth_show, ld->async_depth, 0);
+#undef SHOW_FUNCTION
+
+static ssize_t lat_throttled_show(struct elevator_queue *e, char *page)
+{
+	struct lat_data *ld = e->elevator_data;
+
+	return sprintf(page, "%lu\n", ld->throttled);
+}
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page,	\
+		      size_t count)					\
+{									\
+	struct lat_data *ld = e->elevator_data;				\
+	int __data;							\
+	int ret = lat_var_store(&__data, (page), count);		\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	if (__CONV)							\
+		*(__PTR) = msecs_to_jiffies(__data);			\
+	else								\
+		*(__PTR) = __data;					\
+	return ret;							\
+}
+STORE_FUNCTION(lat_read_target_us_store, &ld->target_us[LAT_READ],
+	       0, INT_MAX, 0);
+STORE_FUNCTION(lat_sync_write_target_us_store,
+	       &ld->target_us[LAT_SYNC_WRITE], 0, INT_MAX, 0);
+STORE_FUNCTION(lat_target_percentile_store, &ld->percentile, 1, 100, 0);
+STORE_FUNCTION(lat_window_ms_store, &ld->window_ms, LAT_SLOTS, INT_MAX, 0);
+STORE_FUNCTION(lat_sync_write_expire_store, &ld->fifo_expire[LAT_SYNC_WRITE],
+	       0, INT_MAX, 1);
+STORE_FUNCTION(lat_async_write_expire_store,
+	       &ld->fifo_expire[LAT_ASYNC_WRITE], 0, INT_MAX, 1);
+#undef STORE_FUNCTION
+
+/* A lower maximum takes effect right away, a higher one step by step */
+static ssize_t lat_async_depth_max_store(struct elevator_queue *e,
+					 const char *page, size_t count)
+{
+	struct lat_data *ld = e->elevator_data;
+	int depth;
+	int ret = lat_var_store(&depth, page, count);
+
+	depth = max(depth, 1);
+
+	spin_lock_irq(ld->q->queue_lock);
+	ld->async_depth_max = depth;
+	if (ld->async_depth > depth)
+		ld->async_depth = depth;
+	spin_unlock_irq(ld->q->queue_lock);
+
+	return ret;
+}
+
+/* Percentiles of the window, in usecs */
+static ssize_t lat_class_show(struct elevator_queue *e, char *page,
+			      enum lat_class class)
+{
+	struct lat_data *ld = e->elevator_data;
+	unsigned int nr;
+	u32 p50, p90, p99, max;
+
+	spin_lock_irq(ld->q->queue_lock);
+	lat_slide(ld);
+	p50 = lat_percentile(ld, class, 50, &nr);
+	p90 = lat_percentile(ld, class, 90, NULL);
+	p99 = lat_percentile(ld, class, 99, NULL);
+	max = lat_percentile(ld, class, 100, NULL);
+	spin_unlock_irq(ld->q->queue_lock);
+
+	return sprintf(page, "p50 %u p90 %u p99 %u max %u nr %u\n",
+		       p50, p90, p99, max, nr);
+}
+
+static ssize_t lat_read_lat_show(struct elevator_queue *e, char *page)
+{
+	return lat_class_show(e, page, LAT_READ);
+}
+
+static ssize_t lat_sync_write_lat_show(struct elevator_queue *e, char *page)
+{
+	return lat_class_show(e, page, LAT_SYNC_WRITE);
+}
+
+static ssize_t lat_async_write_lat_show(struct elevator_queue *e, char *page)
+{
+	return lat_class_show(e, page, LAT_ASYNC_WRITE);
+}
+
+#define LAT_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, lat_##name##_show, lat_##name##_store)
+#define LAT_ATTR_RO(name) \
+	__ATTR(name, S_IRUGO, lat_##name##_show, NULL)
+
+static struct elv_fs_entry lat_attrs[] = {
+	LAT_ATTR(read_target_us),
+	LAT_ATTR(sync_write_target_us),
+	LAT_ATTR(target_percentile),
+	LAT_ATTR(window_ms),
+	LAT_ATTR(async_depth_max),
+	LAT_ATTR(sync_write_expire),
+	LAT_ATTR(async_write_expire),
+	LAT_ATTR_RO(async_depth),
+	LAT_ATTR_RO(throttled),
+	LAT_ATTR_RO(read_lat),
+	LAT_ATTR_RO(sync_write_lat),
+	LAT_ATTR_RO(async_write_lat),
+	__ATTR_NULL
+};
+
+static struct elevator_type iosched_lat = {
+	.ops = {
+		.elevator_merge_req_fn		= lat_merged_requests,
+		.elevator_dispatch_fn		= lat_dispatch_requests,
+		.elevator_add_req_fn		= lat_add_request,
+		.elevator_activate_req_fn	= lat_activate_request,
+		.elevator_deactivate_req_fn	= lat_deactivate_request,
+		.elevator_completed_req_fn	= lat_completed_request,
+		.elevator_former_req_fn		= lat_former_request,
+		.elevator_latter_req_fn		= lat_latter_request,
+		.elevator_init_fn		= lat_init_queue,
+		.elevator_exit_fn		= lat_exit_queue,
+	},
+	.elevator_attrs = lat_attrs,
+	.elevator_name = "lat",
+	.elevator_owner = THIS_MODULE,
+};
+
+static int __init lat_init(void)
+{
+	elv_register(&iosched_lat);
+	return 0;
+}
+
+static void __exit lat_exit(void)
+{
+	elv_unregister(&iosched_lat);
+}
+
+module_init(lat_init);
+module_exit(lat_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("Latency targeting IO scheduler");
@@ -17,16 +17,50 @@
 #include <linux/debugfs.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/wait.h>
 #include "ion_priv.h"
 
-struct ion_page_pool_item {
-	struct page *page;
-	struct list_head list;
-};
+/*
+ * Each pool keeps a small per-CPU cache of pages in front of its shared
+ * lists. Pages move between a cache and the lists a batch at a time, so the
+ * pool lock is taken once per batch rather than once per page.
+ *
+ * A cache is only touched by its own CPU with interrupts disabled, which lets
+ * the shrinker drain every cache with an IPI. Since the drain takes the pool
+ * lock from interrupt context, the lock is always taken with interrupts
+ * disabled.
+ *
+ * Freed pages are dirty: they go through a separate per-CPU cache onto the
+ * dirty lists, and ion_page_pool_zero_thread() clears them in the
+ * background and moves them to the clean lists. Allocation only ever hands
+ * out clean pages and zeroes a dirty one itself when nothing clean is left.
+ */
+
+/* most pages a per-CPU cache holds, whatever the order */
+#define ION_PAGE_POOL_CACHE_BYTES	(1 << 20)
+
+/* items the shrinker frees per trip to the pool lock */
+#define ION_PAGE_POOL_SHRINK_BATCH	32
+
+/* items the zeroing thread clears per trip to the pool lock */
+#define ION_PAGE_POOL_ZERO_BATCH	16
+
+static LIST_HEAD(ion_page_pool_zero_pools);
+static DEFINE_MUTEX(ion_page_pool_zero_lock);
+static DECLARE_WAIT_QUEUE_HEAD(ion_page_pool_zero_wait);
+static atomic_t ion_page_pool_zero_pending = ATOMIC_INIT(0);
+static struct task_struct *ion_page_pool_zero_task;
 
 static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
 {
@@ -48,93 +82,296 @@ static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 	__free_pages(page, pool->order);
 }
 
-static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+/*
+ * ion_page_pool_zero_page - clear a dirty item and flush it for dma, leaving
+ * it in the same state as a freshly allocated one.
+ */
+static void ion_page_pool_zero_page(struct ion_page_pool *pool,
+				    struct page *page)
 {
-	struct ion_page_pool_item *item;
+	int i;
 
-	item = kmalloc(sizeof(struct ion_page_pool_item), GFP_KERNEL);
-	if (!item)
-		return -ENOMEM;
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(page + i);
+	__dma_page_cpu_to_dev(page, 0, PAGE_SIZE << pool->order,
+			      DMA_BIDIRECTIONAL);
+}
 
-	mutex_lock(&pool->mutex);
-	item->page = page;
+/* Caller must hold pool->lock. */
+static void ion_page_pool_add(struct ion_page_pool_list *items,
+			      struct page *page)
+{
 	if (PageHighMem(page)) {
-		list_add_tail(&item->list, &pool->high_items);
-		pool->high_count++;
+		list_add_tail(&page->lru, &items->high_items);
+		items->high_count++;
 	} else {
-		list_add_tail(&item->list, &pool->low_items);
-		pool->low_count++;
+		list_add_tail(&page->lru, &items->low_items);
+		items->low_count++;
 	}
-	mutex_unlock(&pool->mutex);
-	return 0;
 }
 
-static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
+/* Caller must hold pool->lock. */
+static struct page *ion_page_pool_remove(struct ion_page_pool_list *items,
+					 bool high)
 {
-	struct ion_page_pool_item *item;
 	struct page *page;
 
 	if (high) {
-		BUG_ON(!pool->high_count);
-		item = list_first_entry(&pool->high_items,
-					struct ion_page_pool_item, list);
-		pool->high_count--;
+		BUG_ON(!items->high_count);
+		page = list_first_entry(&items->high_items, struct page, lru);
+		items->high_count--;
 	} else {
-		BUG_ON(!pool->low_count);
-		item = list_first_entry(&pool->low_items,
-					struct ion_page_pool_item, list);
-		pool->low_count--;
+		BUG_ON(!items->low_count);
+		page = list_first_entry(&items->low_items, struct page, lru);
+		items->low_count--;
 	}
 
-	list_del(&item->list);
-	page = item->page;
-	kfree(item);
+	list_del(&page->lru);
+	return page;
+}
+
+static void ion_page_pool_list_init(struct ion_page_pool_list *items)
+{
+	items->high_count = 0;
+	items->low_count = 0;
+	INIT_LIST_HEAD(&items->high_items);
+	INIT_LIST_HEAD(&items->low_items);
+}
+
+static inline void ion_page_pool_cache_push(struct ion_page_pool_cache *cache,
+					    struct page *page)
+{
+	cache->pages[cache->count++] = page;
+	if (PageHighMem(page))
+		cache->high_count++;
+}
+
+static inline struct page *
+ion_page_pool_cache_pop(struct ion_page_pool_cache *cache)
+{
+	struct page *page = cache->pages[--cache->count];
+
+	if (PageHighMem(page))
+		cache->high_count--;
+	return page;
+}
+
+/*
+ * ion_page_pool_refill - move up to a batch of clean pages from the shared
+ * lists into 'cache', highmem first.
+ *
+ * Called with interrupts disabled.
+ */
+static void ion_page_pool_refill(struct ion_page_pool *pool,
+				 struct ion_page_pool_cache *cache)
+{
+	spin_lock(&pool->lock);
+	while (cache->count < pool->cache_batch) {
+		if (pool->clean.high_count)
+			ion_page_pool_cache_push(cache,
+				ion_page_pool_remove(&pool->clean, true));
+		else if (pool->clean.low_count)
+			ion_page_pool_cache_push(cache,
+				ion_page_pool_remove(&pool->clean, false));
+		else
+			break;
+	}
+	spin_unlock(&pool->lock);
+}
+
+/*
+ * ion_page_pool_flush - move the 'nr' coldest pages of 'cache' to the shared
+ * lists 'items'.
+ *
+ * Called with interrupts disabled.
+ */
+static void ion_page_pool_flush(struct ion_page_pool *pool,
+				struct ion_page_pool_cache *cache,
+				struct ion_page_pool_list *items, int nr)
+{
+	int i;
+
+	spin_lock(&pool->lock);
+	for (i = 0; i < nr; i++) {
+		if (PageHighMem(cache->pages[i]))
+			cache->high_count--;
+		ion_page_pool_add(items, cache->pages[i]);
+	}
+	spin_unlock(&pool->lock);
+
+	cache->count -= nr;
+	memmove(cache->pages, cache->pages + nr,
+		cache->count * sizeof(cache->pages[0]));
+}
+
+/* on_each_cpu() callback: empty this CPU's dirty cache into the lists */
+static void ion_page_pool_drain_dirty_cpu(void *data)
+{
+	struct ion_page_pool *pool = data;
+	struct ion_page_pool_cache *cache = this_cpu_ptr(pool->dirty_cache);
+
+	ion_page_pool_flush(pool, cache, &pool->dirty, cache->count);
+}
+
+/* on_each_cpu() callback: empty both of this CPU's caches into the lists */
+static void ion_page_pool_drain_cpu(void *data)
+{
+	struct ion_page_pool *pool = data;
+	struct ion_page_pool_cache *cache = this_cpu_ptr(pool->cache);
+
+	ion_page_pool_flush(pool, cache, &pool->clean, cache->count);
+	ion_page_pool_drain_dirty_cpu(data);
+}
+
+/*
+ * ion_page_pool_take_dirty - grab a dirty item for an allocation that found
+ * nothing clean, from this CPU's dirty cache first.
+ *
+ * Called with interrupts disabled.
+ */
+static struct page *ion_page_pool_take_dirty(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_cache *cache = this_cpu_ptr(pool->dirty_cache);
+	struct page *page = NULL;
+
+	if (cache->count)
+		return ion_page_pool_cache_pop(cache);
+
+	spin_lock(&pool->lock);
+	if (pool->dirty.high_count)
+		page = ion_page_pool_remove(&pool->dirty, true);
+	else if (pool->dirty.low_count)
+		page = ion_page_pool_remove(&pool->dirty, false);
+	spin_unlock(&pool->lock);
+
 	return page;
 }
 
 void *ion_page_pool_alloc(struct ion_page_pool *pool)
 {
+	struct ion_page_pool_cache *cache;
 	struct page *page = NULL;
+	bool dirty = false;
+	unsigned long flags;
 
 	BUG_ON(!pool);
 
-	mutex_lock(&pool->mutex);
-	if (pool->high_count)
-		page = ion_page_pool_remove(pool, true);
-	else if (pool->low_count)
-		page = ion_page_pool_remove(pool, false);
-	mutex_unlock(&pool->mutex);
+	local_irq_save(flags);
+	cache = this_cpu_ptr(pool->cache);
+	if (!cache->count)
+		ion_page_pool_refill(pool, cache);
+	if (cache->count) {
+		page = ion_page_pool_cache_pop(cache);
+	} else {
+		page = ion_page_pool_take_dirty(pool);
+		dirty = true;
+	}
+	local_irq_restore(flags);
 
 	if (!page)
 		page = ion_page_pool_alloc_pages(pool);
+	else if (dirty)
+		ion_page_pool_zero_page(pool, page);
 
 	return page;
 }
+EXPORT_SYMBOL(ion_page_pool_alloc);
+
+static void ion_page_pool_wake_zero_thread(void)
+{
+	/* pairs with the atomic_xchg() in ion_page_pool_zero_thread() */
+	atomic_set(&ion_page_pool_zero_pending, 1);
+	wake_up(&ion_page_pool_zero_wait);
+}
 
 void ion_page_pool_free(struct ion_page_pool *pool, struct page* page)
 {
-	int ret;
+	struct ion_page_pool_cache *cache;
+	bool flushed = false;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(pool->dirty_cache);
+	if (cache->count == pool->cache_batch) {
+		ion_page_pool_flush(pool, cache, &pool->dirty, cache->count);
+		flushed = true;
+	}
+	ion_page_pool_cache_push(cache, page);
+	local_irq_restore(flags);
+
+	if (flushed)
+		ion_page_pool_wake_zero_thread();
+}
+EXPORT_SYMBOL(ion_page_pool_free);
+
+int ion_page_pool_cache_count(struct ion_page_pool *pool, bool high,
+			      bool dirty)
+{
+	struct ion_page_pool_cache __percpu *caches;
+	int cpu, count = 0;
+
+	caches = dirty ? pool->dirty_cache : pool->cache;
+	/* racy, but only used for statistics and shrinker estimates */
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cache *cache;
+
+		cache = per_cpu_ptr(caches, cpu);
+		count += high ? cache->count :
+				cache->count - cache->high_count;
+	}
+
+	return count;
+}
 
-	ret = ion_page_pool_add(pool, page);
-	if (ret)
-		ion_page_pool_free_pages(pool, page);
+static int ion_page_pool_list_count(struct ion_page_pool_list *items,
+				    bool high)
+{
+	return high ? items->high_count + items->low_count : items->low_count;
 }
 
 static int ion_page_pool_total(struct ion_page_pool *pool, bool high)
 {
-	int total = 0;
+	int total;
+
+	total = ion_page_pool_cache_count(pool, high, false) +
+		ion_page_pool_cache_count(pool, high, true) +
+		ion_page_pool_list_count(&pool->clean, high) +
+		ion_page_pool_list_count(&pool->dirty, high);
+	return total << pool->order;
+}
+
+/*
+ * ion_page_pool_take - move up to 'nr' items from the shared lists 'items',
+ * highmem first if 'high', to 'pages'. Returns the number moved.
+ */
+static int ion_page_pool_take(struct ion_page_pool *pool,
+			      struct ion_page_pool_list *items, bool high,
+			      int nr, struct list_head *pages)
+{
+	int i;
 
-	total += high ? (pool->high_count + pool->low_count) *
-		(1 << pool->order) :
-			pool->low_count * (1 << pool->order);
-	return total;
+	spin_lock_irq(&pool->lock);
+	for (i = 0; i < nr; i++) {
+		struct page *page;
+
+		if (high && items->high_count)
+			page = ion_page_pool_remove(items, true);
+		else if (items->low_count)
+			page = ion_page_pool_remove(items, false);
+		else
+			break;
+		list_add(&page->lru, pages);
+	}
+	spin_unlock_irq(&pool->lock);
+
+	return i;
 }
 
 int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 				int nr_to_scan)
 {
+	bool drained = false;
 	int nr_freed = 0;
-	int i;
 	bool high;
 
 	high = gfp_mask & __GFP_HIGHMEM;
@@ -142,56 +379,205 @@ int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
 	if (nr_to_scan == 0)
 		return ion_page_pool_total(pool, high);
 
-	for (i = 0; i < nr_to_scan; i++) {
-		struct page *page;
+	while (nr_freed < nr_to_scan) {
+		struct page *page, *tmp;
+		LIST_HEAD(pages);
+		int nr;
+
+		nr = DIV_ROUND_UP(nr_to_scan - nr_freed, 1 << pool->order);
+		nr = min(nr, ION_PAGE_POOL_SHRINK_BATCH);
+		/* no point in zeroing what is about to be reclaimed */
+		nr = ion_page_pool_take(pool, &pool->dirty, high, nr, &pages) ?:
+		     ion_page_pool_take(pool, &pool->clean, high, nr, &pages);
+		if (!nr) {
+			/* the shared lists are empty, try the CPU caches once */
+			if (drained)
+				break;
+			on_each_cpu(ion_page_pool_drain_cpu, pool, 1);
+			drained = true;
+			continue;
+		}
 
-		mutex_lock(&pool->mutex);
-		if (high && pool->high_count) {
-			page = ion_page_pool_remove(pool, true);
-		} else if (pool->low_count) {
-			page = ion_page_pool_remove(pool, false);
-		} else {
-			mutex_unlock(&pool->mutex);
-			break;
+		list_for_each_entry_safe(page, tmp, &pages, lru) {
+			list_del(&page->lru);
+			ion_page_pool_free_pages(pool, page);
 		}
-		mutex_unlock(&pool->mutex);
-		ion_page_pool_free_pages(pool, page);
-		nr_freed += (1 << pool->order);
+		nr_freed += nr << pool->order;
 	}
 
 	return nr_freed;
 }
 
+/*
+ * ion_page_pool_zero_dirty - zero every dirty item of 'pool' and move it to
+ * the clean lists. Pages left in the per-CPU dirty caches are pulled in
+ * once the lists run dry, so a burst of frees never leaves pages behind
+ * that only a synchronous allocation would clear.
+ */
+static void ion_page_pool_zero_dirty(struct ion_page_pool *pool)
+{
+	bool drained = false;
+
+	while (!kthread_should_stop()) {
+		struct page *page, *tmp;
+		LIST_HEAD(pages);
+
+		if (!ion_page_pool_take(pool, &pool->dirty, true,
+					ION_PAGE_POOL_ZERO_BATCH, &pages)) {
+			if (drained ||
+			    !ion_page_pool_cache_count(pool, true, true))
+				break;
+			on_each_cpu(ion_page_pool_drain_dirty_cpu, pool, 1);
+			drained = true;
+			continue;
+		}
+
+		list_for_each_entry(page, &pages, lru) {
+			ion_page_pool_zero_page(pool, page);
+			cond_resched();
+		}
+
+		spin_lock_irq(&pool->lock);
+		list_for_each_entry_safe(page, tmp, &pages, lru) {
+			list_del(&page->lru);
+			ion_page_pool_add(&pool->clean, page);
+		}
+		spin_unlock_irq(&pool->lock);
+	}
+}
+
+static int ion_page_pool_zero_thread(void *data)
+{
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		struct ion_page_pool *pool;
+
+		wait_event_freezable(ion_page_pool_zero_wait,
+				     atomic_read(&ion_page_pool_zero_pending) ||
+				     kthread_should_stop());
+
+		/*
+		 * Full barrier: a free that flushes to a dirty list after we
+		 * have looked at it sets the flag again and we go round once
+		 * more.
+		 */
+		if (!atomic_xchg(&ion_page_pool_zero_pending, 0))
+			continue;
+
+		mutex_lock(&ion_page_pool_zero_lock);
+		list_for_each_entry(pool, &ion_page_pool_zero_pools, zero_list)
+			ion_page_pool_zero_dirty(pool);
+		mutex_unlock(&ion_page_pool_zero_lock);
+	}
+
+	return 0;
+}
+
 struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
 {
 	struct ion_page_pool *pool = kmalloc(sizeof(struct ion_page_pool),
 					     GFP_KERNEL);
 	if (!pool)
 		return NULL;
-	pool->high_count = 0;
-	pool->low_count = 0;
-	INIT_LIST_HEAD(&pool->low_items);
-	INIT_LIST_HEAD(&pool->high_items);
+	pool->cache = alloc_percpu(struct ion_page_pool_cache);
+	if (!pool->cache)
+		goto err_cache;
+	pool->dirty_cache = alloc_percpu(struct ion_page_pool_cache);
+	if (!pool->dirty_cache)
+		goto err_dirty_cache;
+	pool->cache_batch = clamp_t(int, (ION_PAGE_POOL_CACHE_BYTES >>
+					  PAGE_SHIFT) >> order,
+				    1, ION_PAGE_POOL_CACHE_MAX);
+	ion_page_pool_list_init(&pool->clean);
+	ion_page_pool_list_init(&pool->dirty);
 	pool->gfp_mask = gfp_mask;
 	pool->order = order;
-	mutex_init(&pool->mutex);
+	spin_lock_init(&pool->lock);
 	plist_node_init(&pool->list, order);
 
+	mutex_lock(&ion_page_pool_zero_lock);
+	list_add_tail(&pool->zero_list, &ion_page_pool_zero_pools);
+	mutex_unlock(&ion_page_pool_zero_lock);
+
 	return pool;
+
+err_dirty_cache:
+	free_percpu(pool->cache);
+err_cache:
+	kfree(pool);
+	return NULL;
+}
+EXPORT_SYMBOL(ion_page_pool_create);
+
+static void ion_page_pool_destroy_cache(struct ion_page_pool *pool,
+				struct ion_page_pool_cache __percpu *caches)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ion_page_pool_cache *cache;
+
+		cache = per_cpu_ptr(caches, cpu);
+		while (cache->count)
+			ion_page_pool_free_pages(pool,
+				ion_page_pool_cache_pop(cache));
+	}
+	free_percpu(caches);
+}
+
+static void ion_page_pool_destroy_list(struct ion_page_pool *pool,
+				       struct ion_page_pool_list *items)
+{
+	while (items->high_count)
+		ion_page_pool_free_pages(pool,
+			ion_page_pool_remove(items, true));
+	while (items->low_count)
+		ion_page_pool_free_pages(pool,
+			ion_page_pool_remove(items, false));
 }
 
 void ion_page_pool_destroy(struct ion_page_pool *pool)
 {
+	/* once off the list the zeroing thread no longer looks at the pool */
+	mutex_lock(&ion_page_pool_zero_lock);
+	list_del(&pool->zero_list);
+	mutex_unlock(&ion_page_pool_zero_lock);
+
+	/* nobody uses the pool anymore, so the caches can be emptied here */
+	ion_page_pool_destroy_cache(pool, pool->cache);
+	ion_page_pool_destroy_cache(pool, pool->dirty_cache);
+	ion_page_pool_destroy_list(pool, &pool->clean);
+	ion_page_pool_destroy_list(pool, &pool->dirty);
 	kfree(pool);
 }
+EXPORT_SYMBOL(ion_page_pool_destroy);
 
 static int __init ion_page_pool_init(void)
 {
+	struct sched_param param = { .sched_priority = 0 };
+	struct task_struct *task;
+
+	/*
+	 * Without the thread nothing is lost, allocations just zero dirty
+	 * pages themselves.
+	 */
+	task = kthread_create(ion_page_pool_zero_thread, NULL, "ion_pool_zero");
+	if (IS_ERR(task)) {
+		pr_err("%s: creating thread for page zeroing failed\n",
+		       __func__);
+		return 0;
+	}
+	sched_setscheduler(task, SCHED_IDLE, &param);
+	ion_page_pool_zero_task = task;
+	wake_up_process(task);
 	return 0;
 }
 
 static void __exit ion_page_pool_exit(void)
 {
+	if (ion_page_pool_zero_task)
+		kthread_stop(ion_page_pool_zero_task);
 }
 
 module_init(ion_page_pool_init);
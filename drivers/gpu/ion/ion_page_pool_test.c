@@ -0,0 +1,187 @@
+/*
+ * drivers/gpu/ion/ion_page_pool_test.c
+ *
+ * Page pool self-test: allocates and frees ion-sized buffers from the page
+ * pools on several threads at once and reports the throughput.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/err.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include "ion_priv.h"
+
+static int threads;
+module_param(threads, int, 0444);
+MODULE_PARM_DESC(threads, "allocating threads, default one per online cpu");
+
+static int buffers = 32;
+module_param(buffers, int, 0444);
+MODULE_PARM_DESC(buffers, "buffers each thread allocates and frees");
+
+static int buffer_mb = 8;
+module_param(buffer_mb, int, 0444);
+MODULE_PARM_DESC(buffer_mb, "size of each buffer in megabytes");
+
+/* the orders and gfp flags of the system heap's pools */
+static const unsigned int orders[] = {8, 4, 0};
+static struct ion_page_pool *pools[ARRAY_SIZE(orders)];
+
+static atomic_t running;
+static atomic_t failed;
+static DECLARE_COMPLETION(done);
+
+/* allocate 'size' bytes largest pages first, like the system heap does */
+static int ion_pool_test_alloc(struct list_head *pages, size_t size)
+{
+	while (size) {
+		struct page *page = NULL;
+		int i;
+
+		for (i = 0; i < ARRAY_SIZE(orders); i++) {
+			if (size < PAGE_SIZE << orders[i])
+				continue;
+			page = ion_page_pool_alloc(pools[i]);
+			if (page)
+				break;
+		}
+		if (!page)
+			return -ENOMEM;
+
+		set_page_private(page, i);
+		list_add_tail(&page->lru, pages);
+		size -= PAGE_SIZE << orders[i];
+	}
+
+	return 0;
+}
+
+static void ion_pool_test_free(struct list_head *pages)
+{
+	struct page *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, pages, lru) {
+		int i = page_private(page);
+
+		list_del(&page->lru);
+		set_page_private(page, 0);
+		ion_page_pool_free(pools[i], page);
+	}
+}
+
+static int ion_pool_test_thread(void *unused)
+{
+	LIST_HEAD(pages);
+	int i;
+
+	for (i = 0; i < buffers; i++) {
+		int ret = ion_pool_test_alloc(&pages, (size_t)buffer_mb << 20);
+
+		ion_pool_test_free(&pages);
+		if (ret) {
+			atomic_inc(&failed);
+			break;
+		}
+	}
+
+	if (atomic_dec_and_test(&running))
+		complete(&done);
+
+	return 0;
+}
+
+/* run one round on 'threads' threads, returns throughput in MB/s */
+static u64 ion_pool_test_round(void)
+{
+	ktime_t start;
+	s64 us;
+	int i;
+
+	INIT_COMPLETION(done);
+	atomic_set(&running, threads);
+	start = ktime_get();
+	for (i = 0; i < threads; i++) {
+		struct task_struct *task;
+
+		task = kthread_run(ion_pool_test_thread, NULL,
+				   "ion_pool_test/%d", i);
+		if (IS_ERR(task)) {
+			atomic_inc(&failed);
+			if (atomic_dec_and_test(&running))
+				complete(&done);
+		}
+	}
+	wait_for_completion(&done);
+	us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	return div64_u64((u64)threads * buffers * buffer_mb * USEC_PER_SEC,
+			 max_t(s64, us, 1));
+}
+
+static int __init ion_pool_test_init(void)
+{
+	gfp_t high_order_gfp_flags = (GFP_HIGHUSER | __GFP_ZERO |
+				      __GFP_NOWARN | __GFP_NORETRY |
+				      __GFP_NO_KSWAPD) & ~__GFP_WAIT;
+	gfp_t low_order_gfp_flags = GFP_HIGHUSER | __GFP_ZERO | __GFP_NOWARN;
+	u64 cold, warm;
+	int ret = 0;
+	int i;
+
+	if (threads <= 0)
+		threads = num_online_cpus();
+	if (buffers <= 0 || buffer_mb <= 0)
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(orders); i++) {
+		pools[i] = ion_page_pool_create(orders[i] > 4 ?
+						high_order_gfp_flags :
+						low_order_gfp_flags,
+						orders[i]);
+		if (!pools[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/* the first round fills the pools, the second one runs from them */
+	cold = ion_pool_test_round();
+	warm = ion_pool_test_round();
+	pr_info("ion_page_pool_test: %d threads x %d buffers of %dMB: "
+		"%llu MB/s from empty pools, %llu MB/s from filled pools\n",
+		threads, buffers, buffer_mb, cold, warm);
+	if (atomic_read(&failed)) {
+		pr_err("ion_page_pool_test: %d threads failed\n",
+		       atomic_read(&failed));
+		ret = -ENOMEM;
+	}
+
+out:
+	for (i = 0; i < ARRAY_SIZE(orders); i++)
+		if (pools[i])
+			ion_page_pool_destroy(pools[i]);
+	return ret;
+}
+
+static void __exit ion_pool_test_exit(void)
+{
+}
+
+module_init(ion_pool_test_init);
+module_exit(ion_pool_test_exit);
+
+MODULE_LICENSE("GPL");
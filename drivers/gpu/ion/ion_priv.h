@@ -24,6 +24,7 @@
 #include <linux/rbtree.h>
 #include <linux/sched.h>
 #include <linux/shrinker.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 
 struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
@@ -308,37 +309,70 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * invalidated from the cache, provides a significant peformance benefit on
  * many systems */
 
+/* size of the per-CPU page cache array in each pool */
+#define ION_PAGE_POOL_CACHE_MAX		64
+
 /**
- * struct ion_page_pool - pagepool struct
- * @high_count:		number of highmem items in the pool
- * @low_count:		number of lowmem items in the pool
+ * struct ion_page_pool_cache - per-CPU cache of pages in front of a pool
+ * @count:		number of pages in the cache
+ * @high_count:		how many of them are highmem
+ * @pages:		the pages, most recently freed last
+ */
+struct ion_page_pool_cache {
+	int count;
+	int high_count;
+	struct page *pages[ION_PAGE_POOL_CACHE_MAX];
+};
+
+/**
+ * struct ion_page_pool_list - items of a pool in one state
+ * @high_count:		number of highmem items
+ * @low_count:		number of lowmem items
  * @high_items:		list of highmem items
  * @low_items:		list of lowmem items
- * @shrinker:		a shrinker for the items
- * @mutex:		lock protecting this struct and especially the count
- *			item list
- * @alloc:		function to be used to allocate pageory when the pool
- *			is empty
- * @free:		function to be used to free pageory back to the system
- *			when the shrinker fires
+ */
+struct ion_page_pool_list {
+	int high_count;
+	int low_count;
+	struct list_head high_items;
+	struct list_head low_items;
+};
+
+/**
+ * struct ion_page_pool - pagepool struct
+ * @clean:		items that are zeroed and ready for dma
+ * @dirty:		freed items still waiting to be zeroed
+ * @lock:		lock protecting this struct and especially the count
+ *			item list, always taken with interrupts disabled
+ * @cache:		per-CPU caches of clean items in front of the lists
+ * @dirty_cache:	per-CPU caches of freed items in front of the lists
+ * @cache_batch:	most pages a per-CPU cache holds, all of which are
+ *			moved between the cache and the lists at once
  * @gfp_mask:		gfp_mask to use from alloc
  * @order:		order of pages in the pool
  * @list:		plist node for list of pools
+ * @zero_list:		entry in the list of pools the zeroing thread scans
  *
  * Allows you to keep a pool of pre allocated pages to use from your heap.
  * Keeping a pool of pages that is ready for dma, ie any cached mapping have
  * been invalidated from the cache, provides a significant peformance benefit
- * on many systems
+ * on many systems.
+ *
+ * Freed items go on the dirty lists and a low priority thread zeroes them
+ * and moves them to the clean lists, so neither freeing nor allocating has
+ * to clear memory unless the thread falls behind.
  */
 struct ion_page_pool {
-	int high_count;
-	int low_count;
-	struct list_head high_items;
-	struct list_head low_items;
-	struct mutex mutex;
+	struct ion_page_pool_list clean;
+	struct ion_page_pool_list dirty;
+	spinlock_t lock;
+	struct ion_page_pool_cache __percpu *cache;
+	struct ion_page_pool_cache __percpu *dirty_cache;
+	int cache_batch;
 	gfp_t gfp_mask;
 	unsigned int order;
 	struct plist_node list;
+	struct list_head zero_list;
 };
 
 struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
@@ -346,11 +380,23 @@ void ion_page_pool_destroy(struct ion_page_pool *);
 void *ion_page_pool_alloc(struct ion_page_pool *);
 void ion_page_pool_free(struct ion_page_pool *, struct page *);
 
+/** ion_page_pool_cache_count - number of items in the per-CPU caches
+ * @pool:		the pool
+ * @high:		count highmem items as well as lowmem ones
+ * @dirty:		count the items waiting to be zeroed instead of the
+ *			clean ones
+ */
+int ion_page_pool_cache_count(struct ion_page_pool *pool, bool high,
+			      bool dirty);
+
 /** ion_page_pool_shrink - shrinks the size of the memory cached in the pool
  * @pool:		the pool
  * @gfp_mask:		the memory type to reclaim
  * @nr_to_scan:		number of items to shrink in pages
  *
+ * Frees items in batches, dirty ones first, and empties the per-CPU caches
+ * once the item lists run out.
+ *
  * returns the number of items freed in pages
  */
 int ion_page_pool_shrink(struct ion_page_pool *pool, gfp_t gfp_mask,
@@ -63,11 +63,13 @@ static struct page *alloc_buffer_page(struct ion_system_heap *heap,
 				      struct ion_buffer *buffer,
 				      unsigned long order)
 {
-	bool cached = ion_buffer_cached(buffer);
+	bool split_pages = ion_buffer_fault_user_mappings(buffer);
 	struct ion_page_pool *pool = heap->pools[order_to_index(order)];
 	struct page *page;
 
-	if (!cached) {
+	/* pool pages are zeroed in the background, split ones can't be
+	   pooled and are zeroed by the page allocator */
+	if (!split_pages) {
 		page = ion_page_pool_alloc(pool);
 	} else {
 		gfp_t gfp_flags = low_order_gfp_flags;
@@ -90,18 +92,15 @@ static void free_buffer_page(struct ion_system_heap *heap,
 			     struct ion_buffer *buffer, struct page *page,
 			     unsigned int order)
 {
-	bool cached = ion_buffer_cached(buffer);
 	bool split_pages = ion_buffer_fault_user_mappings(buffer);
 	int i;
 
-	if (!cached) {
+	if (!split_pages) {
 		struct ion_page_pool *pool = heap->pools[order_to_index(order)];
 		ion_page_pool_free(pool, page);
-	} else if (split_pages) {
+	} else {
 		for (i = 0; i < (1 << order); i++)
 			__free_page(page + i);
-	} else {
-		__free_pages(page, order);
 	}
 }
 
@@ -197,16 +196,12 @@ void ion_system_heap_free(struct ion_buffer *buffer)
 							struct ion_system_heap,
 							heap);
 	struct sg_table *table = buffer->sg_table;
-	bool cached = ion_buffer_cached(buffer);
 	struct scatterlist *sg;
 	LIST_HEAD(pages);
 	int i;
 
-	/* uncached pages come from the page pools, zero them before returning
-	   for security purposes (other allocations are zerod at alloc time */
-	if (!cached)
-		ion_heap_buffer_zero(buffer);
-
+	/* pages going back to the pools are zeroed there before they are
+	   handed out again, the rest were zeroed at alloc time */
 	for_each_sg(table->sgl, sg, table->nents, i)
 		free_buffer_page(sys_heap, buffer, sg_page(sg),
 				get_order(sg_dma_len(sg)));
@@ -280,6 +275,15 @@ end:
 
 }
 
+static void ion_system_heap_show_pool(struct seq_file *s,
+				      struct ion_page_pool *pool,
+				      const char *what, int count)
+{
+	seq_printf(s, "%d order %u %s pages in pool = %lu total\n",
+		   count, pool->order, what,
+		   (1 << pool->order) * PAGE_SIZE * count);
+}
+
 static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 				      void *unused)
 {
@@ -290,12 +294,19 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 	int i;
 	for (i = 0; i < num_orders; i++) {
 		struct ion_page_pool *pool = sys_heap->pools[i];
-		seq_printf(s, "%d order %u highmem pages in pool = %lu total\n",
-			   pool->high_count, pool->order,
-			   (1 << pool->order) * PAGE_SIZE * pool->high_count);
-		seq_printf(s, "%d order %u lowmem pages in pool = %lu total\n",
-			   pool->low_count, pool->order,
-			   (1 << pool->order) * PAGE_SIZE * pool->low_count);
+
+		ion_system_heap_show_pool(s, pool, "clean highmem",
+					  pool->clean.high_count);
+		ion_system_heap_show_pool(s, pool, "clean lowmem",
+					  pool->clean.low_count);
+		ion_system_heap_show_pool(s, pool, "dirty highmem",
+					  pool->dirty.high_count);
+		ion_system_heap_show_pool(s, pool, "dirty lowmem",
+					  pool->dirty.low_count);
+		ion_system_heap_show_pool(s, pool, "clean per-cpu cached",
+				ion_page_pool_cache_count(pool, true, false));
+		ion_system_heap_show_pool(s, pool, "dirty per-cpu cached",
+				ion_page_pool_cache_count(pool, true, true));
 	}
 	return 0;
 }
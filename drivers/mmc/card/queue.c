@@ -292,6 +292,52 @@ int mmc_init_queue(struct mmc_queue *mq, struct mmc_card *card,
 	return ret;
 }
 
+static void mmc_packed_clean(struct mmc_queue *mq)
+{
+	struct mmc_queue_req *mqrq_cur = &mq->mqrq[0];
+	struct mmc_queue_req *mqrq_prev = &mq->mqrq[1];
+
+	kfree(mqrq_cur->packed);
+	mqrq_cur->packed = NULL;
+	kfree(mqrq_prev->packed);
+	mqrq_prev->packed = NULL;
+}
+
+/**
+ * mmc_packed_init - allocate the packed command state of a queue
+ * @mq: mmc queue
+ * @card: card the queue belongs to
+ *
+ * Each of the two queue slots gets its own packed header and request
+ * list so that a packed write can be prepared while the previous one
+ * is still on the bus.
+ */
+int mmc_packed_init(struct mmc_queue *mq, struct mmc_card *card)
+{
+	struct mmc_queue_req *mqrq_cur = &mq->mqrq[0];
+	struct mmc_queue_req *mqrq_prev = &mq->mqrq[1];
+
+	mqrq_cur->packed = kzalloc(sizeof(struct mmc_packed), GFP_KERNEL);
+	if (!mqrq_cur->packed) {
+		pr_warning("%s: unable to allocate packed cmd for mqrq_cur\n",
+			   mmc_card_name(card));
+		return -ENOMEM;
+	}
+
+	mqrq_prev->packed = kzalloc(sizeof(struct mmc_packed), GFP_KERNEL);
+	if (!mqrq_prev->packed) {
+		pr_warning("%s: unable to allocate packed cmd for mqrq_prev\n",
+			   mmc_card_name(card));
+		mmc_packed_clean(mq);
+		return -ENOMEM;
+	}
+
+	INIT_LIST_HEAD(&mqrq_cur->packed->list);
+	INIT_LIST_HEAD(&mqrq_prev->packed->list);
+
+	return 0;
+}
+
 void mmc_cleanup_queue(struct mmc_queue *mq)
 {
 	struct request_queue *q = mq->queue;
@@ -329,6 +375,8 @@ void mmc_cleanup_queue(struct mmc_queue *mq)
 	kfree(mqrq_prev->bounce_buf);
 	mqrq_prev->bounce_buf = NULL;
 
+	mmc_packed_clean(mq);
+
 	mq->card = NULL;
 }
 EXPORT_SYMBOL(mmc_cleanup_queue);
@@ -377,6 +425,43 @@ void mmc_queue_resume(struct mmc_queue *mq)
 	}
 }
 
+/*
+ * Map a packed write: the header block goes first, followed by the
+ * data of every request on the packed list in order.
+ */
+static unsigned int mmc_queue_packed_map_sg(struct mmc_queue *mq,
+					    struct mmc_packed *packed,
+					    struct scatterlist *sg)
+{
+	struct scatterlist *__sg = sg;
+	unsigned int sg_len = 0;
+	struct request *req;
+
+	sg_set_buf(__sg, packed->cmd_hdr, sizeof(packed->cmd_hdr));
+	__sg->page_link &= ~0x02;
+	sg_len++;
+
+	list_for_each_entry(req, &packed->list, queuelist) {
+		sg_len += blk_rq_map_sg(mq->queue, req, sg + sg_len);
+		/* blk_rq_map_sg() terminated the list, undo that */
+		__sg = sg + sg_len - 1;
+		__sg->page_link &= ~0x02;
+	}
+	sg_mark_end(sg + sg_len - 1);
+
+	return sg_len;
+}
+
+static unsigned int mmc_queue_do_map_sg(struct mmc_queue *mq,
+					struct mmc_queue_req *mqrq,
+					struct scatterlist *sg)
+{
+	if (mmc_packed_cmd(mqrq->cmd_type))
+		return mmc_queue_packed_map_sg(mq, mqrq->packed, sg);
+
+	return blk_rq_map_sg(mq->queue, mqrq->req, sg);
+}
+
 /*
  * Prepare the sg list(s) to be handed of to the host driver
  */
@@ -388,11 +473,11 @@ unsigned int mmc_queue_map_sg(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
 	int i;
 
 	if (!mqrq->bounce_buf)
-		return blk_rq_map_sg(mq->queue, mqrq->req, mqrq->sg);
+		return mmc_queue_do_map_sg(mq, mqrq, mqrq->sg);
 
 	BUG_ON(!mqrq->bounce_sg);
 
-	sg_len = blk_rq_map_sg(mq->queue, mqrq->req, mqrq->bounce_sg);
+	sg_len = mmc_queue_do_map_sg(mq, mqrq, mqrq->bounce_sg);
 
 	mqrq->bounce_sg_len = sg_len;
 
@@ -241,6 +241,10 @@ struct mmc_card *mmc_alloc_card(struct mmc_host *host, struct device_type *type)
 		return ERR_PTR(-ENOMEM);
 
 	card->host = host;
+	spin_lock_init(&card->wr_pack_stats.lock);
+	spin_lock_init(&card->bkops_info.stats.lock);
+	INIT_DELAYED_WORK(&card->bkops_info.dw, mmc_bkops_work);
+	card->bkops_info.delay_ms = MMC_BKOPS_IDLE_DELAY_MS;
 
 	device_initialize(&card->dev);
 
@@ -26,6 +26,7 @@
 #include <linux/suspend.h>
 #include <linux/fault-inject.h>
 #include <linux/random.h>
+#include <linux/slab.h>
 #include <linux/wakelock.h>
 
 #include <trace/events/mmc.h>
@@ -355,8 +356,22 @@ struct mmc_async_req *mmc_start_req(struct mmc_host *host,
 		mmc_pre_req(host, areq->mrq, !host->areq);
 
 	if (host->areq) {
+		struct mmc_command *cmd = host->areq->mrq->cmd;
+
 		mmc_wait_for_req_done(host, host->areq->mrq);
 		err = host->areq->err_check(host->card, host->areq);
+
+		/*
+		 * The card raises the exception event in R1 when it is
+		 * running out of clean blocks.  Let it catch up before
+		 * the next request rather than in the middle of it.
+		 */
+		if (!err && host->card && mmc_card_mmc(host->card) &&
+		    host->card->ext_csd.bkops_en &&
+		    (mmc_resp_type(cmd) == MMC_RSP_R1 ||
+		     mmc_resp_type(cmd) == MMC_RSP_R1B) &&
+		    (cmd->resp[0] & R1_EXCEPTION_EVENT))
+			mmc_start_bkops(host->card, true);
 	}
 
 	if (!err && areq) {
@@ -457,6 +472,215 @@ out:
 }
 EXPORT_SYMBOL(mmc_interrupt_hpi);
 
+/*
+ * Background operations
+ *
+ * A card that runs out of clean blocks garbage collects inside
+ * whichever write needs the space, and that write stalls for as long
+ * as it takes.  BKOPS let the host choose the moment instead: the block
+ * driver starts them once its queue has been idle for
+ * bkops_info.delay_ms and stops them with HPI as soon as the next
+ * request arrives.  When the card flags them urgent through the
+ * exception event they are run to completion straight away.
+ */
+#define MMC_BKOPS_MAX_TIMEOUT	(4 * 60 * 1000)	/* max time to wait in ms */
+
+static void mmc_bkops_account(struct mmc_card *card, ktime_t start,
+			      unsigned long *counter)
+{
+	struct mmc_bkops_stats *stats = &card->bkops_info.stats;
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&stats->lock);
+	(*counter)++;
+	stats->total_ns += ns;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+	spin_unlock(&stats->lock);
+}
+
+/**
+ *	mmc_read_bkops_status - refresh the card's BKOPS level
+ *	@card: MMC card to check
+ *
+ *	Reads EXT_CSD into card->ext_csd.raw_bkops_status.  The caller
+ *	must have claimed the host.
+ */
+int mmc_read_bkops_status(struct mmc_card *card)
+{
+	int err;
+	u8 *ext_csd;
+
+	ext_csd = kmalloc(512, GFP_KERNEL);
+	if (!ext_csd)
+		return -ENOMEM;
+
+	err = mmc_send_ext_csd(card, ext_csd);
+	if (!err)
+		card->ext_csd.raw_bkops_status =
+			ext_csd[EXT_CSD_BKOPS_STATUS] & 0x3;
+
+	kfree(ext_csd);
+	return err;
+}
+EXPORT_SYMBOL(mmc_read_bkops_status);
+
+/**
+ *	mmc_start_bkops - start BKOPS if the card wants them
+ *	@card: MMC card to start BKOPS on
+ *	@from_exception: called because the card raised an exception
+ *
+ *	Urgent BKOPS (level 2 and up) are waited for with the busy
+ *	signal, since the card would otherwise do the same work in the
+ *	middle of a later write.  Anything less is only worth starting
+ *	on an idle card that can be interrupted with HPI, and is left
+ *	running with MMC_STATE_DOING_BKOPS set.  The caller must have
+ *	claimed the host.
+ */
+void mmc_start_bkops(struct mmc_card *card, bool from_exception)
+{
+	struct mmc_bkops_stats *stats = &card->bkops_info.stats;
+	unsigned int level;
+	ktime_t start;
+	bool urgent;
+	int err;
+
+	BUG_ON(!card);
+
+	if (!card->ext_csd.bkops_en || mmc_card_doing_bkops(card))
+		return;
+
+	err = mmc_read_bkops_status(card);
+	if (err) {
+		pr_err("%s: failed to read BKOPS status: %d\n",
+		       mmc_hostname(card->host), err);
+		return;
+	}
+
+	level = card->ext_csd.raw_bkops_status;
+	if (!level)
+		return;
+
+	urgent = level >= EXT_CSD_BKOPS_LEVEL_2;
+	if (!urgent && (from_exception || !card->ext_csd.hpi_en))
+		return;
+
+	start = ktime_get();
+	err = __mmc_switch(card, EXT_CSD_CMD_SET_NORMAL, EXT_CSD_BKOPS_START,
+			   1, urgent ? MMC_BKOPS_MAX_TIMEOUT : 0, urgent);
+	if (err) {
+		pr_warning("%s: error %d starting BKOPS\n",
+			   mmc_hostname(card->host), err);
+		return;
+	}
+
+	spin_lock(&stats->lock);
+	stats->level[level]++;
+	spin_unlock(&stats->lock);
+
+	if (urgent) {
+		mmc_bkops_account(card, start, &stats->urgent);
+	} else {
+		spin_lock(&stats->lock);
+		stats->manual++;
+		spin_unlock(&stats->lock);
+		card->bkops_info.start = start;
+		mmc_card_set_doing_bkops(card);
+	}
+}
+EXPORT_SYMBOL(mmc_start_bkops);
+
+/**
+ *	mmc_stop_bkops - make the card available for requests
+ *	@card: MMC card to stop BKOPS on
+ *
+ *	Cancels a pending idle start and interrupts running BKOPS with
+ *	HPI.  The card keeps whatever it has reclaimed so far.  The
+ *	caller must have claimed the host.
+ */
+int mmc_stop_bkops(struct mmc_card *card)
+{
+	struct mmc_bkops_stats *stats = &card->bkops_info.stats;
+	unsigned long *counter;
+	u32 status;
+	int err;
+
+	BUG_ON(!card);
+
+	cancel_delayed_work(&card->bkops_info.dw);
+
+	if (!mmc_card_doing_bkops(card))
+		return 0;
+
+	err = mmc_send_status(card, &status);
+	if (!err && R1_CURRENT_STATE(status) == R1_STATE_PRG) {
+		err = mmc_interrupt_hpi(card);
+		counter = &stats->hpi;
+	} else {
+		counter = &stats->completed;
+	}
+
+	if (err)
+		pr_err("%s: error %d stopping BKOPS\n",
+		       mmc_hostname(card->host), err);
+
+	mmc_bkops_account(card, card->bkops_info.start, counter);
+	mmc_card_clr_doing_bkops(card);
+	return err;
+}
+EXPORT_SYMBOL(mmc_stop_bkops);
+
+/**
+ *	mmc_start_idle_bkops - start BKOPS once the card has been idle
+ *	@card: MMC card whose queue just went idle
+ *
+ *	Arms the idle timer.  Any request that comes in before it fires
+ *	goes through mmc_stop_bkops(), which disarms it again.
+ */
+void mmc_start_idle_bkops(struct mmc_card *card)
+{
+	struct mmc_bkops_info *info = &card->bkops_info;
+
+	if (!card->ext_csd.bkops_en || !card->ext_csd.hpi_en ||
+	    !info->delay_ms)
+		return;
+
+	queue_delayed_work(system_nrt_wq, &info->dw,
+			   msecs_to_jiffies(info->delay_ms));
+}
+EXPORT_SYMBOL(mmc_start_idle_bkops);
+
+void mmc_bkops_work(struct work_struct *work)
+{
+	struct mmc_bkops_info *info = container_of(to_delayed_work(work),
+						   struct mmc_bkops_info, dw);
+	struct mmc_card *card = container_of(info, struct mmc_card,
+					     bkops_info);
+	struct mmc_host *host = card->host;
+	u32 status;
+
+	/* Whoever holds the host is using the card, so it is not idle */
+	if (!mmc_try_claim_host(host))
+		return;
+
+	if (mmc_card_doing_bkops(card)) {
+		/* Poll, so the time is accounted when the card finishes */
+		if (mmc_send_status(card, &status) ||
+		    R1_CURRENT_STATE(status) != R1_STATE_PRG) {
+			mmc_bkops_account(card, info->start,
+					  &info->stats.completed);
+			mmc_card_clr_doing_bkops(card);
+		}
+	} else if (!mmc_card_is_sleep(card)) {
+		mmc_start_bkops(card, false);
+	}
+
+	if (mmc_card_doing_bkops(card))
+		queue_delayed_work(system_nrt_wq, &info->dw,
+				   msecs_to_jiffies(MMC_BKOPS_POLL_MS));
+	mmc_release_host(host);
+}
+
 /**
  *	mmc_wait_for_cmd - start a command and wait for completion
  *	@host: MMC host to start command
@@ -2334,6 +2558,43 @@ EXPORT_SYMBOL(mmc_cache_ctrl);
 
 #ifdef CONFIG_PM
 
+/*
+ * Nothing may be left running when the card is put to sleep, and
+ * urgent BKOPS are better done now than in the first write after
+ * resume.
+ */
+static int mmc_suspend_bkops(struct mmc_card *card)
+{
+	struct mmc_bkops_stats *stats = &card->bkops_info.stats;
+	int err;
+
+	if (!card->ext_csd.bkops_en)
+		return 0;
+
+	cancel_delayed_work_sync(&card->bkops_info.dw);
+
+	mmc_claim_host(card->host);
+	err = mmc_stop_bkops(card);
+	if (err)
+		goto out;
+
+	if (mmc_read_bkops_status(card)) {
+		pr_warning("%s: failed to read BKOPS status\n",
+			   mmc_hostname(card->host));
+		goto out;
+	}
+
+	if (card->ext_csd.raw_bkops_status >= EXT_CSD_BKOPS_LEVEL_2) {
+		spin_lock(&stats->lock);
+		stats->suspend++;
+		spin_unlock(&stats->lock);
+		mmc_start_bkops(card, true);
+	}
+out:
+	mmc_release_host(card->host);
+	return err;
+}
+
 /**
  *	mmc_suspend_host - suspend a host
  *	@host: mmc host
@@ -2349,6 +2610,12 @@ int mmc_suspend_host(struct mmc_host *host)
 		wake_unlock(&host->detect_wake_lock);
 	mmc_flush_scheduled_work();
 
+	if (host->card && mmc_card_mmc(host->card)) {
+		err = mmc_suspend_bkops(host->card);
+		if (err)
+			goto out;
+	}
+
 	err = mmc_cache_ctrl(host, 0);
 	if (err)
 		goto out;
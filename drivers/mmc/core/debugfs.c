@@ -318,6 +318,149 @@ static const struct file_operations mmc_dbg_ext_csd_fops = {
 	.llseek		= default_llseek,
 };
 
+static const char *const mmc_pack_stop_names[MMC_PACK_STOP_NR] = {
+	[MMC_PACK_STOP_SEGMENTS]	= "exceeds max segments",
+	[MMC_PACK_STOP_SECTORS]		= "exceeds max sectors",
+	[MMC_PACK_STOP_DATA_DIR]	= "wrong data direction",
+	[MMC_PACK_STOP_FLUSH_DISCARD]	= "flush or discard",
+	[MMC_PACK_STOP_EMPTY_QUEUE]	= "empty queue",
+	[MMC_PACK_STOP_REL_WRITE]	= "reliable write",
+	[MMC_PACK_STOP_MAX_ENTRIES]	= "max packed entries",
+};
+
+static int mmc_wr_pack_stats_show(struct seq_file *s, void *data)
+{
+	struct mmc_card *card = s->private;
+	struct mmc_wr_pack_stats *stats = &card->wr_pack_stats;
+	int i;
+
+	spin_lock(&stats->lock);
+
+	seq_printf(s, "max packed writes: %u\n",
+		   card->ext_csd.max_packed_writes);
+	seq_printf(s, "packed event enabled: %d\n",
+		   card->ext_csd.packed_event_en);
+
+	seq_printf(s, "\nrequests per write:\n");
+	for (i = 1; i <= MMC_PACKED_NR_MAX; i++)
+		if (stats->packing_events[i])
+			seq_printf(s, "%8d: %lu\n", i,
+				   stats->packing_events[i]);
+
+	seq_printf(s, "\npacking stopped by:\n");
+	for (i = 0; i < MMC_PACK_STOP_NR; i++)
+		seq_printf(s, "%24s: %lu\n", mmc_pack_stop_names[i],
+			   stats->stop_reason[i]);
+
+	seq_printf(s, "\nfailed packed writes: %lu\n", stats->failures);
+	seq_printf(s, "packed write retries: %lu\n", stats->retries);
+
+	spin_unlock(&stats->lock);
+
+	return 0;
+}
+
+static int mmc_wr_pack_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_wr_pack_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters */
+static ssize_t mmc_wr_pack_stats_write(struct file *file,
+				       const char __user *ubuf,
+				       size_t cnt, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct mmc_card *card = s->private;
+	struct mmc_wr_pack_stats *stats = &card->wr_pack_stats;
+
+	spin_lock(&stats->lock);
+	memset(stats->packing_events, 0, sizeof(stats->packing_events));
+	memset(stats->stop_reason, 0, sizeof(stats->stop_reason));
+	stats->failures = 0;
+	stats->retries = 0;
+	spin_unlock(&stats->lock);
+
+	return cnt;
+}
+
+static const struct file_operations mmc_dbg_wr_pack_stats_fops = {
+	.open		= mmc_wr_pack_stats_open,
+	.read		= seq_read,
+	.write		= mmc_wr_pack_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int mmc_bkops_stats_show(struct seq_file *s, void *data)
+{
+	struct mmc_card *card = s->private;
+	struct mmc_bkops_stats *stats = &card->bkops_info.stats;
+	int i;
+
+	spin_lock(&stats->lock);
+
+	seq_printf(s, "bkops supported: %d\n", card->ext_csd.bkops);
+	seq_printf(s, "bkops enabled: %d\n", card->ext_csd.bkops_en);
+	seq_printf(s, "idle delay: %u ms\n", card->bkops_info.delay_ms);
+	seq_printf(s, "running: %d\n", !!mmc_card_doing_bkops(card));
+
+	seq_printf(s, "\nstarted on idle: %lu\n", stats->manual);
+	seq_printf(s, "urgent: %lu\n", stats->urgent);
+	seq_printf(s, "urgent before suspend: %lu\n", stats->suspend);
+	seq_printf(s, "stopped by HPI: %lu\n", stats->hpi);
+	seq_printf(s, "completed on idle: %lu\n", stats->completed);
+
+	seq_printf(s, "\nlevel when started:\n");
+	for (i = 1; i < ARRAY_SIZE(stats->level); i++)
+		seq_printf(s, "%8d: %lu\n", i, stats->level[i]);
+
+	seq_printf(s, "\ntime in bkops: %llu us\n",
+		   div_u64(stats->total_ns, NSEC_PER_USEC));
+	seq_printf(s, "longest bkops: %llu us\n",
+		   div_u64(stats->max_ns, NSEC_PER_USEC));
+
+	spin_unlock(&stats->lock);
+
+	return 0;
+}
+
+static int mmc_bkops_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_bkops_stats_show, inode->i_private);
+}
+
+/* Any write clears the counters */
+static ssize_t mmc_bkops_stats_write(struct file *file,
+				     const char __user *ubuf,
+				     size_t cnt, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct mmc_card *card = s->private;
+	struct mmc_bkops_stats *stats = &card->bkops_info.stats;
+
+	spin_lock(&stats->lock);
+	stats->manual = 0;
+	stats->urgent = 0;
+	stats->suspend = 0;
+	stats->hpi = 0;
+	stats->completed = 0;
+	memset(stats->level, 0, sizeof(stats->level));
+	stats->total_ns = 0;
+	stats->max_ns = 0;
+	spin_unlock(&stats->lock);
+
+	return cnt;
+}
+
+static const struct file_operations mmc_dbg_bkops_stats_fops = {
+	.open		= mmc_bkops_stats_open,
+	.read		= seq_read,
+	.write		= mmc_bkops_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 void mmc_add_card_debugfs(struct mmc_card *card)
 {
 	struct mmc_host	*host = card->host;
@@ -350,6 +493,21 @@ void mmc_add_card_debugfs(struct mmc_card *card)
 					&mmc_dbg_ext_csd_fops))
 			goto err;
 
+	if (mmc_card_mmc(card))
+		if (!debugfs_create_file("wr_pack_stats", S_IRUSR | S_IWUSR,
+					root, card,
+					&mmc_dbg_wr_pack_stats_fops))
+			goto err;
+
+	if (mmc_card_mmc(card) && card->ext_csd.bkops) {
+		if (!debugfs_create_file("bkops_stats", S_IRUSR | S_IWUSR,
+					root, card, &mmc_dbg_bkops_stats_fops))
+			goto err;
+		if (!debugfs_create_u32("bkops_delay_ms", S_IRUSR | S_IWUSR,
+					root, &card->bkops_info.delay_ms))
+			goto err;
+	}
+
 	return;
 
 err:
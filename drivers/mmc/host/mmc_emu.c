@@ -0,0 +1,1502 @@
+/*
+ * Emulated eMMC host controller
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This driver pretends to be a host controller with an eMMC 4.5 device
+ * soldered to it, so that the card and block drivers can be exercised and
+ * measured on a machine without any MMC hardware.  The device is emulated
+ * at the command level: the core sends the usual CMD0/CMD1/CMD2/... and
+ * gets CID, CSD and EXT_CSD registers back, then reads and writes data
+ * with CMD17/18/24/25, with or without CMD23.
+ *
+ * The contents are kept in pages allocated on first write, or in a file
+ * given with backing_file=.  Trim and discard give the pages back.
+ *
+ * Requests are served one at a time from a workqueue and each command is
+ * held until the time the latency model says it should take has passed:
+ *
+ *   every command       cmd_latency_us
+ *   read                read_latency_us + bytes at read_kbps
+ *   write to media      write_latency_us + bytes at write_kbps
+ *   write to cache      bytes at cache_kbps
+ *   cache flush         flush_latency_us + dirty bytes at write_kbps
+ *   erase/trim/discard  erase_latency_us
+ *
+ * A rate of 0 means no limit.  Writes go to the cache while it is enabled
+ * (EXT_CSD CACHE_CTRL) and has room, except for reliable writes which
+ * always go to media.  The data itself always lands in the store right
+ * away; only the timing of the cache is modelled.
+ *
+ * Packed writes (eMMC 4.5) of up to max_packed entries are taken and cost
+ * one media access for all of their data.  With packed_fail_every=N every
+ * Nth packed write fails half way, to exercise the host's recovery.
+ *
+ * With gc_threshold_kb set, data reaching the media also runs up a garbage
+ * collection debt, which the device pays off at gc_kbps.  BKOPS_STATUS
+ * follows the debt in quarters of the threshold, and from level 2 on the
+ * device raises the URGENT_BKOPS exception.  Once the debt reaches the
+ * threshold the write that got it there stalls while a quarter of it is
+ * collected.  BKOPS_START without the busy signal collects in the
+ * background, showing PRG in the status, until HPI or any other command
+ * stops it; with the busy signal the host waits for all of it.
+ *
+ * All parameters can be changed at run time through
+ * /sys/module/mmc_emu/parameters.  The time spent on each command is
+ * reported in the "emu_stats" debugfs file of the host; writing to it
+ * clears the numbers.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/dma-mapping.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/hrtimer.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/radix-tree.h>
+#include <linux/scatterlist.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include <linux/mmc/host.h>
+#include <linux/mmc/mmc.h>
+
+#define DRIVER_NAME	"mmc_emu"
+
+#define EMU_RCA_NONE	0
+#define EMU_OCR		(MMC_CARD_BUSY | (1 << 30) | 0x00ff8080)
+#define EMU_ERASE_SECTORS	1024	/* 512KiB erase groups */
+#define EMU_SECTOR_SHIFT	9
+#define EMU_SECTORS_PER_PAGE	(PAGE_SIZE >> EMU_SECTOR_SHIFT)
+#define EMU_MAX_OPCODE	64
+
+static unsigned int size_mb = 256;
+module_param(size_mb, uint, S_IRUGO);
+MODULE_PARM_DESC(size_mb, "Size of the emulated device in MiB");
+
+static char *backing_file;
+module_param(backing_file, charp, S_IRUGO);
+MODULE_PARM_DESC(backing_file, "Keep the contents in this file instead of RAM");
+
+static unsigned int cache_kb = 4096;
+module_param(cache_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(cache_kb, "Size of the write cache in KiB, 0 for none");
+
+static unsigned int max_packed = 32;
+module_param(max_packed, uint, S_IRUGO);
+MODULE_PARM_DESC(max_packed, "Entries in a packed write, 0 for no packing");
+
+static unsigned int packed_fail_every;
+module_param(packed_fail_every, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(packed_fail_every, "Fail every Nth packed write, 0 for never");
+
+static unsigned int cmd_latency_us;
+module_param(cmd_latency_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cmd_latency_us, "Time taken by every command");
+
+static unsigned int read_latency_us;
+module_param(read_latency_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(read_latency_us, "Access time of a read command");
+
+static unsigned int write_latency_us;
+module_param(write_latency_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(write_latency_us, "Access time of a write to media");
+
+static unsigned int flush_latency_us;
+module_param(flush_latency_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(flush_latency_us, "Fixed cost of a cache flush");
+
+static unsigned int erase_latency_us;
+module_param(erase_latency_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(erase_latency_us, "Time taken by an erase, trim or discard");
+
+static unsigned int read_kbps;
+module_param(read_kbps, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(read_kbps, "Read bandwidth in KiB/s, 0 for unlimited");
+
+static unsigned int write_kbps;
+module_param(write_kbps, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(write_kbps, "Media write bandwidth in KiB/s, 0 for unlimited");
+
+static unsigned int cache_kbps;
+module_param(cache_kbps, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cache_kbps, "Cache write bandwidth in KiB/s, 0 for unlimited");
+
+static unsigned int gc_threshold_kb;
+module_param(gc_threshold_kb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_threshold_kb, "Writes before garbage collection stalls, 0 for no GC");
+
+static unsigned int gc_kbps = 16384;
+module_param(gc_kbps, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(gc_kbps, "Garbage collection speed in KiB/s, 0 for unlimited");
+
+struct mmc_emu_cmd_stats {
+	unsigned long	count;
+	unsigned long	errors;
+	u64		bytes;
+	u64		total_ns;
+	u64		max_ns;
+};
+
+struct mmc_emu_stats {
+	struct mmc_emu_cmd_stats cmd[EMU_MAX_OPCODE];
+	unsigned long	reliable_writes;
+	unsigned long	cached_writes;
+	unsigned long	flushes;
+	u64		flushed_bytes;
+	unsigned long	erases;
+	unsigned long	trims;
+	unsigned long	discards;
+	unsigned long	packed_writes;
+	unsigned long	packed_entries;
+	unsigned long	packed_failures;
+	unsigned long	gc_stalls;
+	u64		gc_stall_ns;
+	unsigned long	bkops_starts;
+	unsigned long	bkops_hpi;
+	unsigned long	bkops_interrupted;
+	unsigned long	bkops_completed;
+	u64		bkops_ns;
+};
+
+struct mmc_emu_host {
+	struct mmc_host		*mmc;
+	struct mmc_request	*mrq;
+	struct workqueue_struct	*workqueue;
+	struct work_struct	request_work;
+
+	/* Backing store, only touched from request_work */
+	sector_t		sectors;
+	struct radix_tree_root	pages;
+	struct file		*file;
+
+	/* Device state, only touched from request_work */
+	unsigned int		state;
+	u32			status;		/* error bits for next R1 */
+	u16			rca;
+	u32			cid[4];
+	u32			csd[4];
+	u8			*ext_csd;
+	unsigned int		sbc_blocks;	/* from CMD23, 0 if none */
+	bool			sbc_reliable;
+	bool			sbc_packed;
+	unsigned long		packed_seq;	/* for packed_fail_every */
+	u32			erase_start;
+	u32			erase_end;
+	u64			cache_dirty;	/* bytes not on media yet */
+	u64			gc_debt;	/* bytes to collect */
+	bool			bkops_running;
+	ktime_t			bkops_time;	/* debt last updated */
+
+	spinlock_t		stats_lock;
+	struct mmc_emu_stats	stats;
+};
+
+/*
+ * Store
+ */
+
+static struct page *mmc_emu_lookup_page(struct mmc_emu_host *host,
+					pgoff_t idx, bool create)
+{
+	struct page *page;
+
+	page = radix_tree_lookup(&host->pages, idx);
+	if (page || !create)
+		return page;
+
+	page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO);
+	if (!page)
+		return NULL;
+	page->index = idx;
+	if (radix_tree_insert(&host->pages, idx, page)) {
+		__free_page(page);
+		return NULL;
+	}
+	return page;
+}
+
+static int mmc_emu_file_rw(struct mmc_emu_host *host, void *buf, loff_t pos,
+			   size_t len, bool write)
+{
+	mm_segment_t old_fs = get_fs();
+	ssize_t ret;
+
+	set_fs(get_ds());
+	if (write)
+		ret = vfs_write(host->file, (const char __user *)buf, len,
+				&pos);
+	else
+		ret = vfs_read(host->file, (char __user *)buf, len, &pos);
+	set_fs(old_fs);
+
+	if (ret == len)
+		return 0;
+	if (ret >= 0 && !write) {
+		/* past the end of a sparse file */
+		memset(buf + ret, 0, len - ret);
+		return 0;
+	}
+	return ret < 0 ? ret : -EIO;
+}
+
+/* Copies len bytes at byte offset pos to or from the store. */
+static int mmc_emu_rw(struct mmc_emu_host *host, void *buf, loff_t pos,
+		      size_t len, bool write)
+{
+	if (host->file)
+		return mmc_emu_file_rw(host, buf, pos, len, write);
+
+	while (len) {
+		unsigned int offset = pos & ~PAGE_MASK;
+		size_t chunk = min_t(size_t, len, PAGE_SIZE - offset);
+		struct page *page;
+		void *vaddr;
+
+		page = mmc_emu_lookup_page(host, pos >> PAGE_SHIFT, write);
+		if (page) {
+			vaddr = kmap_atomic(page);
+			if (write)
+				memcpy(vaddr + offset, buf, chunk);
+			else
+				memcpy(buf, vaddr + offset, chunk);
+			kunmap_atomic(vaddr);
+		} else if (write) {
+			return -ENOMEM;
+		} else {
+			memset(buf, 0, chunk);
+		}
+
+		buf += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/*
+ * Erases nr sectors from sector on.  Whole pages are freed and read back
+ * as zeroes; partial pages are zeroed unless this is a discard, which
+ * leaves the contents undefined.
+ */
+static void mmc_emu_erase(struct mmc_emu_host *host, sector_t sector,
+			  sector_t nr, bool discard)
+{
+	if (host->file) {
+		loff_t pos = (loff_t)sector << EMU_SECTOR_SHIFT;
+		loff_t len = (loff_t)nr << EMU_SECTOR_SHIFT;
+		void *zero;
+
+		if (host->file->f_op->fallocate &&
+		    !host->file->f_op->fallocate(host->file,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				pos, len))
+			return;
+		if (discard)
+			return;
+
+		zero = (void *)get_zeroed_page(GFP_NOIO);
+		if (!zero)
+			return;
+		while (nr) {
+			sector_t chunk = min_t(sector_t, nr,
+					       EMU_SECTORS_PER_PAGE);
+
+			if (mmc_emu_file_rw(host, zero, pos,
+					    chunk << EMU_SECTOR_SHIFT, true))
+				break;
+			pos += chunk << EMU_SECTOR_SHIFT;
+			nr -= chunk;
+		}
+		free_page((unsigned long)zero);
+		return;
+	}
+
+	while (nr) {
+		pgoff_t idx = sector / EMU_SECTORS_PER_PAGE;
+		unsigned int first = sector & (EMU_SECTORS_PER_PAGE - 1);
+		sector_t chunk = min_t(sector_t, nr,
+				       EMU_SECTORS_PER_PAGE - first);
+		struct page *page;
+
+		if (chunk == EMU_SECTORS_PER_PAGE) {
+			page = radix_tree_delete(&host->pages, idx);
+			if (page)
+				__free_page(page);
+		} else if (!discard) {
+			page = radix_tree_lookup(&host->pages, idx);
+			if (page) {
+				void *vaddr = kmap_atomic(page);
+
+				memset(vaddr + (first << EMU_SECTOR_SHIFT), 0,
+				       chunk << EMU_SECTOR_SHIFT);
+				kunmap_atomic(vaddr);
+			}
+		}
+		sector += chunk;
+		nr -= chunk;
+	}
+}
+
+static void mmc_emu_free_pages(struct mmc_emu_host *host)
+{
+	struct page *pages[16];
+	pgoff_t idx = 0;
+	int i, n;
+
+	do {
+		n = radix_tree_gang_lookup(&host->pages, (void **)pages, idx,
+					   ARRAY_SIZE(pages));
+		for (i = 0; i < n; i++) {
+			idx = pages[i]->index;
+			radix_tree_delete(&host->pages, idx);
+			__free_page(pages[i]);
+		}
+		idx++;
+	} while (n == ARRAY_SIZE(pages));
+}
+
+/*
+ * Latency model
+ */
+
+static u64 mmc_emu_xfer_ns(u64 bytes, unsigned int kbps)
+{
+	if (!kbps)
+		return 0;
+	return div_u64(bytes * NSEC_PER_SEC, (u64)kbps * 1024);
+}
+
+static u64 mmc_emu_us(unsigned int us)
+{
+	return (u64)us * NSEC_PER_USEC;
+}
+
+/* Sets BKOPS_STATUS and URGENT_BKOPS from the debt. */
+static void mmc_emu_gc_update(struct mmc_emu_host *host)
+{
+	u64 threshold = (u64)ACCESS_ONCE(gc_threshold_kb) << 10;
+	u8 *ext_csd = host->ext_csd;
+	unsigned int level = 0;
+
+	if (threshold)
+		level = min_t(u64, div64_u64(host->gc_debt * 4, threshold), 3);
+	ext_csd[EXT_CSD_BKOPS_STATUS] = level;
+	if (level >= EXT_CSD_BKOPS_LEVEL_2)
+		ext_csd[EXT_CSD_EXP_EVENTS_STATUS] |= EXT_CSD_URGENT_BKOPS;
+	else
+		ext_csd[EXT_CSD_EXP_EVENTS_STATUS] &= ~EXT_CSD_URGENT_BKOPS;
+}
+
+/* Data reaching the media: returns the foreground collection stall. */
+static u64 mmc_emu_gc_cost(struct mmc_emu_host *host, u64 bytes)
+{
+	u64 threshold = (u64)ACCESS_ONCE(gc_threshold_kb) << 10;
+	u64 ns = 0;
+
+	if (!threshold)
+		return 0;
+
+	host->gc_debt += bytes;
+	while (host->gc_debt >= threshold) {
+		u64 chunk = threshold / 4 ? threshold / 4 : host->gc_debt;
+
+		ns += mmc_emu_xfer_ns(chunk, ACCESS_ONCE(gc_kbps));
+		host->gc_debt -= chunk;
+	}
+	mmc_emu_gc_update(host);
+
+	if (ns) {
+		spin_lock(&host->stats_lock);
+		host->stats.gc_stalls++;
+		host->stats.gc_stall_ns += ns;
+		spin_unlock(&host->stats_lock);
+	}
+	return ns;
+}
+
+/* Background collection: catches up with the time that has passed. */
+static void mmc_emu_bkops_progress(struct mmc_emu_host *host)
+{
+	unsigned int kbps = ACCESS_ONCE(gc_kbps);
+	ktime_t now = ktime_get();
+	u64 ns, needed;
+
+	if (!host->bkops_running)
+		return;
+
+	ns = ktime_to_ns(ktime_sub(now, host->bkops_time));
+	needed = mmc_emu_xfer_ns(host->gc_debt, kbps);
+	host->bkops_time = now;
+
+	if (ns >= needed) {
+		ns = needed;
+		host->gc_debt = 0;
+		host->bkops_running = false;
+	} else {
+		host->gc_debt -= min(host->gc_debt,
+				     div_u64(div_u64(ns, NSEC_PER_USEC) *
+					     kbps * 1024, USEC_PER_SEC));
+	}
+	mmc_emu_gc_update(host);
+
+	spin_lock(&host->stats_lock);
+	host->stats.bkops_ns += ns;
+	if (!host->bkops_running)
+		host->stats.bkops_completed++;
+	spin_unlock(&host->stats_lock);
+}
+
+static void mmc_emu_bkops_stop(struct mmc_emu_host *host, bool hpi)
+{
+	mmc_emu_bkops_progress(host);
+	if (!host->bkops_running)
+		return;
+
+	host->bkops_running = false;
+	spin_lock(&host->stats_lock);
+	if (hpi)
+		host->stats.bkops_hpi++;
+	else
+		host->stats.bkops_interrupted++;
+	spin_unlock(&host->stats_lock);
+}
+
+/* BKOPS_START: returns the time the host waits on the busy signal. */
+static u64 mmc_emu_bkops_start(struct mmc_emu_host *host, bool busy)
+{
+	u64 ns = 0;
+
+	spin_lock(&host->stats_lock);
+	host->stats.bkops_starts++;
+	spin_unlock(&host->stats_lock);
+
+	if (busy) {
+		ns = mmc_emu_xfer_ns(host->gc_debt, ACCESS_ONCE(gc_kbps));
+		host->gc_debt = 0;
+		mmc_emu_gc_update(host);
+
+		spin_lock(&host->stats_lock);
+		host->stats.bkops_ns += ns;
+		host->stats.bkops_completed++;
+		spin_unlock(&host->stats_lock);
+	} else if (host->gc_debt) {
+		host->bkops_running = true;
+		host->bkops_time = ktime_get();
+	}
+	return ns;
+}
+
+static u64 mmc_emu_flush_cost(struct mmc_emu_host *host)
+{
+	u64 ns;
+
+	ns = mmc_emu_us(ACCESS_ONCE(flush_latency_us)) +
+	     mmc_emu_xfer_ns(host->cache_dirty, ACCESS_ONCE(write_kbps));
+	ns += mmc_emu_gc_cost(host, host->cache_dirty);
+	spin_lock(&host->stats_lock);
+	host->stats.flushes++;
+	host->stats.flushed_bytes += host->cache_dirty;
+	spin_unlock(&host->stats_lock);
+	host->cache_dirty = 0;
+	return ns;
+}
+
+static u64 mmc_emu_write_cost(struct mmc_emu_host *host, u64 bytes,
+			      bool reliable)
+{
+	u64 cache_size = (u64)cache_kb << 10;
+	u64 cached = 0;
+	u64 ns = 0;
+
+	if (!reliable && host->ext_csd[EXT_CSD_CACHE_CTRL] &&
+	    host->cache_dirty < cache_size) {
+		cached = min(bytes, cache_size - host->cache_dirty);
+		host->cache_dirty += cached;
+		ns += mmc_emu_xfer_ns(cached, ACCESS_ONCE(cache_kbps));
+	}
+	if (bytes > cached)
+		ns += mmc_emu_us(ACCESS_ONCE(write_latency_us)) +
+		      mmc_emu_xfer_ns(bytes - cached, ACCESS_ONCE(write_kbps)) +
+		      mmc_emu_gc_cost(host, bytes - cached);
+
+	spin_lock(&host->stats_lock);
+	if (reliable)
+		host->stats.reliable_writes++;
+	else if (cached)
+		host->stats.cached_writes++;
+	spin_unlock(&host->stats_lock);
+	return ns;
+}
+
+static u64 mmc_emu_read_cost(u64 bytes)
+{
+	return mmc_emu_us(ACCESS_ONCE(read_latency_us)) +
+	       mmc_emu_xfer_ns(bytes, ACCESS_ONCE(read_kbps));
+}
+
+/* Holds the caller until ns have passed since start. */
+static void mmc_emu_wait(ktime_t start, u64 ns)
+{
+	ktime_t end = ktime_add_ns(start, ns);
+
+	while (ktime_to_ns(ktime_sub(end, ktime_get())) > 0) {
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_hrtimeout(&end, HRTIMER_MODE_ABS);
+	}
+}
+
+/*
+ * Registers
+ */
+
+static void mmc_emu_stuff(u32 *resp, unsigned int start, unsigned int size,
+			  u32 val)
+{
+	int off = 3 - (start / 32);
+	int shft = start & 31;
+
+	resp[off] |= val << shft;
+	if (size + shft > 32)
+		resp[off - 1] |= val >> (32 - shft);
+}
+
+static void mmc_emu_init_regs(struct mmc_emu_host *host)
+{
+	u8 *ext_csd = host->ext_csd;
+	u32 *cid = host->cid;
+	u32 *csd = host->csd;
+	const char *name = "EMUMMC";
+	int i;
+
+	memset(cid, 0, sizeof(host->cid));
+	mmc_emu_stuff(cid, 120, 8, 0xfe);		/* MID */
+	mmc_emu_stuff(cid, 104, 16, 0x0100);		/* OID */
+	for (i = 0; i < 6; i++)				/* PNM */
+		mmc_emu_stuff(cid, 96 - i * 8, 8, name[i]);
+	mmc_emu_stuff(cid, 48, 8, 0x10);		/* PRV */
+	mmc_emu_stuff(cid, 16, 32, 0x12345678);		/* PSN */
+	mmc_emu_stuff(cid, 8, 8, 0x1f);			/* MDT */
+
+	memset(csd, 0, sizeof(host->csd));
+	mmc_emu_stuff(csd, 126, 2, 3);		/* CSD_STRUCTURE: in EXT_CSD */
+	mmc_emu_stuff(csd, 122, 4, 4);		/* SPEC_VERS: 4.x */
+	mmc_emu_stuff(csd, 112, 8, 0x27);	/* TAAC: 1.5ms */
+	mmc_emu_stuff(csd, 104, 8, 1);		/* NSAC */
+	mmc_emu_stuff(csd, 96, 8, 0x32);	/* TRAN_SPEED: 26MHz */
+	mmc_emu_stuff(csd, 84, 12, 0x0f5);	/* CCC: 0, 2, 4, 5, 6, 7 */
+	mmc_emu_stuff(csd, 80, 4, 9);		/* READ_BL_LEN: 512 */
+	mmc_emu_stuff(csd, 62, 12, 0xfff);	/* C_SIZE: see SEC_COUNT */
+	mmc_emu_stuff(csd, 47, 3, 7);		/* C_SIZE_MULT */
+	mmc_emu_stuff(csd, 42, 5, 31);		/* ERASE_GRP_SIZE */
+	mmc_emu_stuff(csd, 37, 5, 31);		/* ERASE_GRP_MULT */
+	mmc_emu_stuff(csd, 26, 3, 2);		/* R2W_FACTOR */
+	mmc_emu_stuff(csd, 22, 4, 9);		/* WRITE_BL_LEN: 512 */
+
+	memset(ext_csd, 0, 512);
+	ext_csd[EXT_CSD_REV] = 6;
+	ext_csd[EXT_CSD_STRUCTURE] = 2;
+	ext_csd[EXT_CSD_CARD_TYPE] = EXT_CSD_CARD_TYPE_26 |
+				     EXT_CSD_CARD_TYPE_52;
+	ext_csd[EXT_CSD_SEC_CNT + 0] = host->sectors >> 0;
+	ext_csd[EXT_CSD_SEC_CNT + 1] = host->sectors >> 8;
+	ext_csd[EXT_CSD_SEC_CNT + 2] = host->sectors >> 16;
+	ext_csd[EXT_CSD_SEC_CNT + 3] = host->sectors >> 24;
+	ext_csd[EXT_CSD_S_A_TIMEOUT] = 0x11;
+	ext_csd[EXT_CSD_PART_SWITCH_TIME] = 1;
+	ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] = EMU_ERASE_SECTORS / 1024;
+	ext_csd[EXT_CSD_HC_WP_GRP_SIZE] = 1;
+	ext_csd[EXT_CSD_ERASE_TIMEOUT_MULT] = 1;
+	ext_csd[EXT_CSD_REL_WR_SEC_C] = 1;
+	ext_csd[EXT_CSD_WR_REL_PARAM] = EXT_CSD_WR_REL_PARAM_EN;
+	ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT] = EXT_CSD_SEC_GB_CL_EN;
+	ext_csd[EXT_CSD_TRIM_MULT] = 1;
+	ext_csd[EXT_CSD_POWER_OFF_LONG_TIME] = 100;
+	ext_csd[EXT_CSD_GENERIC_CMD6_TIME] = 10;
+	ext_csd[EXT_CSD_CACHE_SIZE + 0] = cache_kb >> 0;
+	ext_csd[EXT_CSD_CACHE_SIZE + 1] = cache_kb >> 8;
+	ext_csd[EXT_CSD_CACHE_SIZE + 2] = cache_kb >> 16;
+	ext_csd[EXT_CSD_CACHE_SIZE + 3] = cache_kb >> 24;
+	ext_csd[EXT_CSD_MAX_PACKED_WRITES] = min(max_packed, 63U);
+	ext_csd[EXT_CSD_HPI_FEATURES] = 1;		/* HPI with CMD13 */
+	ext_csd[EXT_CSD_OUT_OF_INTERRUPT_TIME] = 1;	/* 10ms */
+	ext_csd[EXT_CSD_BKOPS_SUPPORT] = 1;
+	ext_csd[EXT_CSD_BKOPS_EN] = 1;			/* as provisioned */
+}
+
+/* What a power cycle does to the device. */
+static void mmc_emu_reset(struct mmc_emu_host *host)
+{
+	host->state = R1_STATE_IDLE;
+	host->status = 0;
+	host->rca = EMU_RCA_NONE;
+	host->sbc_blocks = 0;
+	host->cache_dirty = 0;
+	host->ext_csd[EXT_CSD_CACHE_CTRL] = 0;
+	host->ext_csd[EXT_CSD_POWER_OFF_NOTIFICATION] = 0;
+	host->ext_csd[EXT_CSD_ERASE_GROUP_DEF] = 0;
+	host->ext_csd[EXT_CSD_BUS_WIDTH] = 0;
+	host->ext_csd[EXT_CSD_HS_TIMING] = 0;
+	host->ext_csd[EXT_CSD_POWER_CLASS] = 0;
+	host->ext_csd[EXT_CSD_EXP_EVENTS_CTRL] = 0;
+	host->ext_csd[EXT_CSD_EXP_EVENTS_STATUS] = 0;
+	host->ext_csd[EXT_CSD_PACKED_CMD_STATUS] = 0;
+	host->ext_csd[EXT_CSD_PACKED_FAILURE_INDEX] = 0;
+	host->ext_csd[EXT_CSD_HPI_MGMT] = 0;
+	/* the debt is in the flash and survives, the collection does not */
+	host->bkops_running = false;
+	mmc_emu_gc_update(host);
+}
+
+/*
+ * Commands
+ */
+
+static u32 mmc_emu_r1(struct mmc_emu_host *host, unsigned int state)
+{
+	u32 r1 = host->status | R1_READY_FOR_DATA | (state << 9);
+	u8 *ext_csd = host->ext_csd;
+
+	/* urgent BKOPS need no enabling */
+	if (ext_csd[EXT_CSD_EXP_EVENTS_STATUS] &
+	    (ext_csd[EXT_CSD_EXP_EVENTS_CTRL] | EXT_CSD_URGENT_BKOPS))
+		r1 |= R1_EXCEPTION_EVENT;
+	host->status = 0;
+	return r1;
+}
+
+/* CMD6: returns the time the switch takes */
+static u64 mmc_emu_switch(struct mmc_emu_host *host, u32 arg, bool busy)
+{
+	unsigned int mode = (arg >> 24) & 0x3;
+	unsigned int index = (arg >> 16) & 0xff;
+	u8 value = (arg >> 8) & 0xff;
+	u8 *ext_csd = host->ext_csd;
+
+	if (mode == MMC_SWITCH_MODE_CMD_SET)
+		return 0;
+	if (mode == MMC_SWITCH_MODE_SET_BITS)
+		value |= ext_csd[index];
+	else if (mode == MMC_SWITCH_MODE_CLEAR_BITS)
+		value = ext_csd[index] & ~value;
+
+	switch (index) {
+	case EXT_CSD_FLUSH_CACHE:
+		/* reads back as 0 once the flush is done */
+		if (value & 1)
+			return mmc_emu_flush_cost(host);
+		return 0;
+	case EXT_CSD_CACHE_CTRL:
+		/* turning the cache off flushes it */
+		ext_csd[index] = value & 1;
+		if (!ext_csd[index])
+			return mmc_emu_flush_cost(host);
+		return 0;
+	case EXT_CSD_POWER_OFF_NOTIFICATION:
+		ext_csd[index] = value;
+		if (value == EXT_CSD_POWER_OFF_SHORT ||
+		    value == EXT_CSD_POWER_OFF_LONG)
+			return mmc_emu_flush_cost(host);
+		return 0;
+	case EXT_CSD_PART_CONFIG:
+		/* there are no boot or general purpose partitions */
+		if (value & EXT_CSD_PART_CONFIG_ACC_MASK)
+			break;
+		ext_csd[index] = value;
+		return 0;
+	case EXT_CSD_ERASE_GROUP_DEF:
+	case EXT_CSD_BUS_WIDTH:
+	case EXT_CSD_HS_TIMING:
+	case EXT_CSD_POWER_CLASS:
+	case EXT_CSD_RST_N_FUNCTION:
+	case EXT_CSD_BOOT_WP:
+		ext_csd[index] = value;
+		return 0;
+	case EXT_CSD_EXP_EVENTS_CTRL:
+		ext_csd[index] = value & EXT_CSD_PACKED_EVENT_EN;
+		return 0;
+	case EXT_CSD_HPI_MGMT:
+		ext_csd[index] = value & 1;
+		return 0;
+	case EXT_CSD_BKOPS_START:
+		if (!ext_csd[EXT_CSD_BKOPS_EN] || !(value & 1))
+			break;
+		return mmc_emu_bkops_start(host, busy);
+	}
+
+	host->status |= R1_SWITCH_ERROR;
+	return 0;
+}
+
+/* CMD38: returns the time the erase takes */
+static u64 mmc_emu_do_erase(struct mmc_emu_host *host, u32 arg)
+{
+	u32 start = host->erase_start, end = host->erase_end;
+	unsigned long *counter;
+
+	if (end < start || end >= host->sectors) {
+		host->status |= R1_ERASE_PARAM;
+		return 0;
+	}
+
+	switch (arg) {
+	case MMC_TRIM_ARG:
+		counter = &host->stats.trims;
+		break;
+	case MMC_DISCARD_ARG:
+		counter = &host->stats.discards;
+		break;
+	case MMC_ERASE_ARG:
+		/* erase works on whole erase groups */
+		start = round_down(start, EMU_ERASE_SECTORS);
+		end = min_t(u32, round_up(end + 1, EMU_ERASE_SECTORS),
+			    host->sectors) - 1;
+		counter = &host->stats.erases;
+		break;
+	default:
+		/* no secure erase or trim */
+		host->status |= R1_ERASE_PARAM;
+		return 0;
+	}
+
+	mmc_emu_erase(host, start, end - start + 1, arg == MMC_DISCARD_ARG);
+	spin_lock(&host->stats_lock);
+	(*counter)++;
+	spin_unlock(&host->stats_lock);
+	return mmc_emu_us(ACCESS_ONCE(erase_latency_us));
+}
+
+/*
+ * Moves the data of a transfer that the command expects blocks of.  Asking
+ * for more than that is what mmc_test does to check short transfers: the
+ * device never sends or takes the rest, so that part times out.
+ */
+static u64 mmc_emu_transfer(struct mmc_emu_host *host,
+			    struct mmc_command *cmd, struct mmc_data *data,
+			    sector_t sector, unsigned int blocks, bool reliable)
+{
+	bool write = data->flags & MMC_DATA_WRITE;
+	unsigned int sg_flags = write ? SG_MITER_FROM_SG : SG_MITER_TO_SG;
+	unsigned int len, done = 0;
+	struct sg_mapping_iter miter;
+	int err = 0;
+
+	if (data->blksz != 512) {
+		data->error = -EINVAL;
+		return 0;
+	}
+	if (blocks > data->blocks)
+		blocks = data->blocks;
+	if (sector + blocks > host->sectors) {
+		cmd->resp[0] |= R1_OUT_OF_RANGE;
+		data->error = -EIO;
+		return 0;
+	}
+
+	len = blocks * data->blksz;
+	sg_miter_start(&miter, data->sg, data->sg_len, sg_flags);
+	while (done < len && sg_miter_next(&miter)) {
+		size_t chunk = min_t(size_t, miter.length, len - done);
+
+		err = mmc_emu_rw(host, miter.addr,
+				 ((loff_t)sector << EMU_SECTOR_SHIFT) + done,
+				 chunk, write);
+		if (err)
+			break;
+		done += chunk;
+	}
+	sg_miter_stop(&miter);
+
+	data->bytes_xfered = done;
+	if (err)
+		data->error = -EIO;
+	else if (blocks < data->blocks)
+		data->error = -ETIMEDOUT;
+
+	if (write)
+		return mmc_emu_write_cost(host, done, reliable);
+	return mmc_emu_read_cost(done);
+}
+
+static void mmc_emu_packed_failed(struct mmc_emu_host *host,
+				  unsigned int index)
+{
+	u8 *ext_csd = host->ext_csd;
+
+	ext_csd[EXT_CSD_PACKED_CMD_STATUS] = EXT_CSD_PACKED_GENERIC_ERROR;
+	if (index)
+		ext_csd[EXT_CSD_PACKED_CMD_STATUS] |=
+			EXT_CSD_PACKED_INDEXED_ERROR;
+	ext_csd[EXT_CSD_PACKED_FAILURE_INDEX] = index;
+	ext_csd[EXT_CSD_EXP_EVENTS_STATUS] |= EXT_CSD_PACKED_FAILURE;
+
+	spin_lock(&host->stats_lock);
+	host->stats.packed_failures++;
+	spin_unlock(&host->stats_lock);
+}
+
+/*
+ * CMD25 after a packed CMD23.  The first block is the header: version,
+ * direction and number of entries, then the CMD23 and CMD25 arguments of
+ * each entry.  The data of the entries follows in order.  A bad header
+ * fails the whole command and a bad entry stops at that entry; either way
+ * the data phase itself completes and the failure is reported through the
+ * exception event, as a real device does.
+ */
+static u64 mmc_emu_packed_write(struct mmc_emu_host *host,
+				struct mmc_command *cmd, struct mmc_data *data,
+				unsigned int blocks)
+{
+	u32 hdr[128];
+	unsigned int nr, i, fail = 0, total = 1;
+	size_t len, done = 0, entry_start = 0, entry_end = sizeof(hdr);
+	struct sg_mapping_iter miter;
+	bool reliable = false;
+	u64 written = 0;
+
+	host->ext_csd[EXT_CSD_EXP_EVENTS_STATUS] &= ~EXT_CSD_PACKED_FAILURE;
+	host->ext_csd[EXT_CSD_PACKED_CMD_STATUS] = 0;
+	host->ext_csd[EXT_CSD_PACKED_FAILURE_INDEX] = 0;
+
+	len = (size_t)data->blocks * data->blksz;
+	if (data->blksz != 512 || blocks != data->blocks) {
+		data->error = -EINVAL;
+		return 0;
+	}
+	sg_copy_to_buffer(data->sg, data->sg_len, hdr, sizeof(hdr));
+
+	nr = (le32_to_cpu(hdr[0]) >> 16) & 0xff;
+	if ((le32_to_cpu(hdr[0]) & 0xffff) != 0x0201 || !nr ||
+	    nr > host->ext_csd[EXT_CSD_MAX_PACKED_WRITES] ||
+	    nr >= ARRAY_SIZE(hdr) / 2) {
+		mmc_emu_packed_failed(host, 0);
+		goto out;
+	}
+	for (i = 1; i <= nr; i++) {
+		u32 count = le32_to_cpu(hdr[2 * i]) & 0xffff;
+		u32 sector = le32_to_cpu(hdr[2 * i + 1]);
+
+		if (!fail && (!count || sector + count > host->sectors ||
+			      sector + count < sector))
+			fail = i;
+		total += count;
+		reliable |= !!(le32_to_cpu(hdr[2 * i]) & (1 << 31));
+	}
+	if (total != blocks) {
+		mmc_emu_packed_failed(host, 0);
+		goto out;
+	}
+
+	if (!fail && packed_fail_every &&
+	    ++host->packed_seq % packed_fail_every == 0)
+		fail = nr / 2 + 1;
+
+	/* i is the entry being written, 0 while in the header */
+	i = 0;
+	sg_miter_start(&miter, data->sg, data->sg_len, SG_MITER_FROM_SG);
+	while (done < len && sg_miter_next(&miter)) {
+		size_t off = 0;
+
+		while (off < miter.length && done < len) {
+			size_t chunk;
+
+			while (done >= entry_end) {
+				i++;
+				entry_start = entry_end;
+				entry_end += (size_t)(le32_to_cpu(hdr[2 * i]) &
+						      0xffff) << EMU_SECTOR_SHIFT;
+			}
+			chunk = min(miter.length - off, entry_end - done);
+			if (i && (!fail || i < fail)) {
+				loff_t pos = (loff_t)le32_to_cpu(hdr[2 * i + 1])
+					     << EMU_SECTOR_SHIFT;
+
+				if (mmc_emu_rw(host, miter.addr + off,
+					       pos + done - entry_start,
+					       chunk, true))
+					fail = i;
+				else
+					written += chunk;
+			}
+			off += chunk;
+			done += chunk;
+		}
+	}
+	sg_miter_stop(&miter);
+
+	if (fail)
+		mmc_emu_packed_failed(host, fail);
+
+	spin_lock(&host->stats_lock);
+	host->stats.packed_writes++;
+	host->stats.packed_entries += nr;
+	spin_unlock(&host->stats_lock);
+out:
+	data->bytes_xfered = len;
+	return mmc_emu_write_cost(host, written, reliable);
+}
+
+/*
+ * Runs one command, filling in its response and error, and moving the
+ * data of the request if it has a data phase.  Returns the time the
+ * device takes for it on top of cmd_latency_us.
+ */
+static u64 mmc_emu_command(struct mmc_emu_host *host, struct mmc_command *cmd,
+			   struct mmc_data *data)
+{
+	unsigned int state = host->state;
+	bool addressed = (cmd->arg >> 16) == host->rca;
+	unsigned int sbc_blocks = host->sbc_blocks;
+	bool reliable = host->sbc_reliable;
+	bool packed = host->sbc_packed;
+
+	cmd->error = 0;
+	host->sbc_blocks = 0;
+	host->sbc_reliable = false;
+	host->sbc_packed = false;
+
+	/*
+	 * Background collection goes on through plain status polls.  HPI,
+	 * which is CMD13 with bit 0 set, stops it, and so does anything
+	 * else the host sends instead of waiting.
+	 */
+	mmc_emu_bkops_progress(host);
+	if (host->bkops_running && (cmd->opcode != MMC_SEND_STATUS ||
+				    (cmd->arg & 1)))
+		mmc_emu_bkops_stop(host, cmd->opcode == MMC_SEND_STATUS);
+
+	switch (cmd->opcode) {
+	case MMC_GO_IDLE_STATE:
+		if (cmd->arg == 0)
+			mmc_emu_reset(host);
+		return 0;
+	case MMC_SEND_OP_COND:
+		if (state != R1_STATE_IDLE && state != R1_STATE_READY)
+			break;
+		cmd->resp[0] = EMU_OCR;
+		host->state = R1_STATE_READY;
+		return 0;
+	case MMC_ALL_SEND_CID:
+		if (state != R1_STATE_READY)
+			break;
+		memcpy(cmd->resp, host->cid, sizeof(host->cid));
+		host->state = R1_STATE_IDENT;
+		return 0;
+	case MMC_SET_RELATIVE_ADDR:
+		if (state != R1_STATE_IDENT)
+			break;
+		host->rca = cmd->arg >> 16;
+		host->state = R1_STATE_STBY;
+		goto r1;
+	case MMC_SEND_CSD:
+	case MMC_SEND_CID:
+		if (state != R1_STATE_STBY || !addressed)
+			break;
+		memcpy(cmd->resp, cmd->opcode == MMC_SEND_CSD ?
+		       host->csd : host->cid, sizeof(host->csd));
+		return 0;
+	case MMC_SELECT_CARD:
+		if (state != R1_STATE_STBY && state != R1_STATE_TRAN)
+			break;
+		host->state = addressed ? R1_STATE_TRAN : R1_STATE_STBY;
+		if (!addressed)
+			return 0;
+		goto r1;
+	case MMC_SEND_STATUS:
+		if (!addressed || state == R1_STATE_IDLE)
+			break;
+		if (data) {
+			/* no data phase */
+			data->error = -ETIMEDOUT;
+		}
+		if (host->bkops_running) {
+			cmd->resp[0] = mmc_emu_r1(host, R1_STATE_PRG) &
+				       ~R1_READY_FOR_DATA;
+			return 0;
+		}
+		goto r1;
+	case MMC_SET_BLOCKLEN:
+		if (state != R1_STATE_TRAN)
+			break;
+		if (cmd->arg != 512)
+			host->status |= R1_BLOCK_LEN_ERROR;
+		goto r1;
+	case MMC_SWITCH:
+		if (state != R1_STATE_TRAN)
+			break;
+		/* a failed switch shows in the status that follows */
+		cmd->resp[0] = mmc_emu_r1(host, state);
+		return mmc_emu_switch(host, cmd->arg,
+				      cmd->flags & MMC_RSP_BUSY);
+	case MMC_SEND_EXT_CSD:
+		/* without data this is SD_SEND_IF_COND */
+		if (state != R1_STATE_TRAN || !data)
+			break;
+		if (data->blksz * data->blocks != 512) {
+			data->error = -EINVAL;
+			goto r1;
+		}
+		sg_copy_from_buffer(data->sg, data->sg_len, host->ext_csd, 512);
+		data->bytes_xfered = 512;
+		goto r1;
+	case MMC_SET_BLOCK_COUNT:
+		if (state != R1_STATE_TRAN)
+			break;
+		host->sbc_blocks = cmd->arg & 0xffff;
+		host->sbc_reliable = cmd->arg & (1 << 31);
+		host->sbc_packed = cmd->arg & (1 << 30);
+		goto r1;
+	case MMC_READ_SINGLE_BLOCK:
+	case MMC_READ_MULTIPLE_BLOCK:
+	case MMC_WRITE_BLOCK:
+	case MMC_WRITE_MULTIPLE_BLOCK:
+		if (state != R1_STATE_TRAN || !data)
+			break;
+		cmd->resp[0] = mmc_emu_r1(host, state);
+		if (cmd->opcode == MMC_READ_SINGLE_BLOCK ||
+		    cmd->opcode == MMC_WRITE_BLOCK)
+			sbc_blocks = 1;
+		else if (!sbc_blocks)
+			sbc_blocks = data->blocks;	/* open ended */
+		if (packed) {
+			/* there are no packed reads */
+			if (cmd->opcode != MMC_WRITE_MULTIPLE_BLOCK) {
+				cmd->resp[0] |= R1_ERROR;
+				data->error = -EIO;
+				return 0;
+			}
+			return mmc_emu_packed_write(host, cmd, data,
+						    sbc_blocks);
+		}
+		return mmc_emu_transfer(host, cmd, data, cmd->arg, sbc_blocks,
+					reliable);
+	case MMC_STOP_TRANSMISSION:
+		if (state != R1_STATE_TRAN)
+			break;
+		goto r1;
+	case MMC_ERASE_GROUP_START:
+	case MMC_ERASE_GROUP_END:
+		if (state != R1_STATE_TRAN)
+			break;
+		if (cmd->arg >= host->sectors)
+			host->status |= R1_OUT_OF_RANGE;
+		else if (cmd->opcode == MMC_ERASE_GROUP_START)
+			host->erase_start = cmd->arg;
+		else
+			host->erase_end = cmd->arg;
+		goto r1;
+	case MMC_ERASE:
+		if (state != R1_STATE_TRAN)
+			break;
+		cmd->resp[0] = mmc_emu_r1(host, state);
+		return mmc_emu_do_erase(host, cmd->arg);
+	}
+
+	/*
+	 * SD and SDIO commands sent while probing, and anything else the
+	 * device does not take in its current state: no response.
+	 */
+	if (state != R1_STATE_IDLE)
+		host->status |= R1_ILLEGAL_COMMAND;
+	cmd->error = -ETIMEDOUT;
+	return 0;
+
+r1:
+	cmd->resp[0] = mmc_emu_r1(host, state);
+	return 0;
+}
+
+static void mmc_emu_account(struct mmc_emu_host *host,
+			    struct mmc_command *cmd, struct mmc_data *data,
+			    u64 ns)
+{
+	struct mmc_emu_cmd_stats *st = &host->stats.cmd[cmd->opcode &
+							(EMU_MAX_OPCODE - 1)];
+
+	spin_lock(&host->stats_lock);
+	st->count++;
+	if (cmd->error || (data && data->error))
+		st->errors++;
+	if (data)
+		st->bytes += data->bytes_xfered;
+	st->total_ns += ns;
+	if (ns > st->max_ns)
+		st->max_ns = ns;
+	spin_unlock(&host->stats_lock);
+}
+
+static void mmc_emu_run(struct mmc_emu_host *host, struct mmc_command *cmd,
+			struct mmc_data *data)
+{
+	ktime_t start = ktime_get();
+	u64 ns;
+
+	ns = mmc_emu_us(ACCESS_ONCE(cmd_latency_us));
+	ns += mmc_emu_command(host, cmd, data);
+	mmc_emu_wait(start, ns);
+	mmc_emu_account(host, cmd, data,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+static void mmc_emu_request_work(struct work_struct *work)
+{
+	struct mmc_emu_host *host = container_of(work, struct mmc_emu_host,
+						 request_work);
+	struct mmc_request *mrq = host->mrq;
+
+	if (mrq->sbc) {
+		mmc_emu_run(host, mrq->sbc, NULL);
+		if (mrq->sbc->error)
+			goto done;
+	}
+
+	mmc_emu_run(host, mrq->cmd, mrq->data);
+
+	if (mrq->data && mrq->stop && !mrq->sbc)
+		mmc_emu_run(host, mrq->stop, NULL);
+done:
+	host->mrq = NULL;
+	mmc_request_done(host->mmc, mrq);
+}
+
+/*
+ * Host operations
+ */
+
+static void mmc_emu_request(struct mmc_host *mmc, struct mmc_request *mrq)
+{
+	struct mmc_emu_host *host = mmc_priv(mmc);
+
+	WARN_ON(host->mrq);
+	host->mrq = mrq;
+	queue_work(host->workqueue, &host->request_work);
+}
+
+static void mmc_emu_set_ios(struct mmc_host *mmc, struct mmc_ios *ios)
+{
+	struct mmc_emu_host *host = mmc_priv(mmc);
+
+	/* the core only changes the power with no request in flight */
+	if (ios->power_mode == MMC_POWER_UP)
+		mmc_emu_reset(host);
+}
+
+static int mmc_emu_get_cd(struct mmc_host *mmc)
+{
+	return 1;
+}
+
+static int mmc_emu_get_ro(struct mmc_host *mmc)
+{
+	return 0;
+}
+
+static const struct mmc_host_ops mmc_emu_ops = {
+	.request	= mmc_emu_request,
+	.set_ios	= mmc_emu_set_ios,
+	.get_cd		= mmc_emu_get_cd,
+	.get_ro		= mmc_emu_get_ro,
+};
+
+/*
+ * Statistics
+ */
+
+static const char *mmc_emu_cmd_names[EMU_MAX_OPCODE] = {
+	[MMC_GO_IDLE_STATE]		= "GO_IDLE_STATE",
+	[MMC_SEND_OP_COND]		= "SEND_OP_COND",
+	[MMC_ALL_SEND_CID]		= "ALL_SEND_CID",
+	[MMC_SET_RELATIVE_ADDR]		= "SET_RELATIVE_ADDR",
+	[MMC_SWITCH]			= "SWITCH",
+	[MMC_SELECT_CARD]		= "SELECT_CARD",
+	[MMC_SEND_EXT_CSD]		= "SEND_EXT_CSD",
+	[MMC_SEND_CSD]			= "SEND_CSD",
+	[MMC_SEND_CID]			= "SEND_CID",
+	[MMC_STOP_TRANSMISSION]		= "STOP_TRANSMISSION",
+	[MMC_SEND_STATUS]		= "SEND_STATUS",
+	[MMC_SET_BLOCKLEN]		= "SET_BLOCKLEN",
+	[MMC_READ_SINGLE_BLOCK]		= "READ_SINGLE_BLOCK",
+	[MMC_READ_MULTIPLE_BLOCK]	= "READ_MULTIPLE_BLOCK",
+	[MMC_SET_BLOCK_COUNT]		= "SET_BLOCK_COUNT",
+	[MMC_WRITE_BLOCK]		= "WRITE_BLOCK",
+	[MMC_WRITE_MULTIPLE_BLOCK]	= "WRITE_MULTIPLE_BLOCK",
+	[MMC_ERASE_GROUP_START]		= "ERASE_GROUP_START",
+	[MMC_ERASE_GROUP_END]		= "ERASE_GROUP_END",
+	[MMC_ERASE]			= "ERASE",
+};
+
+static int mmc_emu_stats_show(struct seq_file *s, void *v)
+{
+	struct mmc_emu_host *host = s->private;
+	struct mmc_emu_stats *stats;
+	int i;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+	spin_lock(&host->stats_lock);
+	*stats = host->stats;
+	spin_unlock(&host->stats_lock);
+
+	seq_printf(s, "%-24s %10s %8s %12s %10s %10s\n", "command", "count",
+		   "errors", "bytes", "avg_us", "max_us");
+	for (i = 0; i < EMU_MAX_OPCODE; i++) {
+		struct mmc_emu_cmd_stats *st = &stats->cmd[i];
+		char name[24];
+
+		if (!st->count)
+			continue;
+		if (mmc_emu_cmd_names[i])
+			snprintf(name, sizeof(name), "CMD%d %s", i,
+				 mmc_emu_cmd_names[i]);
+		else
+			snprintf(name, sizeof(name), "CMD%d", i);
+		seq_printf(s, "%-24s %10lu %8lu %12llu %10llu %10llu\n", name,
+			   st->count, st->errors, st->bytes,
+			   div_u64(div_u64(st->total_ns, st->count),
+				   NSEC_PER_USEC),
+			   div_u64(st->max_ns, NSEC_PER_USEC));
+	}
+	seq_printf(s, "reliable writes: %lu\n", stats->reliable_writes);
+	seq_printf(s, "cached writes: %lu\n", stats->cached_writes);
+	seq_printf(s, "cache flushes: %lu (%llu bytes)\n", stats->flushes,
+		   stats->flushed_bytes);
+	seq_printf(s, "erases: %lu trims: %lu discards: %lu\n",
+		   stats->erases, stats->trims, stats->discards);
+	seq_printf(s, "packed writes: %lu entries: %lu failures: %lu\n",
+		   stats->packed_writes, stats->packed_entries,
+		   stats->packed_failures);
+	seq_printf(s, "gc stalls: %lu (%llu us)\n", stats->gc_stalls,
+		   div_u64(stats->gc_stall_ns, NSEC_PER_USEC));
+	seq_printf(s, "bkops: %lu completed: %lu hpi: %lu interrupted: %lu "
+		   "(%llu us)\n", stats->bkops_starts, stats->bkops_completed,
+		   stats->bkops_hpi, stats->bkops_interrupted,
+		   div_u64(stats->bkops_ns, NSEC_PER_USEC));
+
+	kfree(stats);
+	return 0;
+}
+
+static int mmc_emu_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_emu_stats_show, inode->i_private);
+}
+
+static ssize_t mmc_emu_stats_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct mmc_emu_host *host =
+		((struct seq_file *)file->private_data)->private;
+
+	spin_lock(&host->stats_lock);
+	memset(&host->stats, 0, sizeof(host->stats));
+	spin_unlock(&host->stats_lock);
+	return count;
+}
+
+static const struct file_operations mmc_emu_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= mmc_emu_stats_open,
+	.read		= seq_read,
+	.write		= mmc_emu_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Device
+ */
+
+static int mmc_emu_open_store(struct mmc_emu_host *host)
+{
+	INIT_RADIX_TREE(&host->pages, GFP_NOIO);
+	host->sectors = (sector_t)size_mb << (20 - EMU_SECTOR_SHIFT);
+
+	if (backing_file) {
+		host->file = filp_open(backing_file,
+				       O_RDWR | O_LARGEFILE, 0);
+		if (IS_ERR(host->file)) {
+			int err = PTR_ERR(host->file);
+
+			host->file = NULL;
+			return err;
+		}
+		host->sectors = i_size_read(host->file->f_mapping->host) >>
+				EMU_SECTOR_SHIFT;
+	}
+
+	/* SEC_COUNT is 32 bits and only whole erase groups are used */
+	host->sectors = min_t(sector_t, host->sectors, 0xffffffff);
+	host->sectors = round_down(host->sectors, EMU_ERASE_SECTORS);
+	if (!host->sectors)
+		return -EINVAL;
+	return 0;
+}
+
+static void mmc_emu_close_store(struct mmc_emu_host *host)
+{
+	if (host->file)
+		filp_close(host->file, NULL);
+	else
+		mmc_emu_free_pages(host);
+}
+
+static int __devinit mmc_emu_probe(struct platform_device *pdev)
+{
+	struct mmc_emu_host *host;
+	struct mmc_host *mmc;
+	int ret;
+
+	mmc = mmc_alloc_host(sizeof(struct mmc_emu_host), &pdev->dev);
+	if (!mmc)
+		return -ENOMEM;
+
+	host = mmc_priv(mmc);
+	host->mmc = mmc;
+	spin_lock_init(&host->stats_lock);
+	INIT_WORK(&host->request_work, mmc_emu_request_work);
+
+	ret = -ENOMEM;
+	host->ext_csd = kzalloc(512, GFP_KERNEL);
+	if (!host->ext_csd)
+		goto err_free_host;
+
+	ret = mmc_emu_open_store(host);
+	if (ret) {
+		dev_err(&pdev->dev, "cannot set up the store: %d\n", ret);
+		goto err_free_ext_csd;
+	}
+	mmc_emu_init_regs(host);
+	mmc_emu_reset(host);
+
+	host->workqueue = create_singlethread_workqueue(DRIVER_NAME);
+	if (!host->workqueue) {
+		ret = -ENOMEM;
+		goto err_close_store;
+	}
+
+	mmc->ops = &mmc_emu_ops;
+	mmc->f_min = 400000;
+	mmc->f_max = 52000000;
+	mmc->ocr_avail = MMC_VDD_32_33 | MMC_VDD_33_34;
+	mmc->caps = MMC_CAP_8_BIT_DATA | MMC_CAP_4_BIT_DATA |
+		    MMC_CAP_MMC_HIGHSPEED | MMC_CAP_NONREMOVABLE |
+		    MMC_CAP_WAIT_WHILE_BUSY | MMC_CAP_ERASE | MMC_CAP_CMD23;
+	mmc->caps2 = MMC_CAP2_POWEROFF_NOTIFY | MMC_CAP2_NO_SLEEP_CMD |
+		     MMC_CAP2_HC_ERASE_SZ;
+	if (cache_kb)
+		mmc->caps2 |= MMC_CAP2_CACHE_CTRL;
+	if (max_packed)
+		mmc->caps2 |= MMC_CAP2_PACKED_WR;
+
+	/* data is copied by the CPU, so there are no DMA limits */
+	mmc->max_segs = 128;
+	mmc->max_blk_size = 512;
+	mmc->max_blk_count = 1024;
+	mmc->max_req_size = mmc->max_blk_count * mmc->max_blk_size;
+	mmc->max_seg_size = mmc->max_req_size;
+
+	platform_set_drvdata(pdev, mmc);
+
+	ret = mmc_add_host(mmc);
+	if (ret)
+		goto err_destroy_workqueue;
+
+	if (mmc->debugfs_root &&
+	    !debugfs_create_file("emu_stats", S_IRUSR | S_IWUSR,
+				 mmc->debugfs_root, host, &mmc_emu_stats_fops))
+		dev_err(&pdev->dev, "failed to create debugfs file\n");
+
+	dev_info(&pdev->dev, "%llu sectors in %s\n",
+		 (unsigned long long)host->sectors,
+		 backing_file ? backing_file : "RAM");
+	return 0;
+
+err_destroy_workqueue:
+	destroy_workqueue(host->workqueue);
+err_close_store:
+	mmc_emu_close_store(host);
+err_free_ext_csd:
+	kfree(host->ext_csd);
+err_free_host:
+	mmc_free_host(mmc);
+	return ret;
+}
+
+static int __devexit mmc_emu_remove(struct platform_device *pdev)
+{
+	struct mmc_host *mmc = platform_get_drvdata(pdev);
+	struct mmc_emu_host *host = mmc_priv(mmc);
+
+	mmc_remove_host(mmc);
+	destroy_workqueue(host->workqueue);
+	mmc_emu_close_store(host);
+	kfree(host->ext_csd);
+	platform_set_drvdata(pdev, NULL);
+	mmc_free_host(mmc);
+	return 0;
+}
+
+static struct platform_driver mmc_emu_driver = {
+	.probe		= mmc_emu_probe,
+	.remove		= __devexit_p(mmc_emu_remove),
+	.driver		= {
+		.name	= DRIVER_NAME,
+		.owner	= THIS_MODULE,
+	},
+};
+
+static u64 mmc_emu_dma_mask = DMA_BIT_MASK(64);
+
+static struct platform_device *mmc_emu_device;
+
+static int __init mmc_emu_init(void)
+{
+	struct platform_device *pdev;
+	int ret;
+
+	ret = platform_driver_register(&mmc_emu_driver);
+	if (ret)
+		return ret;
+
+	pdev = platform_device_alloc(DRIVER_NAME, -1);
+	if (!pdev) {
+		ret = -ENOMEM;
+		goto err_driver;
+	}
+	/* keeps the block layer from bouncing highmem pages */
+	pdev->dev.dma_mask = &mmc_emu_dma_mask;
+	pdev->dev.coherent_dma_mask = DMA_BIT_MASK(64);
+
+	ret = platform_device_add(pdev);
+	if (ret)
+		goto err_put;
+
+	mmc_emu_device = pdev;
+	return 0;
+
+err_put:
+	platform_device_put(pdev);
+err_driver:
+	platform_driver_unregister(&mmc_emu_driver);
+	return ret;
+}
+
+static void __exit mmc_emu_exit(void)
+{
+	platform_device_unregister(mmc_emu_device);
+	platform_driver_unregister(&mmc_emu_driver);
+}
+
+module_init(mmc_emu_init);
+module_exit(mmc_emu_exit);
+
+MODULE_DESCRIPTION("Emulated eMMC host controller");
+MODULE_LICENSE("GPL v2");
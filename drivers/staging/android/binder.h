@@ -35,8 +35,22 @@ enum {
 };
 
 enum {
+	/*
+	 * Minimum priority transactions to the node are served at, in
+	 * the node's policy: a nice value for SCHED_NORMAL/SCHED_BATCH,
+	 * an rt priority for SCHED_FIFO/SCHED_RR.
+	 */
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/*
+	 * Scheduling policy of the minimum priority above; only
+	 * SCHED_NORMAL, SCHED_FIFO, SCHED_RR and SCHED_BATCH fit.
+	 */
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK =
+		3U << FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT,
+	/* Let real-time callers hand their policy on to the node's threads */
+	FLAT_BINDER_FLAG_INHERIT_RT = 0x800,
 };
 
 /*
@@ -25,6 +25,8 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,16 +35,26 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers take no lock. Positions count every byte ever written to the log
+ * and are only turned into offsets into 'buffer' by logger_offset(), so they
+ * also serve as sequence numbers. A writer reserves [w_pos, w_pos + len) with
+ * a single atomic add. It then pushes 'tail' past the entries it is about to
+ * overwrite, copies its entry in, and publishes it by advancing 'c_pos'.
+ * Entries are published in the order they were reserved, so everything from
+ * 'tail' up to 'c_pos' can be read. A reader that finds its position behind
+ * 'tail' has been overrun and starts again at 'tail'.
  */
 struct logger_log {
 	unsigned char		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	struct mutex		mutex;	/* mutex protecting readers and head */
+	atomic_long_t		w_pos;	/* end of the last reserved entry */
+	atomic_long_t		c_pos;	/* end of the last published entry */
+	atomic_long_t		tail;	/* oldest entry not being overwritten */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
@@ -51,17 +63,20 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by its own mutex, which
+ * serializes readers sharing the file; log writers never take it.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	struct mutex		mutex;	/* mutex protecting this reader */
+	size_t			r_pos;	/* current read position */
+	size_t			r_lost;	/* bytes lost to overruns */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
 };
 
-/* logger_offset - returns index 'n' into the log via (optimized) modulus */
+/* logger_offset - returns index of position 'n' via (optimized) modulus */
 size_t logger_offset(struct logger_log *log, size_t n)
 {
 	return n & (log->size-1);
@@ -92,43 +107,49 @@ static inline struct logger_log *file_get_log(struct file *file)
 }
 
 /*
- * get_entry_header - returns a pointer to the logger_entry header within
- * 'log' starting at offset 'off'. A temporary logger_entry 'scratch' must
- * be provided. Typically the return value will be a pointer within
- * 'logger->buf'.  However, a pointer to 'scratch' may be returned if
- * the log entry spans the end and beginning of the circular buffer.
+ * get_entry_header - copies the logger_entry header of the entry at position
+ * 'pos' in 'log' into 'entry'. The header may span the end and beginning of
+ * the circular buffer, and a writer may be overwriting it while we copy, so
+ * the copy is only good once entry_intact() has said so.
  */
-static struct logger_entry *get_entry_header(struct logger_log *log,
-		size_t off, struct logger_entry *scratch)
+static void get_entry_header(struct logger_log *log, size_t pos,
+		struct logger_entry *entry)
 {
+	size_t off = logger_offset(log, pos);
 	size_t len = min(sizeof(struct logger_entry), log->size - off);
-	if (len != sizeof(struct logger_entry)) {
-		memcpy(((void *) scratch), log->buffer + off, len);
-		memcpy(((void *) scratch) + len, log->buffer,
+
+	memcpy(entry, log->buffer + off, len);
+	if (len != sizeof(struct logger_entry))
+		memcpy(((void *) entry) + len, log->buffer,
 			sizeof(struct logger_entry) - len);
-		return scratch;
-	}
+}
 
-	return (struct logger_entry *) (log->buffer + off);
+/*
+ * entry_intact - returns whether the entry at position 'pos' is still there
+ * after we read it. Writers push log->tail past an entry before they start
+ * overwriting it.
+ */
+static bool entry_intact(struct logger_log *log, size_t pos)
+{
+	smp_rmb();
+	return (long) (atomic_long_read(&log->tail) - pos) <= 0;
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
- *
- * An entry length is 2 bytes (16 bits) in host endian order.
- * In the log, the length does not include the size of the log entry structure.
- * This function returns the size including the log entry structure.
+ * fix_up_reader - pull 'reader' forward to the oldest intact entry if a
+ * writer lapped it. Any c_pos read after this is at least log->tail.
  *
- * Caller needs to hold log->mutex.
+ * Caller must hold reader->mutex.
  */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	size_t tail = atomic_long_read(&log->tail);
 
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+	if ((long) (tail - reader->r_pos) > 0) {
+		reader->r_lost += tail - reader->r_pos;
+		reader->r_pos = tail;
+	}
+	smp_rmb();
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -164,18 +185,19 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - reads exactly 'count' bytes of the entry 'entry'
+ * found at the reader's position into the user-space buffer 'buf'. Returns
+ * 'count' on success, or 0 if a writer overwrote the entry while we copied
+ * it, in which case the caller has to try again.
  *
- * Caller must hold log->mutex.
+ * Caller must hold reader->mutex.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
+				   struct logger_entry *entry,
 				   char __user *buf,
 				   size_t count)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
 	size_t len;
 	size_t msg_start;
 
@@ -183,14 +205,13 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
 	count -= get_user_hdr_len(reader->r_ver);
 	buf += get_user_hdr_len(reader->r_ver);
 	msg_start = logger_offset(log,
-		reader->r_off + sizeof(struct logger_entry));
+		reader->r_pos + sizeof(struct logger_entry));
 
 	/*
 	 * We read from the msg in two disjoint operations. First, we read from
@@ -209,34 +230,43 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
+	if (!entry_intact(log, reader->r_pos))
+		return 0;
+
+	reader->r_pos += sizeof(struct logger_entry) + count;
 
 	return count + get_user_hdr_len(reader->r_ver);
 }
 
 /*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
+ * get_next_entry - find the next entry 'reader' may read and copy its header
+ * into 'entry'. This pulls the reader forward if it was overrun and skips
+ * discarded entries and, unless the reader can read all entries, entries
+ * written by other users. Returns false if there is nothing to read.
+ *
+ * Caller must hold reader->mutex.
  */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
+static bool get_next_entry(struct logger_log *log,
+			   struct logger_reader *reader,
+			   struct logger_entry *entry)
 {
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
+	while (1) {
+		fix_up_reader(log, reader);
+		if ((long) (atomic_long_read(&log->c_pos) - reader->r_pos) <= 0)
+			return false;
 
-		entry = get_entry_header(log, off, &scratch);
+		/* pairs with the smp_mb() in logger_commit() */
+		smp_rmb();
+		get_entry_header(log, reader->r_pos, entry);
+		if (!entry_intact(log, reader->r_pos))
+			continue;
 
-		if (entry->euid == euid)
-			return off;
+		if (entry->hdr_size &&
+		    (reader->r_all || entry->euid == current_euid()))
+			return true;
 
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(log, off + next_len);
+		reader->r_pos += sizeof(struct logger_entry) + entry->len;
 	}
-
-	return off;
 }
 
 /*
@@ -256,19 +286,20 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	struct logger_entry entry;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
 start:
 	while (1) {
-		mutex_lock(&log->mutex);
-
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
-		if (!ret)
+		mutex_lock(&reader->mutex);
+		if (get_next_entry(log, reader, &entry)) {
+			ret = 0;
 			break;
+		}
+		mutex_unlock(&reader->mutex);
 
 		if (file->f_flags & O_NONBLOCK) {
 			ret = -EAGAIN;
@@ -287,153 +318,163 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
-
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
-
 	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
+	ret = get_user_hdr_len(reader->r_ver) + entry.len;
 	if (count < ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, reader, &entry, buf, ret);
+
+	/* were we lapped while copying? */
+	if (unlikely(!ret)) {
+		mutex_unlock(&reader->mutex);
+		goto start;
+	}
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_reserve - reserve 'len' bytes at the write head and returns their
+ * position. Before returning, pushes log->tail past every entry the
+ * reservation is going to overwrite, so readers stop trusting them.
  *
- * Caller must hold log->mutex.
+ * Called with preemption disabled.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static size_t logger_reserve(struct logger_log *log, size_t len)
 {
-	size_t count = 0;
+	size_t pos = atomic_long_add_return(len, &log->w_pos) - len;
 
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(log, off + nr);
-		count += nr;
-	} while (count < len);
+	while (1) {
+		size_t tail = atomic_long_read(&log->tail);
+		struct logger_entry entry;
 
-	return off;
-}
+		if (pos + len - tail <= log->size)
+			break;
 
-/*
- * is_between - is a < c < b, accounting for wrapping of a, b, and c
- *    positions in the buffer
- *
- * That is, if a<b, check for c between a and b
- * and if a>b, check for c outside (not between) a and b
- *
- * |------- a xxxxxxxx b --------|
- *               c^
- *
- * |xxxxx b --------- a xxxxxxxxx|
- *    c^
- *  or                    c^
- */
-static inline int is_between(size_t a, size_t b, size_t c)
-{
-	if (a < b) {
-		/* is c between a and b? */
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		/* is c outside of b through a? */
-		if (c <= b || a < c)
-			return 1;
+		/*
+		 * The oldest entry may still be in flight on another CPU, a
+		 * lap behind us; its length is only good once it is published.
+		 */
+		if ((long) (atomic_long_read(&log->c_pos) - tail) <= 0) {
+			cpu_relax();
+			continue;
+		}
+		smp_rmb();
+		get_entry_header(log, tail, &entry);
+
+		/* if we lose the race, 'entry' may be garbage; just retry */
+		atomic_long_cmpxchg(&log->tail, tail,
+			tail + sizeof(struct logger_entry) + entry.len);
 	}
 
-	return 0;
+	return pos;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * logger_commit - publish the 'len' bytes reserved at 'pos'. Entries are
+ * published in the order they were reserved, so first wait for the writers
+ * ahead of us. They run with preemption disabled too, so the wait is short.
  *
- * The caller needs to hold log->mutex.
+ * Called with preemption disabled.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void logger_commit(struct logger_log *log, size_t pos, size_t len)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(log, old + len);
-	struct logger_reader *reader;
-
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	while (atomic_long_read(&log->c_pos) != pos)
+		cpu_relax();
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	/* the entry must be visible before c_pos says it is there */
+	smp_mb();
+	atomic_long_set(&log->c_pos, pos + len);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at position 'pos'
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t pos,
+			 const void *buf, size_t count)
 {
+	size_t off = logger_offset(log, pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log, log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_from_user - writes 'count' bytes from the user-space buffer
+ * 'buf' to 'log' at position 'pos'
  *
- * The caller needs to hold log->mutex.
+ * Called with page faults disabled, so that we never sleep while holding a
+ * reservation.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t pos,
 				      const void __user *buf, size_t count)
 {
+	size_t off = logger_offset(log, pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && __copy_from_user_inatomic(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
+		if (__copy_from_user_inatomic(log->buffer, buf + len,
+					      count - len))
+			return -EFAULT;
+
+	return count;
+}
+
+/*
+ * logger_write_slow - writes the entry described by 'header' when its payload
+ * was not resident in memory. The payload is copied into a bounce buffer,
+ * which may sleep, and the entry is written from there.
+ *
+ * Returns the payload length on success, negative error code on failure.
+ */
+static ssize_t logger_write_slow(struct logger_log *log,
+				 struct logger_entry *header,
+				 const struct iovec *iov, unsigned long nr_segs)
+{
+	size_t count = 0;
+	size_t pos;
+	char *msg;
+
+	msg = kmalloc(header->len, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	while (nr_segs-- > 0 && count < header->len) {
+		size_t len = min_t(size_t, iov->iov_len, header->len - count);
+
+		if (copy_from_user(msg + count, iov->iov_base, len)) {
+			kfree(msg);
 			return -EFAULT;
+		}
+		iov++;
+		count += len;
+	}
+
+	preempt_disable();
+	pos = logger_reserve(log, sizeof(struct logger_entry) + count);
+	do_write_log(log, pos, header, sizeof(struct logger_entry));
+	do_write_log(log, pos + sizeof(struct logger_entry), msg, count);
+	logger_commit(log, pos, sizeof(struct logger_entry) + count);
+	preempt_enable();
 
-	log->w_off = logger_offset(log, log->w_off + count);
+	kfree(msg);
 
 	return count;
 }
@@ -447,9 +488,11 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	const struct iovec *seg = iov;
+	unsigned long segs = nr_segs;
 	struct logger_entry header;
 	struct timespec now;
+	size_t pos;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -466,41 +509,50 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Copy the payload straight from userspace into the reserved space.
+	 * Between reserving and publishing we must not sleep, as every later
+	 * writer waits for us to publish, so page faults are disabled. If the
+	 * payload is not resident, we still publish the space we reserved,
+	 * marked as discarded with a zero hdr_size, and go the slow way.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
+	preempt_disable();
+	pos = logger_reserve(log, sizeof(struct logger_entry) + header.len);
+	pagefault_disable();
+	while (segs-- > 0 && ret < header.len) {
 		size_t len;
 		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+		len = min_t(size_t, seg->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log,
+			pos + sizeof(struct logger_entry) + ret,
+			seg->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			ret = nr;
+			header.hdr_size = 0;
+			break;
 		}
 
-		iov++;
+		seg++;
 		ret += nr;
 	}
+	pagefault_enable();
+	do_write_log(log, pos, &header, sizeof(struct logger_entry));
+	logger_commit(log, pos, sizeof(struct logger_entry) + header.len);
+	preempt_enable();
+
+	if (unlikely(ret < 0)) {
+		header.hdr_size = sizeof(struct logger_entry);
+		ret = logger_write_slow(log, &header, iov, nr_segs);
+	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	/* wake up any blocked readers, pairs with prepare_to_wait() */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
 	return ret;
 }
@@ -534,13 +586,15 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		reader->r_ver = 1;
+		reader->r_lost = 0;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
 		INIT_LIST_HEAD(&reader->list);
+		mutex_init(&reader->mutex);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		reader->r_pos = log->head;
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -585,6 +639,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 {
 	struct logger_reader *reader;
 	struct logger_log *log;
+	struct logger_entry entry;
 	unsigned int ret = POLLOUT | POLLWRNORM;
 
 	if (!(file->f_mode & FMODE_READ))
@@ -595,14 +650,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	mutex_lock(&reader->mutex);
+	if (get_next_entry(log, reader, &entry))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -620,15 +671,64 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+/*
+ * logger_position - LOGGER_GET_POSITION and LOGGER_SET_POSITION, see logger.h
+ *
+ * Positions go to userspace as their low 32 bits. Only readers that can
+ * read all entries may set their position: one that does not land on an
+ * entry boundary would let read() return parts of other users' entries.
+ */
+static long logger_position(struct logger_reader *reader, unsigned int cmd,
+			    void __user *arg)
+{
+	struct logger_log *log = reader->log;
+	struct logger_position p;
+	long ret = 0;
+
+	if (cmd == LOGGER_SET_POSITION) {
+		if (!reader->r_all)
+			return -EPERM;
+		if (copy_from_user(&p, arg, sizeof(p)))
+			return -EFAULT;
+	}
+
+	mutex_lock(&reader->mutex);
+	if (cmd == LOGGER_SET_POSITION) {
+		size_t c_pos = atomic_long_read(&log->c_pos);
+		__s32 behind = (__u32) c_pos - p.pos;
+		size_t pos = c_pos - behind;
+
+		if (behind < 0) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if ((long) (pos - reader->r_pos) > 0)
+			reader->r_pos = pos;
+	}
+
+	fix_up_reader(log, reader);
+	p.pos = reader->r_pos;
+	p.end = atomic_long_read(&log->c_pos);
+	p.tail = atomic_long_read(&log->tail);
+	p.lost = reader->r_lost;
+	reader->r_lost = 0;
+
+	if (copy_to_user(arg, &p, sizeof(p)))
+		ret = -EFAULT;
+out:
+	mutex_unlock(&reader->mutex);
+
+	return ret;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_entry entry;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
-	mutex_lock(&log->mutex);
-
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
 		ret = log->size;
@@ -639,10 +739,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		mutex_lock(&reader->mutex);
+		fix_up_reader(log, reader);
+		ret = atomic_long_read(&log->c_pos) - reader->r_pos;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -651,15 +751,12 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		mutex_lock(&reader->mutex);
+		if (get_next_entry(log, reader, &entry))
+			ret = get_user_hdr_len(reader->r_ver) + entry.len;
 		else
 			ret = 0;
+		mutex_unlock(&reader->mutex);
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
@@ -671,9 +768,14 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EPERM;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		mutex_lock(&log->mutex);
+		log->head = atomic_long_read(&log->c_pos);
+		list_for_each_entry(reader, &log->readers, list) {
+			mutex_lock(&reader->mutex);
+			reader->r_pos = log->head;
+			mutex_unlock(&reader->mutex);
+		}
+		mutex_unlock(&log->mutex);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -690,20 +792,71 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
+		mutex_lock(&reader->mutex);
 		ret = logger_set_version(reader, argp);
+		mutex_unlock(&reader->mutex);
+		break;
+	case LOGGER_GET_POSITION:
+	case LOGGER_SET_POSITION:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = logger_position(reader, cmd, argp);
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation, for batched reads
+ *
+ * Maps the log read-only, once or twice back to back, see logger.h. The
+ * mapping shows every entry, so only readers that can read all entries
+ * get one.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader = file->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct logger_log *log;
+	unsigned long off;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	log = reader->log;
+	if (!reader->r_all || (vma->vm_flags & VM_WRITE))
+		return -EPERM;
+	if (vma->vm_pgoff || (size != log->size && size != 2 * log->size))
+		return -EINVAL;
+
+	/* no mprotect() to writable later, and no COW to get in the way */
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/* the buffer is vmalloc()ed, so it goes in a page at a time */
+	for (off = 0; off < size; off += PAGE_SIZE) {
+		struct page *page;
+
+		page = vmalloc_to_page(log->buffer + (off & (log->size - 1)));
+		ret = vm_insert_page(vma, vma->vm_start + off, page);
+		if (ret)
+			return ret;
+	}
+	vma->vm_flags |= VM_RESERVED;
+
+	return 0;
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -712,13 +865,13 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * must be a power of two, a multiple of PAGE_SIZE so that it can be mapped,
+ * and greater than (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * The buffer itself is allocated by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
+	.buffer = NULL, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -728,7 +881,9 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
+	.w_pos = ATOMIC_LONG_INIT(0), \
+	.c_pos = ATOMIC_LONG_INIT(0), \
+	.tail = ATOMIC_LONG_INIT(0), \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -755,10 +910,20 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	/* zeroed, and allowed to be mapped into user space */
+	log->buffer = vmalloc_user(log->size);
+	if (unlikely(!log->buffer)) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->buffer);
+		log->buffer = NULL;
 		return ret;
 	}
 
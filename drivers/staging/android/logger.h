@@ -58,6 +58,35 @@ struct logger_entry {
 
 #define LOGGER_ENTRY_MAX_PAYLOAD	4076
 
+/*
+ * Batched reads. A reader that may read every entry can mmap() the log
+ * read-only from offset 0. The mapping is either the log size, or twice
+ * that to map the log twice back to back, so that no entry wraps around
+ * the end. The log is a sequence of struct logger_entry, each followed by
+ * its payload. An entry with a zero hdr_size was discarded and should be
+ * skipped.
+ *
+ * Positions count bytes and wrap, so compare them with signed differences.
+ * The entry at position 'pos' starts at offset (pos & (size - 1)). A batch
+ * goes like this:
+ *
+ *  1. LOGGER_GET_POSITION gives the reader's position 'pos' and the end of
+ *     the published entries 'end'.
+ *  2. Consume the entries from 'pos' to 'end' from the mapping.
+ *  3. LOGGER_SET_POSITION moves the reader to the given 'pos', normally the
+ *     old 'end', and reports the new state. Writers may have overwritten
+ *     anything consumed from before the returned 'tail'.
+ *
+ * 'lost' counts the bytes the reader missed because writers lapped it
+ * since the last of these calls.
+ */
+struct logger_position {
+	__u32		pos;		/* reader position */
+	__u32		end;		/* end of the published entries */
+	__u32		tail;		/* oldest entry not being overwritten */
+	__u32		lost;		/* bytes lost to overruns */
+};
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
@@ -66,5 +95,7 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_GET_POSITION		_IOR(__LOGGERIO, 7, struct logger_position)
+#define LOGGER_SET_POSITION		_IOWR(__LOGGERIO, 8, struct logger_position)
 
 #endif /* _LINUX_LOGGER_H */
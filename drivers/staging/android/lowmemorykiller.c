@@ -17,6 +17,26 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are tracked in buckets by oom_score_adj as they fork, exit and
+ * have their oom_score_adj changed, so picking the victim only walks the
+ * processes that may be killed. The lowmemorykiller:lowmem_select tracepoint
+ * reports how long each selection took.
+ *
+ * Writing 1 to /sys/module/lowmemorykiller/parameters/pressure_mode moves
+ * the kill decision to a kernel thread which is woken when reclaim stops
+ * making progress. More than pressure_min percent of the scanned pages not
+ * being reclaimed wakes it; it then applies the minfree levels to the zones
+ * usable by the allocation, with swap_credit percent of the anonymous pages
+ * that still fit into free swap counted as file pages. Above
+ * pressure_critical percent it kills at the largest minfree level even if
+ * free memory looks sufficient, as the page cache is likely thrashing.
+ *
+ * A victim's anonymous memory is unmapped by the lowmem_reaper thread
+ * right after the kill, and any later fault in it fails with SIGBUS. The
+ * lowmemorykiller:lowmem_reap tracepoint reports the pages freed and the
+ * time since the kill. Memory is compacted afterwards if at least
+ * reap_compact_pages were freed.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -41,6 +61,15 @@
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
 #include <linux/compaction.h>
+#include <linux/spinlock.h>
+#include <linux/bitmap.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/vmstat.h>
+#include <linux/delay.h>
+
+#include "lowmemorykiller_trace.h"
 
 static uint32_t lowmem_debug_level = 1;
 static int lowmem_adj[6] = {
@@ -68,89 +97,361 @@ extern int compact_nodes();
 			pr_info(x);			\
 	} while (0)
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * Thread group leaders are kept in one bucket per oom_score_adj value,
+ * highest value first, so that choosing a victim only has to look at
+ * the tasks which may be killed at the current level of pressure.
+ * lowmem_bucket_map has a bit set for every bucket that may be in use;
+ * bits of buckets found empty are cleared while selecting.
+ */
+#define LOWMEM_NR_BUCKETS	(OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN + 1)
+
+static struct hlist_head lowmem_buckets[LOWMEM_NR_BUCKETS];
+static DECLARE_BITMAP(lowmem_bucket_map, LOWMEM_NR_BUCKETS);
+static DEFINE_SPINLOCK(lowmem_bucket_lock);
+
+/* the last task we killed, until it is released */
+static struct task_struct *lowmem_deathpending;
+
+static inline int lowmem_bucket(int oom_score_adj)
+{
+	return OOM_SCORE_ADJ_MAX - oom_score_adj;
+}
+
+static void __lowmem_task_add(struct task_struct *task)
+{
+	int b = lowmem_bucket(task->signal->oom_score_adj);
+
+	hlist_add_head(&task->lowmem_node, &lowmem_buckets[b]);
+	__set_bit(b, lowmem_bucket_map);
+}
+
+/* called for a new thread group leader, before it first runs */
+void lowmem_task_add(struct task_struct *task)
+{
+	spin_lock(&lowmem_bucket_lock);
+	__lowmem_task_add(task);
+	spin_unlock(&lowmem_bucket_lock);
+}
+
+/* called for every task as it is released; a no-op for non-leaders */
+void lowmem_task_del(struct task_struct *task)
+{
+	spin_lock(&lowmem_bucket_lock);
+	if (!hlist_unhashed(&task->lowmem_node))
+		hlist_del_init(&task->lowmem_node);
+	if (task == lowmem_deathpending)
+		lowmem_deathpending = NULL;
+	spin_unlock(&lowmem_bucket_lock);
+}
+
+/*
+ * Called after oom_score_adj of the thread group of @task changed.
+ * The value is read again under the lock, so that the last of several
+ * concurrent writers leaves the task in the right bucket.
+ */
+void lowmem_task_update(struct task_struct *task)
+{
+	struct task_struct *leader;
+
+	rcu_read_lock();
+	leader = ACCESS_ONCE(task->group_leader);
+	spin_lock(&lowmem_bucket_lock);
+	if (!hlist_unhashed(&leader->lowmem_node)) {
+		hlist_del(&leader->lowmem_node);
+		__lowmem_task_add(leader);
+	}
+	spin_unlock(&lowmem_bucket_lock);
+	rcu_read_unlock();
+}
+
+/*
+ * The reaper frees the anonymous memory of a victim right after the kill
+ * rather than waiting for the victim to get scheduled and exit, much
+ * like madvise(MADV_DONTNEED) would.
+ */
+static int lowmem_reap_compact_pages = 4 * 1024;	/* 16MB */
+
+static DEFINE_SPINLOCK(lowmem_reap_lock);
+static LIST_HEAD(lowmem_reap_list);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_reap_wait);
+static struct task_struct *lowmem_reaper_task;
+
+/* hand a reference to a killed task over to the reaper */
+static void lowmem_reap_queue(struct task_struct *victim)
+{
+	spin_lock(&lowmem_reap_lock);
+	if (!list_empty(&victim->lowmem_reap_node)) {
+		/* still queued from an earlier kill */
+		spin_unlock(&lowmem_reap_lock);
+		put_task_struct(victim);
+		return;
+	}
+	victim->lowmem_killed = ktime_get();
+	list_add_tail(&victim->lowmem_reap_node, &lowmem_reap_list);
+	spin_unlock(&lowmem_reap_lock);
+	wake_up(&lowmem_reap_wait);
+}
+
+static struct task_struct *lowmem_reap_dequeue(void)
+{
+	struct task_struct *victim = NULL;
+
+	spin_lock(&lowmem_reap_lock);
+	if (!list_empty(&lowmem_reap_list)) {
+		victim = list_first_entry(&lowmem_reap_list,
+					  struct task_struct,
+					  lowmem_reap_node);
+		list_del_init(&victim->lowmem_reap_node);
+	}
+	spin_unlock(&lowmem_reap_lock);
+	return victim;
+}
+
+/* is @mm also used by a process other than @victim? */
+static bool lowmem_mm_shared(struct task_struct *victim, struct mm_struct *mm)
+{
+	struct task_struct *p, *t;
+	bool shared = false;
+
+	rcu_read_lock();
+	for_each_process(p) {
+		if (same_thread_group(p, victim) || (p->flags & PF_KTHREAD))
+			continue;
+		t = p;
+		do {
+			if (ACCESS_ONCE(t->mm) == mm) {
+				shared = true;
+				goto out;
+			}
+		} while_each_thread(p, t);
+	}
+out:
+	rcu_read_unlock();
+	return shared;
+}
+
+/*
+ * Unmap the anonymous mappings of @victim, returning the pages freed.
+ * File backed and shared mappings are left to exit_mmap(): their pages
+ * are not freed by unmapping them anyway. The victim may still be
+ * running, so its mm is marked first to make any later fault fail
+ * rather than hand it zero pages in place of its data.
+ */
+static unsigned long lowmem_reap(struct task_struct *victim)
+{
+	struct task_struct *p;
+	struct mm_struct *mm = NULL;
+	struct vm_area_struct *vma;
+	unsigned long before, after;
+	unsigned long reaped = 0;
+	int attempts;
+
+	p = find_lock_task_mm(victim);
+	if (!p)
+		return 0;
+	/* pinning mm_users keeps exit_mmap() from running under us */
+	if (atomic_inc_not_zero(&p->mm->mm_users))
+		mm = p->mm;
+	task_unlock(p);
+	if (!mm)
+		return 0;
+
+	if (lowmem_mm_shared(victim, mm))
+		goto out_mmput;
+
+	/* the victim may hold mmap_sem for write; it is about to drop it */
+	for (attempts = 0; !down_read_trylock(&mm->mmap_sem); attempts++) {
+		if (attempts == 10)
+			goto out_mmput;
+		msleep(100);
+	}
+
+	set_bit(MMF_UNSTABLE, &mm->flags);
+
+	before = get_mm_counter(mm, MM_ANONPAGES);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (vma->vm_file || (vma->vm_flags & (VM_LOCKED | VM_HUGETLB |
+						       VM_PFNMAP | VM_SHARED)))
+			continue;
+		zap_page_range(vma, vma->vm_start,
+			       vma->vm_end - vma->vm_start, NULL);
+	}
+	after = get_mm_counter(mm, MM_ANONPAGES);
+	up_read(&mm->mmap_sem);
+	if (before > after)
+		reaped = before - after;
+
+out_mmput:
+	mmput(mm);
+	return reaped;
+}
+
+static int lowmem_reaper(void *data)
+{
+	struct task_struct *victim;
+	unsigned long reaped;
+	s64 reap_ns;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_reap_wait,
+				!list_empty(&lowmem_reap_list) ||
+				kthread_should_stop());
+		victim = lowmem_reap_dequeue();
+		if (!victim)
+			continue;
+
+		reaped = lowmem_reap(victim);
+		reap_ns = ktime_to_ns(ktime_sub(ktime_get(),
+						victim->lowmem_killed));
+		trace_lowmem_reap(victim->pid, reaped, reap_ns);
+		lowmem_print(2, "reaped %lukB from '%s' (%d) %lldus after the kill\n",
+			     reaped * (PAGE_SIZE / 1024), victim->comm,
+			     victim->pid, div_s64(reap_ns, NSEC_PER_USEC));
+
+		if (reaped) {
+			/*
+			 * Its memory is gone already, so do not let the victim
+			 * hold up the next kill or dip further into reserves.
+			 */
+			spin_lock(&lowmem_bucket_lock);
+			if (lowmem_deathpending == victim->group_leader)
+				lowmem_deathpending = NULL;
+			spin_unlock(&lowmem_bucket_lock);
+			clear_tsk_thread_flag(victim, TIF_MEMDIE);
+		}
+		put_task_struct(victim);
+
+		if (reaped >= lowmem_reap_compact_pages)
+			compact_nodes(false);
+	}
+
+	while ((victim = lowmem_reap_dequeue()))
+		put_task_struct(victim);
+	return 0;
+}
+
+static int lowmem_array_size(void)
 {
-	struct task_struct *tsk;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
-	int i;
-	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
-	int minfree = 0;
-	int selected_tasksize = 0;
-	int selected_oom_score_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
-	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
+	return array_size;
+}
+
+/* index of the first minfree level both counts are below, or -1 */
+static int lowmem_level(int other_free, int other_file)
+{
+	int array_size = lowmem_array_size();
+	int i;
+
 	for (i = 0; i < array_size; i++) {
-		minfree = lowmem_minfree[i];
-		if (other_free < minfree && other_file < minfree) {
-			min_score_adj = lowmem_adj[i];
-			break;
-		}
-	}
-	if (sc->nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
-				sc->nr_to_scan, sc->gfp_mask, other_free,
-				other_file, min_score_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
-			     sc->nr_to_scan, sc->gfp_mask, rem);
-		return rem;
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i])
+			return i;
 	}
+	return -1;
+}
+
+/*
+ * Kill the largest task in the highest non-empty bucket at or above
+ * @min_score_adj. Returns the number of pages the victim holds, 0 if
+ * there was none, or -1 while an earlier victim is still dying.
+ */
+static int lowmem_kill(int min_score_adj, int minfree, int other_free,
+		       int other_file)
+{
+	struct task_struct *tsk;
+	struct task_struct *selected = NULL;
+	struct task_struct *selected_leader = NULL;
+	struct hlist_node *pos;
+	int tasksize;
+	int b, last;
+	int selected_tasksize = 0;
+	int selected_oom_score_adj;
+	int nr_scanned = 0;
+	pid_t selected_pid = 0;
+	ktime_t start;
+	s64 select_ns;
+
+	if (min_score_adj < OOM_SCORE_ADJ_MIN)
+		min_score_adj = OOM_SCORE_ADJ_MIN;
 	selected_oom_score_adj = min_score_adj;
 
+	start = ktime_get();
+	/* the bucket lock does not keep the leaders' threads around */
 	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+	spin_lock(&lowmem_bucket_lock);
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		spin_unlock(&lowmem_bucket_lock);
+		rcu_read_unlock();
+		return -1;
+	}
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+	/* highest oom_score_adj first; stop at the first bucket with a task */
+	last = lowmem_bucket(min_score_adj);
+	for (b = find_first_bit(lowmem_bucket_map, last + 1); b <= last;
+	     b = find_next_bit(lowmem_bucket_map, last + 1, b + 1)) {
+		int oom_score_adj = OOM_SCORE_ADJ_MAX - b;
 
-		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
-		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			task_unlock(p);
-			rcu_read_unlock();
-			return 0;
-		}
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
+		if (hlist_empty(&lowmem_buckets[b])) {
+			__clear_bit(b, lowmem_bucket_map);
 			continue;
 		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
+		hlist_for_each_entry(tsk, pos, &lowmem_buckets[b],
+				     lowmem_node) {
+			struct task_struct *p;
+
+			if (tsk->flags & PF_KTHREAD)
+				continue;
+
+			nr_scanned++;
+			p = find_lock_task_mm(tsk);
+			if (!p)
 				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
+
+			if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
+			    time_before_eq(jiffies,
+					   lowmem_deathpending_timeout)) {
+				task_unlock(p);
+				spin_unlock(&lowmem_bucket_lock);
+				rcu_read_unlock();
+				return -1;
+			}
+			/* already dying, e.g. a victim the reaper is done with */
+			if (fatal_signal_pending(p)) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= selected_tasksize)
 				continue;
+			selected = p;
+			selected_leader = tsk;
+			selected_tasksize = tasksize;
+			selected_oom_score_adj = oom_score_adj;
+			lowmem_print(2, "select '%s' (%d), adj %d, size %d, to kill\n",
+				     p->comm, p->pid, oom_score_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select '%s' (%d), adj %d, size %d, to kill\n",
-			     p->comm, p->pid, oom_score_adj, tasksize);
+		if (selected)
+			break;
+	}
+	select_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	if (selected) {
+		get_task_struct(selected);
+		lowmem_deathpending = selected_leader;
+		lowmem_deathpending_timeout = jiffies + HZ;
 	}
+	spin_unlock(&lowmem_bucket_lock);
+	rcu_read_unlock();
+
 	if (selected) {
+		selected_pid = selected->pid;
 		lowmem_print(1, "Killing '%s' (%d), adj %d,\n" \
 				"   to free %ldkB on behalf of '%s' (%d) because\n" \
 				"   cache %ldkB is below limit %ldkB for oom_score_adj %d\n" \
@@ -163,16 +464,200 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     minfree * (long)(PAGE_SIZE / 1024),
 			     min_score_adj,
 			     other_free * (long)(PAGE_SIZE / 1024));
-		lowmem_deathpending_timeout = jiffies + HZ;
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
-		rem -= selected_tasksize;
+		lowmem_reap_queue(selected);
+	}
+	trace_lowmem_select(min_score_adj, nr_scanned, selected_pid,
+			    selected_oom_score_adj, selected_tasksize, select_ns);
+	return selected_tasksize;
+}
+
+/*
+ * Pressure mode: instead of killing from inside the shrinker when the
+ * global free and file counts drop below minfree, the shrinker only
+ * samples how efficiently reclaim is progressing and wakes the kill
+ * thread once it gets poor. The thread then checks minfree against the
+ * zones the allocation could actually use, counting part of the free
+ * swap as reclaimable, and kills at the largest minfree level anyway
+ * when reclaim is hardly making progress at all.
+ */
+static bool lowmem_pressure_mode;
+static int lowmem_pressure_min = 60;
+static int lowmem_pressure_critical = 95;
+static int lowmem_swap_credit = 50;
+
+/* pages to be scanned between two pressure samples */
+#define LOWMEM_PRESSURE_WINDOW	(SWAP_CLUSTER_MAX * 16)
+
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static unsigned long lowmem_last_scanned;
+static unsigned long lowmem_last_reclaimed;
+static gfp_t lowmem_pressure_gfp;
+/* last pressure sample + 1, or 0 once the kill thread consumed it */
+static atomic_t lowmem_pressure_event;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_wait);
+static struct task_struct *lowmem_task;
+
+static void lowmem_vm_events(unsigned long *scanned, unsigned long *reclaimed)
+{
+	int cpu, i;
+
+	*scanned = 0;
+	*reclaimed = 0;
+	for_each_possible_cpu(cpu) {
+		struct vm_event_state *this = &per_cpu(vm_event_states, cpu);
+
+		for (i = 0; i < MAX_NR_ZONES; i++) {
+			*scanned += this->event[PGSCAN_KSWAPD_NORMAL -
+						ZONE_NORMAL + i];
+			*scanned += this->event[PGSCAN_DIRECT_NORMAL -
+						ZONE_NORMAL + i];
+			*reclaimed += this->event[PGSTEAL_KSWAPD_NORMAL -
+						  ZONE_NORMAL + i];
+			*reclaimed += this->event[PGSTEAL_DIRECT_NORMAL -
+						  ZONE_NORMAL + i];
+		}
+	}
+}
+
+/*
+ * Share of the pages scanned since the last sample that could not be
+ * reclaimed, in percent, or -1 if less than a window was scanned.
+ */
+static int lowmem_sample_pressure(void)
+{
+	unsigned long scanned, reclaimed;
+	unsigned long delta_scanned, delta_reclaimed;
+	int pressure = -1;
+
+	if (!spin_trylock(&lowmem_pressure_lock))
+		return -1;
+	lowmem_vm_events(&scanned, &reclaimed);
+	delta_scanned = scanned - lowmem_last_scanned;
+	delta_reclaimed = reclaimed - lowmem_last_reclaimed;
+	if (delta_scanned >= LOWMEM_PRESSURE_WINDOW) {
+		if (delta_reclaimed > delta_scanned)
+			delta_reclaimed = delta_scanned;
+		pressure = 100 - delta_reclaimed * 100 / delta_scanned;
+		lowmem_last_scanned = scanned;
+		lowmem_last_reclaimed = reclaimed;
+	}
+	spin_unlock(&lowmem_pressure_lock);
+	return pressure;
+}
+
+static void lowmem_pressure_notify(gfp_t gfp_mask)
+{
+	int pressure = lowmem_sample_pressure();
+
+	if (pressure < 0 || pressure < lowmem_pressure_min)
+		return;
+	lowmem_print(3, "pressure %d, %x\n", pressure, gfp_mask);
+	lowmem_pressure_gfp = gfp_mask;
+	atomic_set(&lowmem_pressure_event, pressure + 1);
+	wake_up(&lowmem_wait);
+}
+
+/*
+ * Free and file pages in the zones an allocation with @gfp_mask may be
+ * satisfied from, above their high watermarks. Anonymous pages which
+ * still fit into free swap are credited as file pages, discounted by
+ * swap_credit percent since swapping them to compressed swap does not
+ * free all of their memory.
+ */
+static void lowmem_zone_free(gfp_t gfp_mask, int *other_free, int *other_file)
+{
+	enum zone_type high_zoneidx = gfp_zone(gfp_mask);
+	struct zone *zone;
+	long free = 0, file = 0, anon = 0, swap;
+
+	for_each_populated_zone(zone) {
+		if (zone_idx(zone) > high_zoneidx)
+			continue;
+		free += zone_page_state(zone, NR_FREE_PAGES) -
+			high_wmark_pages(zone);
+		file += zone_page_state(zone, NR_FILE_PAGES) -
+			zone_page_state(zone, NR_SHMEM);
+		anon += zone_page_state(zone, NR_ACTIVE_ANON) +
+			zone_page_state(zone, NR_INACTIVE_ANON);
+	}
+	swap = min(nr_swap_pages, anon) * lowmem_swap_credit / 100;
+	*other_free = free;
+	*other_file = file + swap;
+}
+
+static int lowmem_kill_thread(void *data)
+{
+	while (!kthread_should_stop()) {
+		int other_free, other_file;
+		int pressure, level;
+
+		wait_event_interruptible(lowmem_wait,
+				atomic_read(&lowmem_pressure_event) ||
+				kthread_should_stop());
+		pressure = atomic_xchg(&lowmem_pressure_event, 0) - 1;
+		if (pressure < 0 || !lowmem_pressure_mode)
+			continue;
+
+		lowmem_zone_free(lowmem_pressure_gfp, &other_free,
+				 &other_file);
+		level = lowmem_level(other_free, other_file);
+		if (level < 0 && pressure >= lowmem_pressure_critical)
+			level = lowmem_array_size() - 1;
+		lowmem_print(3, "pressure %d, ofree %d %d, level %d\n",
+			     pressure, other_free, other_file, level);
+		if (level < 0)
+			continue;
+		lowmem_kill(lowmem_adj[level], lowmem_minfree[level],
+			    other_free, other_file);
+	}
+	return 0;
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem = 0;
+	int level, killed;
+	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int minfree = 0;
+	int other_free, other_file;
+
+	rem = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_ACTIVE_FILE) +
+		global_page_state(NR_INACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_FILE);
+
+	if (lowmem_pressure_mode) {
+		if (sc->nr_to_scan > 0)
+			lowmem_pressure_notify(sc->gfp_mask);
+		return rem;
+	}
+
+	other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
+	other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+	level = lowmem_level(other_free, other_file);
+	if (level >= 0) {
+		min_score_adj = lowmem_adj[level];
+		minfree = lowmem_minfree[level];
+	}
+	if (sc->nr_to_scan > 0)
+		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
+				sc->nr_to_scan, sc->gfp_mask, other_free,
+				other_file, min_score_adj);
+	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
+		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
+			     sc->nr_to_scan, sc->gfp_mask, rem);
+		return rem;
 	}
+
+	killed = lowmem_kill(min_score_adj, minfree, other_free, other_file);
+	if (killed < 0)
+		return 0;
+	rem -= killed;
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	rcu_read_unlock();
-	if (selected)
-		compact_nodes(false);
 	return rem;
 }
 
@@ -183,6 +668,14 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	lowmem_reaper_task = kthread_run(lowmem_reaper, NULL, "lowmem_reaper");
+	if (IS_ERR(lowmem_reaper_task))
+		return PTR_ERR(lowmem_reaper_task);
+	lowmem_task = kthread_run(lowmem_kill_thread, NULL, "lowmemorykiller");
+	if (IS_ERR(lowmem_task)) {
+		kthread_stop(lowmem_reaper_task);
+		return PTR_ERR(lowmem_task);
+	}
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -190,6 +683,8 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	kthread_stop(lowmem_task);
+	kthread_stop(lowmem_reaper_task);
 }
 
 #ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_AUTODETECT_OOM_ADJ_VALUES
@@ -283,9 +778,20 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_mode, lowmem_pressure_mode, bool,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_min, lowmem_pressure_min, int, S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(swap_credit, lowmem_swap_credit, int, S_IRUGO | S_IWUSR);
+module_param_named(reap_compact_pages, lowmem_reap_compact_pages, int,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
+
 MODULE_LICENSE("GPL");
 
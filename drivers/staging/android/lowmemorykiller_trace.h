@@ -0,0 +1,75 @@
+/*
+ * Tracepoints for the Android low memory killer
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_select,
+	TP_PROTO(int min_score_adj, int nr_scanned, pid_t pid,
+		 int oom_score_adj, int tasksize, s64 select_ns),
+	TP_ARGS(min_score_adj, nr_scanned, pid, oom_score_adj, tasksize,
+		select_ns),
+
+	TP_STRUCT__entry(
+		__field(int, min_score_adj)
+		__field(int, nr_scanned)
+		__field(pid_t, pid)
+		__field(int, oom_score_adj)
+		__field(int, tasksize)
+		__field(s64, select_ns)
+	),
+	TP_fast_assign(
+		__entry->min_score_adj = min_score_adj;
+		__entry->nr_scanned = nr_scanned;
+		__entry->pid = pid;
+		__entry->oom_score_adj = oom_score_adj;
+		__entry->tasksize = tasksize;
+		__entry->select_ns = select_ns;
+	),
+	TP_printk("min_score_adj=%d scanned=%d pid=%d oom_score_adj=%d size=%d select_ns=%lld",
+		  __entry->min_score_adj, __entry->nr_scanned, __entry->pid,
+		  __entry->oom_score_adj, __entry->tasksize,
+		  __entry->select_ns)
+);
+
+TRACE_EVENT(lowmem_reap,
+	TP_PROTO(pid_t pid, unsigned long reaped, s64 reap_ns),
+	TP_ARGS(pid, reaped, reap_ns),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(unsigned long, reaped)
+		__field(s64, reap_ns)
+	),
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->reaped = reaped;
+		__entry->reap_ns = reap_ns;
+	),
+	TP_printk("pid=%d reaped=%lu reap_ns=%lld",
+		  __entry->pid, __entry->reaped, __entry->reap_ns)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+#include <trace/define_trace.h>
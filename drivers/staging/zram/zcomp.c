@@ -0,0 +1,284 @@
+/*
+ * Compression streams for the compressed RAM block device
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+
+#include "zcomp.h"
+#include "zcomp_lzo.h"
+#ifdef CONFIG_ZRAM_LZ4_COMPRESS
+#include "zcomp_lz4.h"
+#endif
+
+static struct zcomp_backend *backends[] = {
+	&zcomp_lzo,
+#ifdef CONFIG_ZRAM_LZ4_COMPRESS
+	&zcomp_lz4,
+#endif
+	NULL
+};
+
+int zcomp_backend_id(const char *comp)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (sysfs_streq(comp, backends[i]->name))
+			return i;
+	}
+	return -1;
+}
+
+const char *zcomp_backend_name(int id)
+{
+	if (id < 0 || id >= ARRAY_SIZE(backends) - 1)
+		return NULL;
+	return backends[id]->name;
+}
+
+/* show available compressors, marking the selected one with [] */
+ssize_t zcomp_available_show(const char *comp, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (sysfs_streq(comp, backends[i]->name))
+			sz += sprintf(buf + sz, "[%s] ", backends[i]->name);
+		else
+			sz += sprintf(buf + sz, "%s ", backends[i]->name);
+	}
+	sz += sprintf(buf + sz, "\n");
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	if (zstrm->private)
+		comp->backend->destroy(zstrm->private);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Streams are allocated from the write path, which may itself be
+ * reclaiming memory on behalf of swap, so never recurse into I/O.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp, gfp_t flags)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = kmalloc(sizeof(*zstrm), flags);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->private = comp->backend->create(flags);
+	/*
+	 * allocate 2 pages. 1 for compressed data, plus 1 extra for the
+	 * case when compressed size is larger than the original one
+	 */
+	zstrm->buffer = (void *)__get_free_pages(flags | __GFP_ZERO, 1);
+	if (!zstrm->private || !zstrm->buffer) {
+		zcomp_strm_free(comp, zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/* either an idle stream or room to allocate a new one */
+static bool zcomp_strm_available(struct zcomp *comp)
+{
+	return !list_empty(&comp->idle_strm) ||
+		comp->avail_strm < comp->max_strm;
+}
+
+/*
+ * Get an idle stream or allocate a new one if we are still below
+ * max_strm. Otherwise sleep until another writer releases one.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_entry(comp->idle_strm.next,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+
+		/* stream limit reached: wait for a released one */
+		if (comp->avail_strm >= comp->max_strm) {
+			spin_unlock(&comp->strm_lock);
+			wait_event(comp->strm_wait,
+					zcomp_strm_available(comp));
+			continue;
+		}
+
+		/* allocate a new stream, dropping the lock meanwhile */
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp, GFP_NOIO);
+		if (zstrm)
+			return zstrm;
+
+		/* out of memory: fall back to waiting for an existing one */
+		spin_lock(&comp->strm_lock);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+/* add stream back to idle list and wake up a waiter, or free it */
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(comp, zstrm);
+}
+
+/*
+ * Change max_strm. Extra idle streams are freed right away; streams
+ * which are busy are freed as they get released.
+ */
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	struct zcomp_strm *zstrm;
+
+	if (num_strm < 1)
+		return -EINVAL;
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = num_strm;
+	while (comp->avail_strm > num_strm &&
+			!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		zcomp_strm_free(comp, zstrm);
+		spin_lock(&comp->strm_lock);
+	}
+	spin_unlock(&comp->strm_lock);
+
+	/* writers may be waiting for the room we just made */
+	wake_up_all(&comp->strm_wait);
+
+	return 0;
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len)
+{
+	int ret;
+	ktime_t start = ktime_get();
+
+	ret = comp->backend->compress(src, zstrm->buffer, dst_len,
+			zstrm->private);
+
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+			&comp->stats->compress_ns);
+	atomic64_inc(&comp->stats->num_compress);
+	if (!ret) {
+		atomic64_add(PAGE_SIZE, &comp->stats->orig_size);
+		atomic64_add(*dst_len, &comp->stats->compr_size);
+	}
+	return ret;
+}
+
+int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
+		size_t src_len, unsigned char *dst)
+{
+	int ret;
+	ktime_t start = ktime_get();
+
+	ret = comp->backend->decompress(src, src_len, dst);
+
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+			&comp->stats->decompress_ns);
+	atomic64_inc(&comp->stats->num_decompress);
+	return ret;
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(comp, zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Create a stream pool for compressor 'compress' bounded by max_strm.
+ * One stream is allocated up front so that the device is always able
+ * to make forward progress. Compression counters go to 'stats'.
+ */
+struct zcomp *zcomp_create(const char *compress, int max_strm,
+		struct zcomp_stats *stats)
+{
+	struct zcomp *comp;
+	struct zcomp_strm *zstrm;
+	int id;
+
+	BUILD_BUG_ON(ARRAY_SIZE(backends) - 1 > ZCOMP_MAX_BACKENDS);
+
+	id = zcomp_backend_id(compress);
+	if (id < 0 || max_strm < 1)
+		return NULL;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	comp->max_strm = max_strm;
+	comp->backend = backends[id];
+	comp->stats = stats;
+
+	zstrm = zcomp_strm_alloc(comp, GFP_KERNEL);
+	if (!zstrm) {
+		kfree(comp);
+		return NULL;
+	}
+	comp->avail_strm = 1;
+	list_add(&zstrm->list, &comp->idle_strm);
+
+	return comp;
+}
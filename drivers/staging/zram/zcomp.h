@@ -0,0 +1,94 @@
+/*
+ * Compression streams for the compressed RAM block device
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+
+/*
+ * A compression stream: everything a single compression operation
+ * needs, so that several of them can run at the same time.
+ */
+struct zcomp_strm {
+	/* compression output buffer; may be up to 2 pages for LZO */
+	void *buffer;
+	/* backend private data, e.g. compressor working memory */
+	void *private;
+	/* entry on zcomp->idle_strm */
+	struct list_head list;
+};
+
+/* static compression backend */
+struct zcomp_backend {
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst);
+
+	void *(*create)(gfp_t flags);
+	void (*destroy)(void *private);
+
+	const char *name;
+};
+
+/*
+ * Per-algorithm counters. A device keeps one set for every backend,
+ * so that algorithms can be compared across device resets.
+ */
+struct zcomp_stats {
+	atomic64_t num_compress;
+	atomic64_t num_decompress;
+	atomic64_t orig_size;		/* bytes fed to the compressor */
+	atomic64_t compr_size;		/* bytes it produced */
+	atomic64_t compress_ns;
+	atomic64_t decompress_ns;
+};
+
+#define ZCOMP_MAX_BACKENDS	2
+
+/*
+ * A bounded pool of compression streams. Streams are allocated on
+ * demand up to max_strm; a writer that finds no idle stream and can
+ * not allocate a new one sleeps on strm_wait until one is released.
+ */
+struct zcomp {
+	spinlock_t strm_lock;		/* protects idle_strm and counters */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;			/* streams currently allocated */
+	int max_strm;			/* upper bound on avail_strm */
+
+	struct zcomp_backend *backend;
+	struct zcomp_stats *stats;
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+int zcomp_backend_id(const char *comp);
+const char *zcomp_backend_name(int id);
+
+struct zcomp *zcomp_create(const char *comp, int max_strm,
+		struct zcomp_stats *stats);
+void zcomp_destroy(struct zcomp *comp);
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
+		size_t src_len, unsigned char *dst);
+
+#endif /* _ZCOMP_H_ */
@@ -23,15 +23,21 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
+#include <linux/file.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/cpumask.h>
+#include <linux/completion.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -42,68 +48,153 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 static unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static int zram_test_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	*v = *v + 1;
+	return zram->table[index].value & BIT(flag);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_set_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	*v = *v - 1;
+	zram->table[index].value |= BIT(flag);
 }
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+static void zram_clear_flag(struct zram *zram, u32 index,
+			enum zram_pageflags flag)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
+	zram->table[index].value &= ~BIT(flag);
 }
 
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+static size_t zram_get_obj_size(struct zram *zram, u32 index)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	return zram->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static void zram_set_obj_size(struct zram *zram, u32 index, size_t size)
 {
-	zram_stat64_add(zram, v, 1);
+	unsigned long flags = zram->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	zram->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
-static int zram_test_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+/*
+ * Each table entry is protected by the ZRAM_ACCESS bit of its own
+ * value word, so I/O to different slots never contends.
+ */
+static void zram_lock_slot(struct zram *zram, u32 index)
 {
-	return zram->table[index].flags & BIT(flag);
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
-static void zram_set_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static void zram_unlock_slot(struct zram *zram, u32 index)
 {
-	zram->table[index].flags |= BIT(flag);
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
-static void zram_clear_flag(struct zram *zram, u32 index,
-			enum zram_pageflags flag)
+static int zram_write_wait(void *word)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	io_schedule();
+	return 0;
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * A partial write reads the slot, merges its bytes in and stores the
+ * result. No other write may store to the slot in between, or its data
+ * would be lost, so the partial write holds ZRAM_WRITE over the whole
+ * sequence and every other write waits for it before storing.
+ *
+ * Returns with the slot locked and ZRAM_WRITE clear.
+ */
+static void zram_lock_slot_write(struct zram *zram, u32 index)
+{
+	for (;;) {
+		zram_lock_slot(zram, index);
+		if (!zram_test_flag(zram, index, ZRAM_WRITE))
+			return;
+		zram_unlock_slot(zram, index);
+		wait_on_bit(&zram->table[index].value, ZRAM_WRITE,
+			    zram_write_wait, TASK_UNINTERRUPTIBLE);
+	}
+}
+
+static void zram_start_write(struct zram *zram, u32 index)
+{
+	zram_lock_slot_write(zram, index);
+	zram_set_flag(zram, index, ZRAM_WRITE);
+	zram_unlock_slot(zram, index);
+}
+
+static void zram_end_write(struct zram *zram, u32 index)
+{
+	zram_lock_slot(zram, index);
+	zram_clear_flag(zram, index, ZRAM_WRITE);
+	zram_unlock_slot(zram, index);
+	smp_mb();
+	wake_up_bit(&zram->table[index].value, ZRAM_WRITE);
+}
+
+/*
+ * Check whether the page is one word repeated over and over, e.g. all
+ * zeroes or a Dalvik heap filled with one pattern. If so, the word is
+ * returned in 'element' and the page needs no storage at all.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (val != page[pos])
 			return 0;
 	}
 
+	*element = val;
+
 	return 1;
 }
 
+static void zram_fill_page(char *ptr, unsigned long len,
+			unsigned long value)
+{
+	unsigned int i;
+	unsigned long *page = (unsigned long *)ptr;
+
+	WARN_ON_ONCE(!IS_ALIGNED(len, sizeof(unsigned long)));
+
+	if (likely(value == 0)) {
+		memset(ptr, 0, len);
+	} else {
+		for (i = 0; i < len / sizeof(*page); i++)
+			page[i] = value;
+	}
+}
+
+/* Pages allocated for stored data: the zsmalloc pool plus huge pages */
+static unsigned long zram_mem_used_pages(struct zram *zram)
+{
+	return (zs_get_total_size_bytes(zram->mem_pool) >> PAGE_SHIFT) +
+		atomic64_read(&zram->stats.pages_expand);
+}
+
+static void zram_update_used_max(struct zram *zram, unsigned long pages)
+{
+	u64 old_max, cur_max;
+
+	old_max = atomic64_read(&zram->stats.max_used_pages);
+	do {
+		cur_max = old_max;
+		if (pages <= cur_max)
+			break;
+		old_max = atomic64_cmpxchg(&zram->stats.max_used_pages,
+				cur_max, pages);
+	} while (old_max != cur_max);
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,69 +224,289 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
-static void zram_free_page(struct zram *zram, size_t index)
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Backing device support. Block 0 of the backing device is never used,
+ * so that a valid block index is always non-zero.
+ */
+/* Must be called with init_lock held for writing, before init */
+void zram_release_bdev(struct zram *zram)
 {
-	void *handle = zram->table[index].handle;
-
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
-		}
+	if (!zram->backing_dev)
 		return;
+
+	destroy_workqueue(zram->bdev_wq);
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->bitmap);
+
+	zram->backing_dev = NULL;
+	zram->bdev_wq = NULL;
+	zram->bdev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+/* On reset the backing device stays, but none of its blocks are used */
+static void zram_reset_bdev(struct zram *zram)
+{
+	if (zram->bitmap)
+		bitmap_zero(zram->bitmap, zram->nr_pages);
+}
+
+/* Must be called with init_lock held for writing, before init */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct file *backing_dev;
+	struct inode *inode;
+	struct block_device *bdev;
+	struct workqueue_struct *wq;
+	unsigned long nr_pages, *bitmap;
+	int err;
+
+	backing_dev = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev))
+		return PTR_ERR(backing_dev);
+
+	inode = backing_dev->f_mapping->host;
+
+	/* Only block devices (partitions, loop devices) are supported */
+	if (!S_ISBLK(inode->i_mode)) {
+		err = -ENOTBLK;
+		goto out_close;
 	}
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		__free_page(handle);
-		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
+	bdev = bdgrab(I_BDEV(inode));
+	err = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (err < 0)
+		goto out_close;
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap || nr_pages < 2) {
+		err = bitmap ? -EINVAL : -ENOMEM;
+		vfree(bitmap);
+		goto out_put;
 	}
 
-	zs_free(zram->mem_pool, handle);
+	err = set_blocksize(bdev, PAGE_SIZE);
+	if (err)
+		goto out_free;
 
-	if (zram->table[index].size <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+	/* Reads of written back pages may be what frees memory */
+	wq = alloc_workqueue("zram%d_bdev", WQ_MEM_RECLAIM, 0,
+			     zram->disk->first_minor);
+	if (!wq) {
+		err = -ENOMEM;
+		goto out_free;
+	}
 
-out:
-	zram_stat64_sub(zram, &zram->stats.compr_size,
-			zram->table[index].size);
-	zram_stat_dec(&zram->stats.pages_stored);
+	zram_release_bdev(zram);
 
-	zram->table[index].handle = NULL;
-	zram->table[index].size = 0;
+	zram->backing_dev = backing_dev;
+	zram->bdev_wq = wq;
+	zram->bdev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+	pr_info("setup backing device %s\n", path);
+	return 0;
+
+out_free:
+	vfree(bitmap);
+out_put:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+out_close:
+	filp_close(backing_dev, NULL);
+	return err;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+/* Allocate nr contiguous blocks; returns the first one, or 0 */
+static unsigned long zram_alloc_blocks(struct zram *zram, unsigned int nr)
 {
-	struct page *page = bvec->bv_page;
-	void *user_mem;
+	unsigned long blk_idx;
 
-	user_mem = kmap_atomic(page);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
-	kunmap_atomic(user_mem);
+	spin_lock(&zram->bitmap_lock);
+	blk_idx = bitmap_find_next_zero_area(zram->bitmap, zram->nr_pages,
+			1, nr, 0);
+	if (blk_idx >= zram->nr_pages) {
+		spin_unlock(&zram->bitmap_lock);
+		return 0;
+	}
+	bitmap_set(zram->bitmap, blk_idx, nr);
+	spin_unlock(&zram->bitmap_lock);
 
-	flush_dcache_page(page);
+	atomic64_add(nr, &zram->stats.bd_count);
+	return blk_idx;
 }
 
-static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
-				     u32 index, int offset)
+static void zram_free_block(struct zram *zram, unsigned long blk_idx)
 {
-	struct page *page = bvec->bv_page;
-	unsigned char *user_mem, *cmem;
+	spin_lock(&zram->bitmap_lock);
+	WARN_ON_ONCE(!test_bit(blk_idx, zram->bitmap));
+	clear_bit(blk_idx, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
 
-	user_mem = kmap_atomic(page);
-	cmem = kmap_atomic(zram->table[index].handle);
+	atomic64_dec(&zram->stats.bd_count);
+}
 
-	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem);
-	kunmap_atomic(user_mem);
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
 
-	flush_dcache_page(page);
+/*
+ * Synchronously read or write nr pages at consecutive blocks starting
+ * at blk_idx, with as few bios as the queue limits allow.
+ */
+static int zram_bdev_rw(struct zram *zram, struct page **pages,
+		unsigned int nr, unsigned long blk_idx, int rw)
+{
+	unsigned int done_pages = 0;
+
+	while (done_pages < nr) {
+		DECLARE_COMPLETION_ONSTACK(done);
+		struct bio *bio;
+		unsigned int i;
+		int ret = 0;
+
+		bio = bio_alloc(GFP_NOIO, nr - done_pages);
+		if (!bio)
+			return -ENOMEM;
+
+		bio->bi_bdev = zram->bdev;
+		bio->bi_sector = (blk_idx + done_pages) <<
+					SECTORS_PER_PAGE_SHIFT;
+		bio->bi_end_io = zram_bdev_end_io;
+		bio->bi_private = &done;
+		for (i = done_pages; i < nr; i++) {
+			if (bio_add_page(bio, pages[i], PAGE_SIZE, 0) !=
+			    PAGE_SIZE)
+				break;
+		}
+		if (i == done_pages) {
+			bio_put(bio);
+			return -EIO;
+		}
+
+		submit_bio(rw, bio);
+		wait_for_completion(&done);
+		if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+			ret = -EIO;
+		bio_put(bio);
+		if (ret)
+			return ret;
+
+		if (rw & WRITE)
+			atomic64_add(i - done_pages, &zram->stats.bd_writes);
+		else
+			atomic64_add(i - done_pages, &zram->stats.bd_reads);
+		done_pages = i;
+	}
+
+	return 0;
+}
+
+struct zram_bdev_read {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int ret;
+};
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_read *rd =
+		container_of(work, struct zram_bdev_read, work);
+
+	rd->ret = zram_bdev_rw(rd->zram, &rd->page, 1, rd->blk_idx, READ);
+}
+
+/*
+ * Reads come from zram_make_request(), inside generic_make_request(),
+ * where a bio submitted by this task is only queued on current->bio_list
+ * until the request returns. Waiting for it here would never end, so
+ * the read is submitted and waited for from the workqueue instead.
+ */
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+		unsigned long blk_idx)
+{
+	struct zram_bdev_read rd = {
+		.zram = zram,
+		.page = page,
+		.blk_idx = blk_idx,
+	};
+
+	INIT_WORK_ONSTACK(&rd.work, zram_bdev_read_work);
+	queue_work(zram->bdev_wq, &rd.work);
+	flush_work(&rd.work);
+	destroy_work_on_stack(&rd.work);
+
+	return rd.ret;
+}
+#else
+static inline void zram_release_bdev(struct zram *zram) {}
+static inline void zram_reset_bdev(struct zram *zram) {}
+static inline int zram_read_from_bdev(struct zram *zram, struct page *page,
+		unsigned long blk_idx)
+{
+	return -EIO;
+}
+static inline void zram_free_block(struct zram *zram,
+		unsigned long blk_idx) {}
+#endif
+
+/* Caller must hold the slot lock of 'index' */
+static void zram_free_page(struct zram *zram, size_t index)
+{
+	void *handle = zram->table[index].handle;
+	size_t size = zram_get_obj_size(zram, index);
+
+	/* A pending writeback of this slot must not complete */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_free_block(zram, zram->table[index].element);
+		zram->table[index].element = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!zram->table[index].element)
+			atomic64_dec(&zram->stats.pages_zero);
+		atomic64_dec(&zram->stats.same_pages);
+		zram->table[index].element = 0;
+		return;
+	}
+
+	if (unlikely(!handle))
+		return;
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		__free_page(handle);
+		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
+		atomic64_dec(&zram->stats.pages_expand);
+		goto out;
+	}
+
+	zs_free(zram->mem_pool, handle);
+
+	if (size <= PAGE_SIZE / 2)
+		atomic64_dec(&zram->stats.good_compress);
+
+out:
+	atomic64_sub(size, &zram->stats.compr_size);
+	atomic64_dec(&zram->stats.pages_stored);
+
+	zram->table[index].handle = NULL;
+	zram_set_obj_size(zram, index, 0);
 }
 
 static inline int is_partial_io(struct bio_vec *bvec)
@@ -203,180 +514,309 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
-static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
-			  u32 index, int offset, struct bio *bio)
+/*
+ * Read slot 'index' into the whole of 'page'. Slots on the backing
+ * device are read synchronously, so this may sleep. Reads for writeback
+ * are not an access and leave the idle mark alone.
+ */
+static int __zram_bvec_read(struct zram *zram, struct page *page, u32 index,
+			    bool for_wb)
 {
 	int ret;
-	size_t clen;
-	struct page *page;
+	void *handle;
 	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	unsigned char *cmem, *mem;
 
-	page = bvec->bv_page;
+	zram_lock_slot(zram, index);
+	if (!for_wb)
+		zram_clear_flag(zram, index, ZRAM_IDLE);
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long blk_idx = zram->table[index].element;
+
+		zram_unlock_slot(zram, index);
+		return zram_read_from_bdev(zram, page, blk_idx);
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		unsigned long element = zram->table[index].element;
+
+		zram_unlock_slot(zram, index);
+		mem = kmap_atomic(page);
+		zram_fill_page(mem, PAGE_SIZE, element);
+		kunmap_atomic(mem);
 		return 0;
 	}
 
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].handle)) {
-		pr_debug("Read before write: sector=%lu, size=%u",
-			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+	handle = zram->table[index].handle;
+	if (unlikely(!handle)) {
+		zram_unlock_slot(zram, index);
+		pr_debug("Read before write: page=%u\n", index);
+		clear_highpage(page);
 		return 0;
 	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		handle_uncompressed_page(zram, bvec, index, offset);
+		cmem = kmap_atomic(handle);
+		mem = kmap_atomic(page);
+		copy_page(mem, cmem);
+		kunmap_atomic(mem);
+		kunmap_atomic(cmem);
+		zram_unlock_slot(zram, index);
 		return 0;
 	}
 
+	cmem = zs_map_object(zram->mem_pool, handle);
+	mem = kmap_atomic(page);
+	ret = zcomp_decompress(zram->comp, cmem + sizeof(*zheader),
+				    zram_get_obj_size(zram, index), mem);
+	kunmap_atomic(mem);
+	zs_unmap_object(zram->mem_pool, handle);
+	zram_unlock_slot(zram, index);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		atomic64_inc(&zram->stats.failed_reads);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
+			  u32 index, int offset, struct bio *bio)
+{
+	int ret;
+	struct page *page;
+	unsigned char *user_mem, *src;
+
+	page = bvec->bv_page;
 	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
-		if (!uncmem) {
+		/* Use a temporary page to decompress the whole slot */
+		page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (!page) {
 			pr_info("Error allocating temp memory!\n");
 			return -ENOMEM;
 		}
 	}
 
-	user_mem = kmap_atomic(page);
-	if (!is_partial_io(bvec))
-		uncmem = user_mem;
-	clen = PAGE_SIZE;
-
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    uncmem, &clen);
+	ret = __zram_bvec_read(zram, page, index, false);
+	if (unlikely(ret))
+		goto out;
 
 	if (is_partial_io(bvec)) {
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+		user_mem = kmap_atomic(bvec->bv_page);
+		src = kmap_atomic(page);
+		memcpy(user_mem + bvec->bv_offset, src + offset,
 		       bvec->bv_len);
-		kfree(uncmem);
+		kunmap_atomic(src);
+		kunmap_atomic(user_mem);
 	}
 
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
-	kunmap_atomic(user_mem);
+	flush_dcache_page(bvec->bv_page);
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
-	}
-
-	flush_dcache_page(page);
+out:
+	if (is_partial_io(bvec))
+		__free_page(page);
 
-	return 0;
+	return ret;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Write a batch of slots, already read into pages[] and flagged
+ * ZRAM_UNDER_WB, to the backing device. Slots which were freed or
+ * overwritten while the I/O was in flight (ZRAM_UNDER_WB cleared by
+ * zram_free_page()) give their block back; the rest drop their
+ * in-memory copy and point at the block instead.
+ */
+static int zram_writeback_batch(struct zram *zram, struct page **pages,
+		u32 *indices, unsigned int nr)
 {
+	unsigned long blk_idx;
+	unsigned int i;
 	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
-	unsigned char *cmem;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].handle) {
-		memset(mem, 0, PAGE_SIZE);
-		return 0;
+	blk_idx = zram_alloc_blocks(zram, nr);
+	if (!blk_idx)
+		ret = -ENOSPC;
+	else
+		ret = zram_bdev_rw(zram, pages, nr, blk_idx, WRITE);
+
+	for (i = 0; i < nr; i++) {
+		u32 index = indices[i];
+
+		zram_lock_slot(zram, index);
+		if (ret || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_unlock_slot(zram, index);
+			if (blk_idx)
+				zram_free_block(zram, blk_idx + i);
+			continue;
+		}
+
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram->table[index].element = blk_idx + i;
+		zram_unlock_slot(zram, index);
 	}
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
+	return ret;
+}
 
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		memcpy(mem, cmem, PAGE_SIZE);
-		kunmap_atomic(cmem);
-		return 0;
+/*
+ * Write every slot carrying 'flag' (ZRAM_UNCOMPRESSED for incompressible
+ * pages, ZRAM_IDLE for idle ones) to the backing device, in batches of
+ * up to ZRAM_WB_BATCH pages per bio.
+ */
+int zram_writeback(struct zram *zram, enum zram_pageflags flag)
+{
+	struct page *pages[ZRAM_WB_BATCH];
+	u32 indices[ZRAM_WB_BATCH];
+	unsigned long nr_slots = zram->disksize >> PAGE_SHIFT;
+	unsigned long index;
+	unsigned int i, nr = 0;
+	int ret = 0;
+
+	if (!zram->backing_dev)
+		return -ENODEV;
+
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		pages[i] = alloc_page(GFP_KERNEL | __GFP_HIGHMEM);
+		if (!pages[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
 	}
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    mem, &clen);
-	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
+	for (index = 0; index < nr_slots; index++) {
+		zram_lock_slot(zram, index);
+		if (!zram_test_flag(zram, index, flag) ||
+		    zram_test_flag(zram, index, ZRAM_WB) ||
+		    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+		    zram_test_flag(zram, index, ZRAM_SAME) ||
+		    !zram->table[index].handle) {
+			zram_unlock_slot(zram, index);
+			continue;
+		}
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_unlock_slot(zram, index);
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
+		if (__zram_bvec_read(zram, pages[nr], index, true)) {
+			zram_lock_slot(zram, index);
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_unlock_slot(zram, index);
+			continue;
+		}
+
+		indices[nr++] = index;
+		if (nr == ZRAM_WB_BATCH) {
+			ret = zram_writeback_batch(zram, pages, indices, nr);
+			nr = 0;
+			if (ret)
+				break;
+		}
+		cond_resched();
 	}
 
-	return 0;
+	if (nr)
+		ret = zram_writeback_batch(zram, pages, indices, nr);
+out:
+	while (i--)
+		__free_page(pages[i]);
+
+	return ret;
 }
 
+/* Mark every stored slot idle; any later access clears the mark */
+void zram_mark_idle(struct zram *zram)
+{
+	unsigned long nr_slots = zram->disksize >> PAGE_SHIFT;
+	unsigned long index;
+
+	for (index = 0; index < nr_slots; index++) {
+		zram_lock_slot(zram, index);
+		if (zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_SAME))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_unlock_slot(zram, index);
+	}
+}
+#endif
+
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
-	int ret;
-	u32 store_offset;
+	int ret = 0;
 	size_t clen;
 	void *handle;
 	struct zobj_header *zheader;
-	struct page *page, *page_store;
-	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	struct zcomp_strm *zstrm = NULL;
+	struct page *page, *page_store = NULL;
+	unsigned char *user_mem, *cmem, *src;
+	unsigned long element, alloced_pages;
+	bool partial = is_partial_io(bvec);
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
-	if (is_partial_io(bvec)) {
+	if (partial) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
-		if (!uncmem) {
+		page = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (!page) {
 			pr_info("Error allocating temp memory!\n");
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		zram_start_write(zram, index);
+		ret = __zram_bvec_read(zram, page, index, false);
+		if (ret)
 			goto out;
-		}
+
+		src = kmap_atomic(bvec->bv_page);
+		user_mem = kmap_atomic(page);
+		memcpy(user_mem + offset, src + bvec->bv_offset,
+		       bvec->bv_len);
+		kunmap_atomic(user_mem);
+		kunmap_atomic(src);
 	}
 
 	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
+	 * Compression runs without the slot lock held: each writer owns
+	 * a stream, so writers on different CPUs compress in parallel and
+	 * readers only ever wait for the table update below.
 	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
+	zstrm = zcomp_strm_find(zram->comp);
 	user_mem = kmap_atomic(page);
 
-	if (is_partial_io(bvec))
-		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
-		       bvec->bv_len);
-	else
-		uncmem = user_mem;
-
-	if (page_zero_filled(uncmem)) {
+	if (page_same_filled(user_mem, &element)) {
 		kunmap_atomic(user_mem);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
-		ret = 0;
+		zcomp_strm_release(zram->comp, zstrm);
+		zstrm = NULL;
+
+		if (partial)
+			zram_lock_slot(zram, index);
+		else
+			zram_lock_slot_write(zram, index);
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram->table[index].element = element;
+		zram_unlock_slot(zram, index);
+		atomic64_inc(&zram->stats.same_pages);
+		if (!element)
+			atomic64_inc(&zram->stats.pages_zero);
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
-
+	ret = zcomp_compress(zram->comp, zstrm, user_mem, &clen);
 	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
@@ -396,57 +836,76 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
 		handle = page_store;
 		src = kmap_atomic(page);
 		cmem = kmap_atomic(page_store);
-		goto memstore;
+		copy_page(cmem, src);
+		kunmap_atomic(cmem);
+		kunmap_atomic(src);
+	} else {
+		handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
+		if (!handle) {
+			pr_info("Error allocating memory for compressed "
+				"page: %u, size=%zu\n", index, clen);
+			ret = -ENOMEM;
+			goto out;
+		}
 	}
 
-	handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
-	if (!handle) {
-		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+	/* the page being added is not counted in pages_expand yet */
+	alloced_pages = zram_mem_used_pages(zram) + !!page_store;
+	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
+		if (page_store)
+			__free_page(page_store);
+		else
+			zs_free(zram->mem_pool, handle);
 		ret = -ENOMEM;
 		goto out;
 	}
-	cmem = zs_map_object(zram->mem_pool, handle);
+	zram_update_used_max(zram, alloced_pages);
 
-memstore:
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
+	if (!page_store) {
+		cmem = zs_map_object(zram->mem_pool, handle);
+		memcpy(cmem, zstrm->buffer, clen);
+		zs_unmap_object(zram->mem_pool, handle);
 	}
-#endif
 
-	memcpy(cmem, src, clen);
+	zcomp_strm_release(zram->comp, zstrm);
+	zstrm = NULL;
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		kunmap_atomic(cmem);
-		kunmap_atomic(src);
-	} else {
-		zs_unmap_object(zram->mem_pool, handle);
-	}
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	if (partial)
+		zram_lock_slot(zram, index);
+	else
+		zram_lock_slot_write(zram, index);
+	zram_free_page(zram, index);
 
+	if (page_store)
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
 	zram->table[index].handle = handle;
-	zram->table[index].size = clen;
+	zram_set_obj_size(zram, index, clen);
+	zram_unlock_slot(zram, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram_stat_inc(&zram->stats.pages_stored);
+	if (page_store)
+		atomic64_inc(&zram->stats.pages_expand);
+	atomic64_add(clen, &zram->stats.compr_size);
+	atomic64_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
-		zram_stat_inc(&zram->stats.good_compress);
-
-	return 0;
+		atomic64_inc(&zram->stats.good_compress);
 
 out:
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (partial && page) {
+		zram_end_write(zram, index);
+		__free_page(page);
+	}
 	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		atomic64_inc(&zram->stats.failed_writes);
 	return ret;
 }
 
@@ -455,15 +914,10 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
+	if (rw == READ)
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
+	else
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
 
 	return ret;
 }
@@ -483,10 +937,10 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 
 	switch (rw) {
 	case READ:
-		zram_stat64_inc(zram, &zram->stats.num_reads);
+		atomic64_inc(&zram->stats.num_reads);
 		break;
 	case WRITE:
-		zram_stat64_inc(zram, &zram->stats.num_writes);
+		atomic64_inc(&zram->stats.num_writes);
 		break;
 	}
 
@@ -569,7 +1023,7 @@ static void zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto error_unlock;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		atomic64_inc(&zram->stats.invalid_io);
 		goto error_unlock;
 	}
 
@@ -590,17 +1044,16 @@ void __zram_reset_device(struct zram *zram)
 
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free compression streams */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		void *handle = zram->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME) ||
+		    zram_test_flag(zram, index, ZRAM_WB))
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
@@ -612,6 +1065,8 @@ void __zram_reset_device(struct zram *zram)
 	vfree(zram->table);
 	zram->table = NULL;
 
+	zram_reset_bdev(zram);
+
 	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
@@ -619,6 +1074,7 @@ void __zram_reset_device(struct zram *zram)
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
 	zram->disksize = 0;
+	zram->limit_pages = 0;
 }
 
 void zram_reset_device(struct zram *zram)
@@ -642,17 +1098,10 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams,
+			&zram->comp_stats[zcomp_backend_id(zram->compressor)]);
+	if (!zram->comp) {
+		pr_err("Error allocating compression streams\n");
 		ret = -ENOMEM;
 		goto fail_no_table;
 	}
@@ -699,8 +1148,11 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+
+	zram_lock_slot(zram, index);
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	zram_unlock_slot(zram, index);
+	atomic64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -712,9 +1164,12 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = -ENOMEM;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bitmap_lock);
+#endif
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor, sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -855,6 +1310,7 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_release_bdev(zram);
 		put_disk(zram->disk);
 	}
 
@@ -19,6 +19,7 @@
 #include <linux/mutex.h>
 
 #include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -43,6 +44,9 @@ struct zobj_header {
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Compression backend used unless comp_algorithm is written */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -66,49 +70,75 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * The lower ZRAM_FLAG_SHIFT bits of table.value hold the object size
+ * (excluding header), the higher bits hold zram_pageflags.
+ */
+#define ZRAM_FLAG_SHIFT 24
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
-	ZRAM_UNCOMPRESSED,
+	ZRAM_UNCOMPRESSED = ZRAM_FLAG_SHIFT,
+
+	/* Page consists of one repeated word, kept in table.element */
+	ZRAM_SAME,
+
+	/* Slot lock: bit spinlock protecting this table entry */
+	ZRAM_ACCESS,
+
+	/* Page lives on the backing device, table.element is its block */
+	ZRAM_WB,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page has not been accessed since it was last marked idle */
+	ZRAM_IDLE,
+
+	/* A partial write is merging into this slot, see zram_start_write() */
+	ZRAM_WRITE,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
+/* Pages written to the backing device per bio */
+#define ZRAM_WB_BATCH		32
+
 /*-- Data structures */
 
 /* Allocated for each disk page */
 struct table {
-	void *handle;
-	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __attribute__((aligned(4)));
+	union {
+		void *handle;
+		unsigned long element;	/* ZRAM_SAME fill word or ZRAM_WB block */
+	};
+	unsigned long value;
+};
 
 struct zram_stats {
-	u64 compr_size;		/* compressed size of pages stored */
-	u64 num_reads;		/* failed + successful */
-	u64 num_writes;		/* --do-- */
-	u64 failed_reads;	/* should NEVER! happen */
-	u64 failed_writes;	/* can happen when memory is too low */
-	u64 invalid_io;		/* non-page-aligned I/O requests */
-	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic64_t compr_size;		/* compressed size of pages stored */
+	atomic64_t num_reads;		/* failed + successful */
+	atomic64_t num_writes;		/* --do-- */
+	atomic64_t failed_reads;	/* should NEVER! happen */
+	atomic64_t failed_writes;	/* can happen when memory is too low */
+	atomic64_t invalid_io;		/* non-page-aligned I/O requests */
+	atomic64_t notify_free;		/* no. of swap slot free notifications */
+	atomic64_t pages_zero;		/* no. of zero filled pages */
+	atomic64_t same_pages;		/* no. of same element filled pages */
+	atomic64_t pages_stored;	/* no. of pages currently stored */
+	atomic64_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic64_t pages_expand;	/* % of incompressible pages */
+	atomic64_t max_used_pages;	/* peak pages allocated for data */
+	atomic64_t bd_count;		/* no. of pages on the backing device */
+	atomic64_t bd_reads;		/* no. of pages read from it */
+	atomic64_t bd_writes;		/* no. of pages written to it */
 };
 
 struct zram {
 	struct zs_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
-	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
+	struct zcomp *comp;	/* pool of compression streams */
+	struct table *table;	/* entries are locked by ZRAM_ACCESS */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -119,8 +149,23 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* Upper bound on concurrent compression streams */
+	int max_comp_streams;
+	/* Pages the device may allocate for compressed data, 0 = no limit */
+	unsigned long limit_pages;
+	char compressor[10];
 
 	struct zram_stats stats;
+	/* Per-algorithm counters, kept across device resets */
+	struct zcomp_stats comp_stats[ZCOMP_MAX_BACKENDS];
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct file *backing_dev;
+	struct block_device *bdev;
+	struct workqueue_struct *bdev_wq;	/* reads from bdev */
+	unsigned long *bitmap;	/* blocks in use on bdev */
+	unsigned long nr_pages;	/* size of bdev in pages */
+	spinlock_t bitmap_lock;
+#endif
 };
 
 extern struct zram *zram_devices;
@@ -131,5 +176,11 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_release_bdev(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_pageflags flag);
+extern void zram_mark_idle(struct zram *zram);
+#endif
 
 #endif
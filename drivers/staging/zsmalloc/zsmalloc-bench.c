@@ -0,0 +1,224 @@
+/*
+ * zsmalloc benchmark
+ *
+ * Runs zs_malloc/zs_map_object/zs_unmap_object/zs_free from a thread
+ * on every online CPU at once, against one shared pool, optionally
+ * with zs_compact() running alongside, and reports the time per
+ * operation. Load the module to run it; results go to the kernel log
+ * and the module unloads itself.
+ *
+ *	modprobe zsmalloc-bench iterations=2000 batch=256 compact_ms=10
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the license that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define pr_fmt(fmt) "zsmalloc-bench: " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/cpu.h>
+
+#include "zsmalloc.h"
+
+static unsigned int iterations = 1000;
+module_param(iterations, uint, 0);
+MODULE_PARM_DESC(iterations, "Rounds of batch allocations per CPU");
+
+static unsigned int batch = 256;
+module_param(batch, uint, 0);
+MODULE_PARM_DESC(batch, "Objects allocated, then freed, per round");
+
+static unsigned int min_size = 64;
+module_param(min_size, uint, 0);
+MODULE_PARM_DESC(min_size, "Smallest object size");
+
+static unsigned int max_size = 3072;
+module_param(max_size, uint, 0);
+MODULE_PARM_DESC(max_size, "Largest object size");
+
+static unsigned int compact_ms;
+module_param(compact_ms, uint, 0);
+MODULE_PARM_DESC(compact_ms, "Run zs_compact() this often meanwhile (0: never)");
+
+struct bench_thread {
+	struct task_struct *task;
+	int cpu;
+	u64 alloc_ns, map_ns, free_ns;
+	unsigned long failed;
+	int corrupt;
+};
+
+static struct zs_pool *pool;
+static DECLARE_COMPLETION(start);
+static atomic_t running;
+static DECLARE_COMPLETION(all_done);
+
+static int bench_fn(void *data)
+{
+	struct bench_thread *bt = data;
+	struct rnd_state rnd;
+	void **handles;
+	u16 *sizes;
+	unsigned int it, i;
+	ktime_t t0;
+	u8 *p;
+
+	handles = kcalloc(batch, sizeof(*handles), GFP_KERNEL);
+	sizes = kcalloc(batch, sizeof(*sizes), GFP_KERNEL);
+	prandom32_seed(&rnd, bt->cpu + 1);
+
+	wait_for_completion(&start);
+	if (!handles || !sizes)
+		goto out;
+
+	for (it = 0; it < iterations; it++) {
+		t0 = ktime_get();
+		for (i = 0; i < batch; i++) {
+			sizes[i] = min_size +
+				prandom32(&rnd) % (max_size - min_size + 1);
+			handles[i] = zs_malloc(pool, sizes[i]);
+			if (!handles[i])
+				bt->failed++;
+		}
+		bt->alloc_ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+
+		/* write each object, then read it back */
+		t0 = ktime_get();
+		for (i = 0; i < batch; i++) {
+			if (!handles[i])
+				continue;
+			p = zs_map_object(pool, handles[i]);
+			memset(p, (u8)(i + it), sizes[i]);
+			zs_unmap_object(pool, handles[i]);
+		}
+		for (i = 0; i < batch; i++) {
+			if (!handles[i])
+				continue;
+			p = zs_map_object(pool, handles[i]);
+			if (p[0] != (u8)(i + it) ||
+			    p[sizes[i] - 1] != (u8)(i + it))
+				bt->corrupt = 1;
+			zs_unmap_object(pool, handles[i]);
+		}
+		bt->map_ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+
+		t0 = ktime_get();
+		for (i = 0; i < batch; i++)
+			zs_free(pool, handles[i]);
+		bt->free_ns += ktime_to_ns(ktime_sub(ktime_get(), t0));
+
+		cond_resched();
+	}
+
+out:
+	kfree(sizes);
+	kfree(handles);
+	if (atomic_dec_and_test(&running))
+		complete(&all_done);
+
+	/* stay around for kthread_stop(), so the module outlives us */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static int __init zs_bench_init(void)
+{
+	struct bench_thread *threads;
+	unsigned long ops, compacted = 0;
+	u64 alloc_ns = 0, map_ns = 0, free_ns = 0;
+	unsigned long failed = 0;
+	int cpu, nr = 0, corrupt = 0;
+
+	if (!batch || !iterations || min_size < 1 || max_size < min_size ||
+	    max_size > PAGE_SIZE - sizeof(unsigned long))
+		return -EINVAL;
+
+	pool = zs_create_pool("zs_bench", GFP_KERNEL | __GFP_HIGHMEM);
+	if (!pool)
+		return -ENOMEM;
+
+	threads = kcalloc(nr_cpu_ids, sizeof(*threads), GFP_KERNEL);
+	if (!threads) {
+		zs_destroy_pool(pool);
+		return -ENOMEM;
+	}
+
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		struct bench_thread *bt = &threads[cpu];
+
+		bt->cpu = cpu;
+		bt->task = kthread_create(bench_fn, bt, "zs_bench/%d", cpu);
+		if (IS_ERR(bt->task)) {
+			bt->task = NULL;
+			continue;
+		}
+		kthread_bind(bt->task, cpu);
+		atomic_inc(&running);
+		wake_up_process(bt->task);
+		nr++;
+	}
+	put_online_cpus();
+
+	/* all threads start at the same time */
+	complete_all(&start);
+	if (nr) {
+		while (!wait_for_completion_timeout(&all_done,
+				msecs_to_jiffies(compact_ms ? compact_ms :
+						 1000))) {
+			if (compact_ms)
+				compacted += zs_compact(pool);
+		}
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct bench_thread *bt = &threads[cpu];
+
+		if (!bt->task)
+			continue;
+		kthread_stop(bt->task);
+		alloc_ns += bt->alloc_ns;
+		map_ns += bt->map_ns;
+		free_ns += bt->free_ns;
+		failed += bt->failed;
+		corrupt |= bt->corrupt;
+	}
+
+	ops = (unsigned long)nr * iterations * batch;
+	if (ops) {
+		pr_info("%d threads, %lu objects of %u-%u bytes each way\n",
+			nr, ops, min_size, max_size);
+		pr_info("zs_malloc %llu ns, map+unmap x2 %llu ns, zs_free %llu ns per object\n",
+			div64_u64(alloc_ns, ops), div64_u64(map_ns, ops),
+			div64_u64(free_ns, ops));
+		pr_info("allocation failures %lu, pages compacted %lu\n",
+			failed, compacted);
+	}
+	if (corrupt)
+		pr_err("object contents corrupted!\n");
+
+	kfree(threads);
+	zs_destroy_pool(pool);
+
+	/* nothing to keep loaded */
+	return corrupt ? -EIO : -EAGAIN;
+}
+module_init(zs_bench_init);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("zsmalloc multi-CPU benchmark");
@@ -17,6 +17,7 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
@@ -27,6 +28,8 @@
 #include <linux/cpumask.h>
 #include <linux/cpu.h>
 #include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 
 #include "zsmalloc.h"
 #include "zsmalloc_int.h"
@@ -43,6 +46,9 @@
 /* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+/* handles: one word per allocation, holding its current obj */
+static struct kmem_cache *zs_handle_cache;
+
 static int is_first_page(struct page *page)
 {
 	return test_bit(PG_private, &page->flags);
@@ -230,30 +236,67 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single obj value */
+static unsigned long obj_location_to_obj(struct page *page,
+				unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
-		return NULL;
+		return 0;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
 
-	return (void *)handle;
+	return obj << OBJ_TAG_BITS;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(void *handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given obj value */
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	unsigned long hval = (unsigned long)handle;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
+
+static unsigned long alloc_handle(gfp_t flags)
+{
+	return (unsigned long)kmem_cache_alloc(zs_handle_cache,
+			flags & ~__GFP_HIGHMEM);
+}
+
+static void free_handle(unsigned long handle)
+{
+	kmem_cache_free(zs_handle_cache, (void *)handle);
+}
+
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj;
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~BIT(HANDLE_PIN_BIT);
+}
+
+/* A pinned object is not moved by compaction */
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
 
-	*page = pfn_to_page(hval >> OBJ_INDEX_BITS);
-	*obj_idx = hval & OBJ_INDEX_MASK;
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -330,7 +373,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = obj_location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -341,7 +384,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = obj_location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -396,9 +439,9 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = (void *)obj_location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
-	first_page->objects = class->zspage_order * PAGE_SIZE / class->size;
+	first_page->objects = class->objs_per_zspage;
 
 	error = 0; /* Success */
 
@@ -425,7 +468,514 @@ static struct page *find_get_zspage(struct size_class *class)
 	return page;
 }
 
+/*
+ * Take a free object off first_page's freelist and tag it with the
+ * handle that will refer to it, if any yet. Caller holds class->lock
+ * and fixes the fullness group afterwards.
+ */
+static unsigned long obj_malloc(struct size_class *class,
+				struct page *first_page, unsigned long handle)
+{
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long obj, m_objidx, m_offset;
+	void *vaddr;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	vaddr = kmap_atomic(m_page);
+	link = (struct link_free *)vaddr + m_offset / sizeof(*link);
+	first_page->freelist = (void *)link->next;
+	link->handle = handle ? handle | OBJ_ALLOCATED_TAG : 0;
+	kunmap_atomic(vaddr);
+
+	first_page->inuse++;
+	class->obj_inuse++;
+
+	return obj;
+}
+
+/*
+ * Put obj back on its zspage's freelist and return the zspage. Caller
+ * holds class->lock and fixes the fullness group afterwards.
+ */
+static struct page *obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+	void *vaddr;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	vaddr = kmap_atomic(f_page);
+	link = (struct link_free *)(vaddr + f_offset);
+	link->next = (unsigned long)first_page->freelist;
+	kunmap_atomic(vaddr);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+	class->obj_inuse--;
+
+	return first_page;
+}
+
+static void obj_set_handle(struct size_class *class, unsigned long obj,
+				unsigned long handle)
+{
+	struct page *page;
+	unsigned long obj_idx, off;
+	void *vaddr;
+
+	obj_to_location(obj, &page, &obj_idx);
+	off = obj_idx_to_offset(page, obj_idx, class->size);
+
+	vaddr = kmap_atomic(page);
+	((struct link_free *)(vaddr + off))->handle =
+					handle | OBJ_ALLOCATED_TAG;
+	kunmap_atomic(vaddr);
+}
+
+static struct size_class *obj_to_class(struct zs_pool *pool,
+				unsigned long obj)
+{
+	struct page *page;
+	unsigned long obj_idx;
+	unsigned int class_idx;
+	enum fullness_group fg;
+
+	obj_to_location(obj, &page, &obj_idx);
+	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
+
+	return &pool->size_class[class_idx];
+}
+
+/*
+ * Per-CPU caches. The fast paths below run with interrupts disabled and
+ * only take class->lock to move a batch of objects. zs_compact() sets
+ * pool->pcp_disabled and waits for a sched RCU grace period, after
+ * which no fast path runs and the caches can be drained from any CPU.
+ */
+
+/* Return the first nr objects of pcp to their zspages */
+static void zs_pcp_drain(struct zs_pool *pool, struct size_class *class,
+				struct zs_pcp *pcp, int nr)
+{
+	LIST_HEAD(free_list);
+	struct page *first_page, *tmp;
+	int i;
+
+	spin_lock(&class->lock);
+	for (i = 0; i < nr; i++) {
+		first_page = obj_free(class, pcp->objs[i]);
+		if (fix_fullness_group(pool, first_page) == ZS_EMPTY) {
+			class->pages_allocated -= class->zspage_order;
+			list_add(&first_page->lru, &free_list);
+		}
+	}
+	spin_unlock(&class->lock);
+
+	pcp->count -= nr;
+	memmove(pcp->objs, pcp->objs + nr, pcp->count * sizeof(pcp->objs[0]));
+
+	list_for_each_entry_safe(first_page, tmp, &free_list, lru) {
+		list_del_init(&first_page->lru);
+		atomic_long_sub(class->zspage_order, &pool->pages_allocated);
+		free_zspage(first_page);
+	}
+}
+
+/*
+ * Allocate an object for handle from the local CPU's cache, refilling
+ * it from zspages the class already has. Returns 0 if that fails.
+ */
+static unsigned long zs_pcp_alloc(struct zs_pool *pool,
+				struct size_class *class, unsigned long handle)
+{
+	struct zs_pcp __percpu *pcps = ACCESS_ONCE(class->pcp);
+	struct zs_pcp *pcp;
+	struct page *first_page;
+	unsigned long flags, obj = 0;
+
+	if (!pcps)
+		return 0;
+	smp_read_barrier_depends();
+
+	local_irq_save(flags);
+	if (ACCESS_ONCE(pool->pcp_disabled))
+		goto out;
+	/* pairs with smp_wmb() in zs_compact() */
+	smp_rmb();
+
+	pcp = this_cpu_ptr(pcps);
+	if (!pcp->count) {
+		spin_lock(&class->lock);
+		while (pcp->count < ZS_PCP_BATCH &&
+		       (first_page = find_get_zspage(class))) {
+			pcp->objs[pcp->count++] = obj_malloc(class,
+							first_page, 0);
+			fix_fullness_group(pool, first_page);
+		}
+		spin_unlock(&class->lock);
+	}
+
+	if (pcp->count) {
+		obj = pcp->objs[--pcp->count];
+		record_obj(handle, obj);
+		obj_set_handle(class, obj, handle);
+	}
+out:
+	local_irq_restore(flags);
+	return obj;
+}
+
+/*
+ * Free handle's object into the local CPU's cache, spilling a batch to
+ * the class when it is full. Returns 0 if the caller must free it.
+ *
+ * The object keeps its now stale header: compaction drains the caches
+ * before it looks at any object, which rewrites the header.
+ */
+static int zs_pcp_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_pcp __percpu *pcps;
+	struct size_class *class;
+	struct zs_pcp *pcp;
+	unsigned long flags, obj;
+	int ret = 0;
+
+	local_irq_save(flags);
+	if (ACCESS_ONCE(pool->pcp_disabled))
+		goto out;
+	smp_rmb();
+
+	obj = handle_to_obj(handle);
+	class = obj_to_class(pool, obj);
+	pcps = ACCESS_ONCE(class->pcp);
+	if (!pcps)
+		goto out;
+	smp_read_barrier_depends();
+
+	pcp = this_cpu_ptr(pcps);
+	if (pcp->count == ZS_PCP_HIGH)
+		zs_pcp_drain(pool, class, pcp, ZS_PCP_BATCH);
+	pcp->objs[pcp->count++] = obj;
+	ret = 1;
+out:
+	local_irq_restore(flags);
+	return ret;
+}
+
+/* Empty every CPU's cache; fast paths must be excluded by the caller */
+static void zs_pcp_drain_all(struct zs_pool *pool, struct size_class *class)
+{
+	struct zs_pcp *pcp;
+	int cpu;
+
+	if (!class->pcp)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		pcp = per_cpu_ptr(class->pcp, cpu);
+		if (pcp->count)
+			zs_pcp_drain(pool, class, pcp, pcp->count);
+	}
+}
+
+/* Give classes that have grown hot their per-CPU caches */
+static void zs_pcp_work(struct work_struct *work)
+{
+	struct zs_pool *pool = container_of(work, struct zs_pool, pcp_work);
+	struct zs_pcp __percpu *pcps;
+	int i;
+
+	/* zs_compact() relies on no cache showing up while it runs */
+	mutex_lock(&pool->compact_lock);
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->pcp || class->pages_allocated < ZS_PCP_MIN_PAGES)
+			continue;
+
+		pcps = alloc_percpu(struct zs_pcp);
+		if (!pcps)
+			break;
+		/* pairs with smp_read_barrier_depends() in the fast paths */
+		smp_wmb();
+		class->pcp = pcps;
+	}
+	mutex_unlock(&pool->compact_lock);
+}
 
+/*
+ * Compaction. Objects of a class are moved out of its ZS_ALMOST_EMPTY
+ * zspages into the free slots of its other partially used zspages,
+ * and each zspage emptied this way is freed. Nothing is allocated, so
+ * this is safe to run under memory pressure; the shrinker still leaves
+ * it to pool->compact_work, as it sleeps on compact_lock and may wait
+ * for a grace period.
+ */
+
+/* Copy a whole object, either side of which may span two pages */
+static void zs_object_copy(unsigned long dst, unsigned long src,
+				struct size_class *class)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	s_size = d_size = class->size;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	if (s_off + class->size > PAGE_SIZE)
+		s_size = PAGE_SIZE - s_off;
+
+	if (d_off + class->size > PAGE_SIZE)
+		d_size = PAGE_SIZE - d_off;
+
+	s_addr = kmap_atomic(s_page);
+	d_addr = kmap_atomic(d_page);
+
+	while (1) {
+		size = min(s_size, d_size);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		written += size;
+
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		/* kmap_atomic mappings must be dropped in reverse order */
+		if (s_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			kunmap_atomic(s_addr);
+			s_page = get_next_page(s_page);
+			BUG_ON(!s_page);
+			s_addr = kmap_atomic(s_page);
+			d_addr = kmap_atomic(d_page);
+			s_size = class->size - written;
+			s_off = 0;
+		}
+
+		if (d_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			d_page = get_next_page(d_page);
+			BUG_ON(!d_page);
+			d_addr = kmap_atomic(d_page);
+			d_size = class->size - written;
+			d_off = 0;
+		}
+	}
+
+	kunmap_atomic(d_addr);
+	kunmap_atomic(s_addr);
+}
+
+/* Number of zspages the class could give back if perfectly packed */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_allocated;
+
+	obj_allocated = class->pages_allocated / class->zspage_order *
+			class->objs_per_zspage;
+
+	return (obj_allocated - class->obj_inuse) / class->objs_per_zspage;
+}
+
+/*
+ * Move every allocated object of src_page, which the caller has taken
+ * off the fullness lists, into other zspages of the class. Returns
+ * -EBUSY if an object is pinned, leaving the rest of src_page alone.
+ */
+static int zs_migrate_zspage(struct zs_pool *pool, struct size_class *class,
+				struct page *src_page)
+{
+	struct page *page = src_page, *dst_page;
+	unsigned long off, obj_idx, head, handle;
+	unsigned long used_obj, free_obj;
+	void *addr;
+
+	while (page && src_page->inuse) {
+		off = obj_idx_to_offset(page, 0, class->size);
+
+		for (obj_idx = 0; off < PAGE_SIZE && src_page->inuse;
+				obj_idx++, off += class->size) {
+			addr = kmap_atomic(page);
+			head = *(unsigned long *)(addr + off);
+			kunmap_atomic(addr);
+
+			if (!(head & OBJ_ALLOCATED_TAG))
+				continue;
+
+			handle = head & ~OBJ_ALLOCATED_TAG;
+			if (!trypin_tag(handle))
+				return -EBUSY;
+
+			dst_page = find_get_zspage(class);
+			if (!dst_page) {
+				unpin_tag(handle);
+				return -ENOSPC;
+			}
+
+			used_obj = obj_location_to_obj(page, obj_idx);
+			free_obj = obj_malloc(class, dst_page, handle);
+			zs_object_copy(free_obj, used_obj, class);
+			/* keep it pinned until unpin_tag() */
+			record_obj(handle, free_obj | BIT(HANDLE_PIN_BIT));
+			unpin_tag(handle);
+
+			obj_free(class, used_obj);
+			fix_fullness_group(pool, dst_page);
+		}
+		page = get_next_page(page);
+	}
+
+	return src_page->inuse ? -EBUSY : 0;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct page *src_page;
+	enum fullness_group fg;
+	unsigned long freed = 0;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class)) {
+		/* emptier zspages are cheaper to move out of */
+		fg = ZS_ALMOST_EMPTY;
+		src_page = class->fullness_list[fg];
+		if (!src_page) {
+			fg = ZS_ALMOST_FULL;
+			src_page = class->fullness_list[fg];
+		}
+		if (!src_page)
+			break;
+
+		/* so that it is never picked as a destination */
+		remove_zspage(src_page, class, fg);
+
+		if (zs_migrate_zspage(pool, class, src_page)) {
+			/* a pinned object is left, so it is not empty */
+			fg = get_fullness_group(src_page);
+			insert_zspage(src_page, class, fg);
+			set_zspage_mapping(src_page, class->index, fg);
+			break;
+		}
+
+		set_zspage_mapping(src_page, class->index, ZS_EMPTY);
+		class->pages_allocated -= class->zspage_order;
+		spin_unlock(&class->lock);
+
+		atomic_long_sub(class->zspage_order, &pool->pages_allocated);
+		free_zspage(src_page);
+		freed += class->zspage_order;
+
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/* Compact every size class; returns the number of pages freed */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+	bool has_pcp = false;
+
+	mutex_lock(&pool->compact_lock);
+
+	/*
+	 * Objects in per-CPU caches can not be moved. Keep the fast
+	 * paths out until compaction is done, and return what the caches
+	 * hold so that their zspages can be emptied. With compact_lock
+	 * held no cache is set up meanwhile, so if the pool has none
+	 * there is nothing to wait for.
+	 */
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		if (pool->size_class[i].pcp)
+			has_pcp = true;
+
+	if (has_pcp) {
+		ACCESS_ONCE(pool->pcp_disabled) = 1;
+		synchronize_sched();
+		for (i = 0; i < ZS_SIZE_CLASSES; i++)
+			zs_pcp_drain_all(pool, &pool->size_class[i]);
+	}
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		freed += __zs_compact(pool, &pool->size_class[i]);
+
+	if (has_pcp) {
+		/* pairs with smp_rmb() in the fast paths */
+		smp_wmb();
+		ACCESS_ONCE(pool->pcp_disabled) = 0;
+	}
+
+	mutex_unlock(&pool->compact_lock);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_pages_compacted(struct zs_pool *pool)
+{
+	return atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_pages_compacted);
+
+static void zs_compact_work(struct work_struct *work)
+{
+	struct zs_pool *pool = container_of(work, struct zs_pool,
+					compact_work);
+
+	zs_compact(pool);
+}
+
+/*
+ * Report how many pages compaction could free; when asked to scan,
+ * kick off compaction of the whole pool. Reclaim must not wait on
+ * compact_lock or a grace period, so that is done from a work item.
+ */
+static int zs_shrinker(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					shrinker);
+	unsigned long freeable = 0;
+	int i;
+
+	if (sc->nr_to_scan)
+		schedule_work(&pool->compact_work);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		freeable += zs_can_compact(class) * class->zspage_order;
+	}
+
+	return min_t(unsigned long, freeable, INT_MAX);
+}
 static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 				void *pcpu)
 {
@@ -464,12 +1014,21 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	if (zs_handle_cache)
+		kmem_cache_destroy(zs_handle_cache);
+	zs_handle_cache = NULL;
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cache = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					0, 0, NULL);
+	if (!zs_handle_cache)
+		return -ENOMEM;
+
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
@@ -508,12 +1067,21 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->zspage_order = get_zspage_order(size);
-
+		class->objs_per_zspage = class->zspage_order * PAGE_SIZE /
+						size;
 	}
 
 	pool->flags = flags;
 	pool->name = name;
 
+	mutex_init(&pool->compact_lock);
+	INIT_WORK(&pool->pcp_work, zs_pcp_work);
+	INIT_WORK(&pool->compact_work, zs_compact_work);
+
+	pool->shrinker.shrink = zs_shrinker;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
 	return pool;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
@@ -522,10 +1090,19 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	unregister_shrinker(&pool->shrinker);
+	cancel_work_sync(&pool->pcp_work);
+	cancel_work_sync(&pool->compact_work);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
 
+		if (class->pcp) {
+			zs_pcp_drain_all(pool, class);
+			free_percpu(class->pcp);
+		}
+
 		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
 			if (class->fullness_list[fg]) {
 				pr_info("Freeing non-empty class with size "
@@ -542,111 +1119,119 @@ EXPORT_SYMBOL_GPL(zs_destroy_pool);
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
  *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
+ * On success, a handle to the allocated block is returned, which
+ * must be mapped with zs_map_object() to access the block. NULL is
+ * returned on failure.
  *
- * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
  */
 void *zs_malloc(struct zs_pool *pool, size_t size)
 {
-	void *obj;
-	struct link_free *link;
+	unsigned long handle, obj;
 	int class_idx;
 	struct size_class *class;
+	struct page *first_page;
 
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return NULL;
 
-	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+	handle = alloc_handle(pool->flags);
+	if (unlikely(!handle))
 		return NULL;
 
+	/* extra space in chunk to keep the handle */
+	size += ZS_HANDLE_SIZE;
 	class_idx = get_size_class_index(size);
 	class = &pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
 
+	if (zs_pcp_alloc(pool, class, handle))
+		return (void *)handle;
+
 	spin_lock(&class->lock);
 	first_page = find_get_zspage(class);
 
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			free_handle(handle);
 			return NULL;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
+		atomic_long_add(class->zspage_order, &pool->pages_allocated);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->zspage_order;
+		if (!class->pcp &&
+		    class->pages_allocated >= ZS_PCP_MIN_PAGES)
+			schedule_work(&pool->pcp_work);
 	}
 
-	obj = first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
+	obj = obj_malloc(class, first_page, handle);
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
+	record_obj(handle, obj);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return (void *)handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, void *obj)
+void zs_free(struct zs_pool *pool, void *handle)
 {
-	struct link_free *link;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
+	unsigned long obj, f_objidx;
 
 	int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
+	if (zs_pcp_free(pool, (unsigned long)handle)) {
+		free_handle((unsigned long)handle);
+		return;
+	}
+
+	/* compaction must not move the object from under us */
+	pin_tag((unsigned long)handle);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
 	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
 
 	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = obj;
-
-	first_page->inuse--;
+	obj_free(class, obj);
 	fullness = fix_fullness_group(pool, first_page);
 
 	if (fullness == ZS_EMPTY)
 		class->pages_allocated -= class->zspage_order;
 
 	spin_unlock(&class->lock);
+	unpin_tag((unsigned long)handle);
+	free_handle((unsigned long)handle);
 
-	if (fullness == ZS_EMPTY)
+	if (fullness == ZS_EMPTY) {
+		atomic_long_sub(class->zspage_order, &pool->pages_allocated);
 		free_zspage(first_page);
+	}
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
+/*
+ * The object stays pinned, and so can not be migrated, until
+ * zs_unmap_object(). Nothing that sleeps may be done meanwhile.
+ */
 void *zs_map_object(struct zs_pool *pool, void *handle)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
@@ -655,7 +1240,9 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	pin_tag((unsigned long)handle);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -688,7 +1275,7 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 		area->vm_addr = area->vm->addr;
 	}
 
-	return area->vm_addr + off;
+	return area->vm_addr + off + ZS_HANDLE_SIZE;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
@@ -704,7 +1291,7 @@ static void local_unmap_kernel_range(unsigned long addr, unsigned long size)
 void zs_unmap_object(struct zs_pool *pool, void *handle)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
 	unsigned int class_idx;
 	enum fullness_group fg;
@@ -713,7 +1300,8 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -726,18 +1314,13 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 			PAGE_SIZE * 2);
 
 	put_cpu_var(zs_map_area);
+	unpin_tag((unsigned long)handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
 u64 zs_get_total_size_bytes(struct zs_pool *pool)
 {
-	int i;
-	u64 npages = 0;
-
-	for (i = 0; i < ZS_SIZE_CLASSES; i++)
-		npages += pool->size_class[i].pages_allocated;
-
-	return npages << PAGE_SHIFT;
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
 }
 EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
 
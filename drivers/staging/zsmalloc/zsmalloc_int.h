@@ -14,8 +14,11 @@
 #define _ZS_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 /*
  * This must be power of 2 and greater than of equal to sizeof(link_free).
@@ -33,13 +36,24 @@
 #define ZS_MAX_PAGES_PER_ZSPAGE (_AC(1, UL) << ZS_MAX_ZSPAGE_ORDER)
 
 /*
- * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * Object location (<PFN>, <obj_idx>) is encoded as a single
+ * unsigned long 'obj' value, shifted left by OBJ_TAG_BITS.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
+ * Users never see obj values: zs_malloc() returns a handle, which
+ * points to a word holding the current obj of the allocation. This
+ * lets compaction move objects by rewriting that word. Bit 0 of the
+ * word (HANDLE_PIN_BIT) pins the object in place while it is mapped,
+ * freed or migrated.
+ *
+ * Every allocated object starts with a ZS_HANDLE_SIZE header holding
+ * its handle with OBJ_ALLOCATED_TAG set; free objects hold the next
+ * free obj there instead, which always has that bit clear. This is
+ * how compaction finds the live objects of a zspage.
+ *
  * This is made more complicated by various memory models and PAE.
  */
 
@@ -55,9 +69,14 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS		1
+#define OBJ_ALLOCATED_TAG	1
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+#define HANDLE_PIN_BIT		0
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -109,6 +128,22 @@ enum fullness_group {
  */
 static const int fullness_threshold_frac = 4;
 
+/*
+ * Per-CPU object caches. Once a size class grows to ZS_PCP_MIN_PAGES
+ * pages, each CPU gets a cache of free objects of that class, so that
+ * zs_malloc() and zs_free() do not touch class->lock. Objects move
+ * between a cache and its class ZS_PCP_BATCH at a time. To the
+ * zspage, a cached object is allocated.
+ */
+#define ZS_PCP_MIN_PAGES	64
+#define ZS_PCP_BATCH		8
+#define ZS_PCP_HIGH		(2 * ZS_PCP_BATCH)
+
+struct zs_pcp {
+	int count;
+	unsigned long objs[ZS_PCP_HIGH];
+};
+
 struct mapping_area {
 	struct vm_struct *vm;
 	char *vm_addr;
@@ -127,8 +162,15 @@ struct size_class {
 
 	spinlock_t lock;
 
+	/* set up by pool->pcp_work once the class is hot, else NULL */
+	struct zs_pcp __percpu *pcp;
+
+	/* Number of objects a zspage of this class holds */
+	int objs_per_zspage;
+
 	/* stats */
-	u64 pages_allocated;
+	unsigned long pages_allocated;
+	unsigned long obj_inuse;
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -140,8 +182,12 @@ struct size_class {
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* obj of next free chunk (encodes <PFN, obj_idx>) */
+		unsigned long next;
+		/* handle of an allocated chunk, with OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
@@ -149,6 +195,20 @@ struct zs_pool {
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;	/* pages freed by compaction */
+
+	/* compacts the pool under memory pressure */
+	struct shrinker shrinker;
+	/* serializes compaction; held while pcp_disabled is set */
+	struct mutex compact_lock;
+	/* while set, per-CPU caches are bypassed (and being drained) */
+	int pcp_disabled;
+	/* allocates per-CPU caches for classes that became hot */
+	struct work_struct pcp_work;
+	/* compacts the pool when the shrinker asks for it */
+	struct work_struct compact_work;
 };
 
 #endif
@@ -974,6 +974,8 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 		threadgroup_change_end(tsk);
 
+		lowmem_task_del(leader);
+		lowmem_task_add(tsk);
 		release_task(leader);
 	}
 
@@ -152,6 +152,7 @@ enum rq_flag_bits {
 	__REQ_MIXED_MERGE,	/* merge of different types, fail separately */
 	__REQ_SANITIZE,		/* sanitize */
 	__REQ_URGENT,		/* urgent request */
+	__REQ_WBT,		/* counted by writeback throttling */
 	__REQ_NR_BITS,		/* stops here */
 };
 
@@ -165,6 +166,7 @@ enum rq_flag_bits {
 #define REQ_DISCARD		(1 << __REQ_DISCARD)
 #define REQ_SANITIZE		(1 << __REQ_SANITIZE)
 #define REQ_URGENT		(1 << __REQ_URGENT)
+#define REQ_WBT			(1 << __REQ_WBT)
 #define REQ_NOIDLE		(1 << __REQ_NOIDLE)
 
 #define REQ_FAILFAST_MASK \
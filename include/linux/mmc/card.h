@@ -13,6 +13,8 @@
 #include <linux/device.h>
 #include <linux/mmc/core.h>
 #include <linux/mod_devicetable.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 
 struct mmc_cid {
 	unsigned int		manfid;
@@ -79,6 +81,11 @@ struct mmc_ext_csd {
 	unsigned int            data_sector_size;       /* 512 bytes or 4KB */
 	unsigned int            data_tag_unit_size;     /* DATA TAG UNIT size */
 	unsigned int		boot_ro_lock;		/* ro lock support */
+	u8			max_packed_writes;	/* 500 */
+	u8			max_packed_reads;	/* 501 */
+	bool			packed_event_en;	/* PACKED_EVENT_EN bit */
+	bool			bkops;		/* background support bit */
+	bool			bkops_en;	/* background enable bit */
 	bool			boot_ro_lockable;
 	u8			raw_partition_support;	/* 160 */
 	u8			raw_erased_mem_count;	/* 181 */
@@ -93,6 +100,7 @@ struct mmc_ext_csd {
 	u8			raw_sec_erase_mult;	/* 230 */
 	u8			raw_sec_feature_support;/* 231 */
 	u8			raw_trim_mult;		/* 232 */
+	u8			raw_bkops_status;	/* 246 */
 	u8			raw_sectors[4];		/* 212 - 4 bytes */
 
 	unsigned int            feature_support;
@@ -202,6 +210,53 @@ struct mmc_part {
 #define MMC_BLK_DATA_AREA_GP	(1<<2)
 };
 
+/*
+ * Packed write statistics.  The block driver fills these in and they
+ * are reported through the card's wr_pack_stats debugfs file.
+ */
+#define MMC_PACKED_NR_MAX	63	/* entries that fit a 512 byte header */
+
+enum mmc_packed_stop_reasons {
+	MMC_PACK_STOP_SEGMENTS = 0,	/* would exceed max_segs */
+	MMC_PACK_STOP_SECTORS,		/* would exceed max_blk_count */
+	MMC_PACK_STOP_DATA_DIR,		/* next request is a read */
+	MMC_PACK_STOP_FLUSH_DISCARD,	/* next request is a flush or discard */
+	MMC_PACK_STOP_EMPTY_QUEUE,	/* nothing left in the queue */
+	MMC_PACK_STOP_REL_WRITE,	/* reliable write the card cannot pack */
+	MMC_PACK_STOP_MAX_ENTRIES,	/* packed header is full */
+	MMC_PACK_STOP_NR,
+};
+
+struct mmc_wr_pack_stats {
+	spinlock_t		lock;
+	unsigned long		packing_events[MMC_PACKED_NR_MAX + 1];
+	unsigned long		stop_reason[MMC_PACK_STOP_NR];
+	unsigned long		failures;	/* packed cmds with an error */
+	unsigned long		retries;	/* re-issued after a failure */
+};
+
+struct mmc_bkops_stats {
+	spinlock_t		lock;
+	unsigned long		manual;		/* started on an idle queue */
+	unsigned long		urgent;		/* run to completion at once */
+	unsigned long		suspend;	/* urgent ones run before sleep */
+	unsigned long		hpi;		/* manual ones cut short by HPI */
+	unsigned long		completed;	/* manual ones the card finished */
+	unsigned long		level[4];	/* BKOPS_STATUS when started */
+	u64			total_ns;	/* time the card spent in BKOPS */
+	u64			max_ns;
+};
+
+#define MMC_BKOPS_IDLE_DELAY_MS	2000	/* default idle time before BKOPS */
+#define MMC_BKOPS_POLL_MS	200	/* completion poll while idle */
+
+struct mmc_bkops_info {
+	struct delayed_work	dw;		/* idle start and poll */
+	unsigned int		delay_ms;	/* idle time before starting */
+	ktime_t			start;		/* of the running manual BKOPS */
+	struct mmc_bkops_stats	stats;
+};
+
 /*
  * MMC device
  */
@@ -225,6 +280,7 @@ struct mmc_card {
 #define MMC_CARD_REMOVED	(1<<7)		/* card has been removed */
 #define MMC_STATE_HIGHSPEED_200	(1<<8)		/* card is in HS200 mode */
 #define MMC_STATE_SLEEP		(1<<9)		/* card is in sleep state */
+#define MMC_STATE_DOING_BKOPS	(1<<10)		/* card is doing BKOPS */
 	unsigned int		quirks; 	/* card quirks */
 #define MMC_QUIRK_LENIENT_FN0	(1<<0)		/* allow SDIO FN0 writes outside of the VS CCCR range */
 #define MMC_QUIRK_BLKSZ_FOR_BYTE_MODE (1<<1)	/* use func->cur_blksize */
@@ -273,6 +329,8 @@ struct mmc_card {
 	unsigned int		sd_bus_speed;	/* Bus Speed Mode set for the card */
 
 	struct dentry		*debugfs_root;
+	struct mmc_wr_pack_stats wr_pack_stats;	/* packed write statistics */
+	struct mmc_bkops_info	bkops_info;	/* background operations */
 	struct mmc_part	part[MMC_NUM_PHY_PARTITION]; /* physical partitions */
 	unsigned int    nr_parts;
 };
@@ -392,6 +450,7 @@ static inline void __maybe_unused remove_quirk(struct mmc_card *card, int data)
 #define mmc_card_ext_capacity(c) ((c)->state & MMC_CARD_SDXC)
 #define mmc_card_removed(c)	((c) && ((c)->state & MMC_CARD_REMOVED))
 #define mmc_card_is_sleep(c)	((c)->state & MMC_STATE_SLEEP)
+#define mmc_card_doing_bkops(c)	((c)->state & MMC_STATE_DOING_BKOPS)
 
 #define mmc_card_set_present(c)	((c)->state |= MMC_STATE_PRESENT)
 #define mmc_card_set_readonly(c) ((c)->state |= MMC_STATE_READONLY)
@@ -404,8 +463,10 @@ static inline void __maybe_unused remove_quirk(struct mmc_card *card, int data)
 #define mmc_card_set_ext_capacity(c) ((c)->state |= MMC_CARD_SDXC)
 #define mmc_card_set_removed(c) ((c)->state |= MMC_CARD_REMOVED)
 #define mmc_card_set_sleep(c)	((c)->state |= MMC_STATE_SLEEP)
+#define mmc_card_set_doing_bkops(c)	((c)->state |= MMC_STATE_DOING_BKOPS)
 
 #define mmc_card_clr_sleep(c)	((c)->state &= ~MMC_STATE_SLEEP)
+#define mmc_card_clr_doing_bkops(c)	((c)->state &= ~MMC_STATE_DOING_BKOPS)
 /*
  * Quirk add/remove for MMC products.
  */
@@ -67,6 +67,26 @@ static inline void oom_killer_enable(void)
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+/*
+ * Keep the lowmemorykiller's per-oom_score_adj task buckets current.
+ * None of these may be called with an irq-safe lock held.
+ */
+extern void lowmem_task_add(struct task_struct *task);
+extern void lowmem_task_del(struct task_struct *task);
+extern void lowmem_task_update(struct task_struct *task);
+#else
+static inline void lowmem_task_add(struct task_struct *task)
+{
+}
+static inline void lowmem_task_del(struct task_struct *task)
+{
+}
+static inline void lowmem_task_update(struct task_struct *task)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
@@ -442,6 +442,7 @@ extern int get_dumpable(struct mm_struct *mm);
 					/* leave room for more dump flags */
 #define MMF_VM_MERGEABLE	16	/* KSM may merge identical pages */
 #define MMF_VM_HUGEPAGE		17	/* set when VM_HUGEPAGE is set on vma */
+#define MMF_UNSTABLE		18	/* mappings were zapped under the owner */
 
 #define MMF_INIT_MASK		(MMF_DUMPABLE_MASK | MMF_DUMP_FILTER_MASK)
 
@@ -1331,6 +1332,13 @@ struct task_struct {
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* thread group leaders only, on the lowmemorykiller oom_score_adj bucket */
+	struct hlist_node lowmem_node;
+	/* killed and waiting for the lowmemorykiller reaper */
+	struct list_head lowmem_reap_node;
+	ktime_t lowmem_killed;
+#endif
 
 	struct mm_struct *mm, *active_mm;
 #ifdef CONFIG_COMPAT_BRK
@@ -177,6 +177,7 @@ repeat:
 	rcu_read_unlock();
 
 	proc_flush_task(p);
+	lowmem_task_del(p);
 
 	write_lock_irq(&tasklist_lock);
 	ptrace_release_task(p);
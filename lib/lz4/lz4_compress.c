@@ -0,0 +1,139 @@
+/*
+ * LZ4 - Fast LZ compression algorithm
+ *
+ * Compressor for the LZ4 block format (Yann Collet,
+ * http://code.google.com/p/lz4/), single pass with a 4-byte hash
+ * table and a 64KB window.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include "lz4defs.h"
+
+/* Emit a length continuation: runs of 255 and a final byte < 255 */
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/* Emit the token and literals [anchor, anchor + run); returns token */
+static inline unsigned char *lz4_put_literals(unsigned char **opp,
+		const unsigned char *anchor, size_t run)
+{
+	unsigned char *token = *opp;
+	unsigned char *op = token + 1;
+
+	if (run >= RUN_MASK) {
+		*token = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, run - RUN_MASK);
+	} else {
+		*token = run << ML_BITS;
+	}
+	memcpy(op, anchor, run);
+	*opp = op + run;
+
+	return token;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	u32 *hashtable = wrkmem;
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char *const iend = src + src_len;
+	const unsigned char *const mflimit = iend - MFLIMIT;
+	const unsigned char *const matchlimit = iend - LASTLITERALS;
+	unsigned char *op = dst;
+
+	/* positions are stored as 32-bit offsets from src */
+	if (src_len > 0x7fffffff)
+		return -1;
+
+	if (src_len < MINLENGTH)
+		goto last_literals;
+
+	memset(hashtable, 0, LZ4_MEM_COMPRESS);
+
+	for (;;) {
+		const unsigned char *ref;
+		unsigned char *token;
+		unsigned int attempts = 1 << SKIPSTRENGTH;
+		size_t len;
+
+		/* Find a match */
+		for (;;) {
+			u32 h;
+
+			if (unlikely(ip > mflimit))
+				goto last_literals;
+
+			h = HASH_VALUE(ip);
+			ref = src + hashtable[h];
+			hashtable[h] = ip - src;
+
+			if (ref < ip && ip - ref <= MAX_DISTANCE &&
+			    get_unaligned((u32 *)ref) ==
+			    get_unaligned((u32 *)ip))
+				break;
+
+			ip += attempts++ >> SKIPSTRENGTH;
+		}
+
+		/* Catch up */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		token = lz4_put_literals(&op, anchor, ip - anchor);
+
+		/* Encode offset */
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		/* Count the match length beyond MINMATCH */
+		ip += MINMATCH;
+		ref += MINMATCH;
+		anchor = ip;
+		while (ip < matchlimit && *ip == *ref) {
+			ip++;
+			ref++;
+		}
+		len = ip - anchor;
+
+		/* Encode MatchLength */
+		if (len >= ML_MASK) {
+			*token |= ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else {
+			*token |= len;
+		}
+
+		anchor = ip;
+
+		/* Fill the table with the position we skipped over */
+		if (ip - 2 > src)
+			hashtable[HASH_VALUE(ip - 2)] = ip - 2 - src;
+	}
+
+last_literals:
+	/* Encode Last Literals */
+	lz4_put_literals(&op, anchor, iend - anchor);
+
+	*dst_len = op - dst;
+	return 0;
+}
+EXPORT_SYMBOL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 compressor");
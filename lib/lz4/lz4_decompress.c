@@ -0,0 +1,106 @@
+/*
+ * LZ4 Decompressor for Linux kernel
+ *
+ * Decoder for the LZ4 block format (Yann Collet,
+ * http://code.google.com/p/lz4/). Every length and offset is checked
+ * against both buffers, so corrupted input can never make it read or
+ * write out of bounds.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include "lz4defs.h"
+
+/* Read a length continuation; returns 0 if it runs past the input */
+static inline int lz4_get_length(const unsigned char **ipp,
+		const unsigned char *iend, size_t *len)
+{
+	const unsigned char *ip = *ipp;
+	unsigned int s;
+
+	do {
+		if (unlikely(ip >= iend))
+			return 0;
+		s = *ip++;
+		*len += s;
+	} while (s == 255);
+
+	*ipp = ip;
+	return 1;
+}
+
+int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+		unsigned char *dest, size_t *dest_len)
+{
+	const unsigned char *ip = src;
+	const unsigned char *const iend = src + src_len;
+	unsigned char *op = dest;
+	unsigned char *const oend = dest + *dest_len;
+
+	while (ip < iend) {
+		const unsigned char *ref;
+		unsigned int token;
+		size_t length, offset;
+
+		/* get runlength */
+		token = *ip++;
+		length = token >> ML_BITS;
+		if (length == RUN_MASK && !lz4_get_length(&ip, iend, &length))
+			goto _output_error;
+
+		/* copy literals */
+		if (unlikely(length > (size_t)(iend - ip) ||
+			     length > (size_t)(oend - op)))
+			goto _output_error;
+		memcpy(op, ip, length);
+		op += length;
+		ip += length;
+
+		/* the last sequence has no match part */
+		if (ip == iend)
+			break;
+
+		/* get offset */
+		if (unlikely(iend - ip < 2))
+			goto _output_error;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(offset == 0 || offset > (size_t)(op - dest)))
+			goto _output_error;
+		ref = op - offset;
+
+		/* get matchlength */
+		length = token & ML_MASK;
+		if (length == ML_MASK && !lz4_get_length(&ip, iend, &length))
+			goto _output_error;
+		length += MINMATCH;
+		if (unlikely(length > (size_t)(oend - op)))
+			goto _output_error;
+
+		/* copy repeated sequence; overlapping copies go bytewise */
+		if (offset >= length) {
+			memcpy(op, ref, length);
+			op += length;
+		} else {
+			while (length--)
+				*op++ = *ref++;
+		}
+	}
+
+	*dest_len = op - dest;
+	return 0;
+
+	/* write overflow error detected */
+_output_error:
+	return -1;
+}
+EXPORT_SYMBOL(lz4_decompress_unknownoutputsize);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
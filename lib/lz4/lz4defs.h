@@ -0,0 +1,39 @@
+/*
+ * lz4defs.h -- LZ4 block format definitions
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <asm/unaligned.h>
+
+/*
+ * Block format: a sequence is a token byte (literal length in the
+ * high nibble, match length - MINMATCH in the low nibble), optional
+ * literal length bytes, the literals, a 16-bit little endian match
+ * offset and optional match length bytes. A length nibble of
+ * RUN_MASK / ML_MASK is continued by bytes of 255 up to a final byte
+ * smaller than 255. The last sequence only carries literals.
+ */
+#define MINMATCH	4
+#define COPYLENGTH	8
+#define LASTLITERALS	5
+#define MFLIMIT		(COPYLENGTH + MINMATCH)
+#define MINLENGTH	(MFLIMIT + 1)
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+#define MAXD_LOG	16
+#define MAX_DISTANCE	((1 << MAXD_LOG) - 1)
+
+#define HASH_LOG	12
+#define HASH_SIZE	(1 << HASH_LOG)
+#define HASH_VALUE(p)	(((get_unaligned((u32 *)(p))) * 2654435761U) >> \
+				((MINMATCH * 8) - HASH_LOG))
+
+/* Skip faster over incompressible data: step grows every 2^SKIPSTRENGTH */
+#define SKIPSTRENGTH	6
@@ -15,11 +15,13 @@
 #define DEBUG
 
 #include <linux/file.h>
+#include <linux/hash.h>
 #include <linux/inetdevice.h>
 #include <linux/module.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_qtaguid.h>
 #include <linux/ratelimit.h>
+#include <linux/rcupdate.h>
 #include <linux/skbuff.h>
 #include <linux/workqueue.h>
 #include <net/addrconf.h>
@@ -136,6 +138,11 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
  * Notice how sock_tag_list_lock is held sometimes when uid_tag_data_tree_lock
  * is acquired.
  *
+ * The packet path takes none of the above: iface_stat_list, sock_tag_hash,
+ * tag_counter_set_hash and each iface's tag_stat_hash are searched under
+ * rcu_read_lock(), and their locks only serialize the writers. Counters are
+ * per cpu, see struct data_counters_cpu.
+ *
  * Call tree with all lock holders as of 2012-04-27:
  *
  * iface_stat_fmt_proc_read()
@@ -144,11 +151,11 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
  *
  * qtaguid_ctrl_proc_read()
  *   sock_tag_list_lock
- *     (sock_tag_tree)
+ *     (sock_tag_hash)
  *     (struct proc_qtu_data->sock_tag_list)
  *   prdebug_full_state()
  *     sock_tag_list_lock
- *       (sock_tag_tree)
+ *       (sock_tag_hash)
  *     uid_tag_data_tree_lock
  *       (uid_tag_data_tree)
  *       (proc_qtu_data_tree)
@@ -188,17 +195,20 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
  *     iface_stat_list_lock
  *
  * qtaguid_mt()
+ *   iface_stat_update_from_skb()
+ *     rcu_read_lock
+ *       (iface_stat_list)
  *   account_for_uid()
  *     if_tag_stat_update()
- *       get_sock_stat()
- *         sock_tag_list_lock
- *       struct iface_stat->tag_stat_list_lock
- *         tag_stat_update()
- *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *       rcu_read_lock
+ *         (iface_stat_list)
+ *         get_sock_tag()
+ *           (sock_tag_hash)
  *         tag_stat_update()
  *           get_active_counter_set()
- *             tag_counter_set_list_lock
+ *             (tag_counter_set_hash)
+ *         struct iface_stat->tag_stat_list_lock (first packet of a tag)
+ *           tag_stat_update()
  *
  *
  * qtaguid_ctrl_parse()
@@ -212,7 +222,7 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
  *     tag_counter_set_list_lock
  *   ctrl_cmd_tag()
  *     sock_tag_list_lock
- *       (sock_tag_tree)
+ *       (sock_tag_hash)
  *       get_tag_ref()
  *         uid_tag_data_tree_lock
  *           (uid_tag_data_tree)
@@ -226,10 +236,12 @@ static struct proc_dir_entry *iface_stat_fmt_procfile;
 static LIST_HEAD(iface_stat_list);
 static DEFINE_SPINLOCK(iface_stat_list_lock);
 
-static struct rb_root sock_tag_tree = RB_ROOT;
+#define SOCK_TAG_HASH_BITS 10
+static struct hlist_head sock_tag_hash[1 << SOCK_TAG_HASH_BITS];
 static DEFINE_SPINLOCK(sock_tag_list_lock);
 
-static struct rb_root tag_counter_set_tree = RB_ROOT;
+#define TAG_COUNTER_SET_HASH_BITS 6
+static struct hlist_head tag_counter_set_hash[1 << TAG_COUNTER_SET_HASH_BITS];
 static DEFINE_SPINLOCK(tag_counter_set_list_lock);
 
 static struct rb_root uid_tag_data_tree = RB_ROOT;
@@ -320,33 +332,76 @@ static void tag_node_tree_insert(struct tag_node *data, struct rb_root *root)
 	rb_insert_color(&data->node, root);
 }
 
-static void tag_stat_tree_insert(struct tag_stat *data, struct rb_root *root)
+/*
+ * Caller must hold rcu_read_lock() or the lock serializing writers to the
+ * hash.
+ */
+static struct tag_hnode *tag_hnode_hash_search(struct hlist_head *hash,
+					       int bits, tag_t tag)
 {
-	tag_node_tree_insert(&data->tn, root);
+	struct tag_hnode *data;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry_rcu(data, pos, &hash[hash_64(tag, bits)], node) {
+		RB_DEBUG("qtaguid: tag_hnode_hash_search(0x%llx): "
+			 " data.tag=0x%llx (uid=%u)\n",
+			 tag, data->tag, get_uid_from_tag(data->tag));
+		if (data->tag == tag)
+			return data;
+	}
+	return NULL;
 }
 
-static struct tag_stat *tag_stat_tree_search(struct rb_root *root, tag_t tag)
+/* Caller must hold the lock serializing writers to the hash. */
+static void tag_hnode_hash_insert(struct tag_hnode *data,
+				  struct hlist_head *hash, int bits)
 {
-	struct tag_node *node = tag_node_tree_search(root, tag);
+	hlist_add_head_rcu(&data->node, &hash[hash_64(data->tag, bits)]);
+}
+
+static void tag_stat_hash_insert(struct tag_stat *data,
+				 struct iface_stat *iface_entry)
+{
+	tag_hnode_hash_insert(&data->tn, iface_entry->tag_stat_hash,
+			      TAG_STAT_HASH_BITS);
+}
+
+static struct tag_stat *tag_stat_hash_search(struct iface_stat *iface_entry,
+					     tag_t tag)
+{
+	struct tag_hnode *node;
+
+	node = tag_hnode_hash_search(iface_entry->tag_stat_hash,
+				     TAG_STAT_HASH_BITS, tag);
 	if (!node)
 		return NULL;
-	return rb_entry(&node->node, struct tag_stat, tn.node);
+	return container_of(node, struct tag_stat, tn);
 }
 
-static void tag_counter_set_tree_insert(struct tag_counter_set *data,
-					struct rb_root *root)
+static void tag_stat_free_rcu(struct rcu_head *head)
 {
-	tag_node_tree_insert(&data->tn, root);
+	struct tag_stat *ts_entry = container_of(head, struct tag_stat,
+						 tn.rcu);
+
+	kfree(ts_entry->counters);
+	kfree(ts_entry);
 }
 
-static struct tag_counter_set *tag_counter_set_tree_search(struct rb_root *root,
-							   tag_t tag)
+static void tag_counter_set_hash_insert(struct tag_counter_set *data)
 {
-	struct tag_node *node = tag_node_tree_search(root, tag);
+	tag_hnode_hash_insert(&data->tn, tag_counter_set_hash,
+			      TAG_COUNTER_SET_HASH_BITS);
+}
+
+static struct tag_counter_set *tag_counter_set_hash_search(tag_t tag)
+{
+	struct tag_hnode *node;
+
+	node = tag_hnode_hash_search(tag_counter_set_hash,
+				     TAG_COUNTER_SET_HASH_BITS, tag);
 	if (!node)
 		return NULL;
-	return rb_entry(&node->node, struct tag_counter_set, tn.node);
-
+	return container_of(node, struct tag_counter_set, tn);
 }
 
 static void tag_ref_tree_insert(struct tag_ref *data, struct rb_root *root)
@@ -362,63 +417,50 @@ static struct tag_ref *tag_ref_tree_search(struct rb_root *root, tag_t tag)
 	return rb_entry(&node->node, struct tag_ref, tn.node);
 }
 
-static struct sock_tag *sock_tag_tree_search(struct rb_root *root,
-					     const struct sock *sk)
+/*
+ * Caller must hold rcu_read_lock() or sock_tag_list_lock.
+ */
+static struct sock_tag *sock_tag_hash_search(const struct sock *sk)
 {
-	struct rb_node *node = root->rb_node;
+	struct hlist_head *head = &sock_tag_hash[hash_ptr(sk,
+							  SOCK_TAG_HASH_BITS)];
+	struct sock_tag *data;
+	struct hlist_node *pos;
 
-	while (node) {
-		struct sock_tag *data = rb_entry(node, struct sock_tag,
-						 sock_node);
-		if (sk < data->sk)
-			node = node->rb_left;
-		else if (sk > data->sk)
-			node = node->rb_right;
-		else
+	hlist_for_each_entry_rcu(data, pos, head, sock_node) {
+		if (data->sk == sk)
 			return data;
 	}
 	return NULL;
 }
 
-static void sock_tag_tree_insert(struct sock_tag *data, struct rb_root *root)
+/* Caller must hold sock_tag_list_lock. */
+static void sock_tag_hash_insert(struct sock_tag *data)
 {
-	struct rb_node **new = &(root->rb_node), *parent = NULL;
+	struct hlist_head *head = &sock_tag_hash[hash_ptr(data->sk,
+							  SOCK_TAG_HASH_BITS)];
 
-	/* Figure out where to put new node */
-	while (*new) {
-		struct sock_tag *this = rb_entry(*new, struct sock_tag,
-						 sock_node);
-		parent = *new;
-		if (data->sk < this->sk)
-			new = &((*new)->rb_left);
-		else if (data->sk > this->sk)
-			new = &((*new)->rb_right);
-		else
-			BUG();
-	}
-
-	/* Add new node and rebalance tree. */
-	rb_link_node(&data->sock_node, parent, new);
-	rb_insert_color(&data->sock_node, root);
+	BUG_ON(sock_tag_hash_search(data->sk));
+	hlist_add_head_rcu(&data->sock_node, head);
 }
 
-static void sock_tag_tree_erase(struct rb_root *st_to_free_tree)
+/*
+ * Release sock_tags that were taken out of the sock_tag_hash and chained on
+ * st_to_free_list through their list.
+ */
+static void sock_tag_list_erase(struct list_head *st_to_free_list)
 {
-	struct rb_node *node;
-	struct sock_tag *st_entry;
+	struct sock_tag *st_entry, *tmp;
 
-	node = rb_first(st_to_free_tree);
-	while (node) {
-		st_entry = rb_entry(node, struct sock_tag, sock_node);
-		node = rb_next(node);
+	list_for_each_entry_safe(st_entry, tmp, st_to_free_list, list) {
 		CT_DEBUG("qtaguid: %s(): "
 			 "erase st: sk=%p tag=0x%llx (uid=%u)\n", __func__,
 			 st_entry->sk,
 			 st_entry->tag,
 			 get_uid_from_tag(st_entry->tag));
-		rb_erase(&st_entry->sock_node, st_to_free_tree);
+		list_del(&st_entry->list);
 		sockfd_put(st_entry->socket);
-		kfree(st_entry);
+		kfree_rcu(st_entry, rcu);
 	}
 }
 
@@ -739,17 +781,18 @@ static int get_active_counter_set(tag_t tag)
 		 tag, get_uid_from_tag(tag));
 	/* For now we only handle UID tags for active sets */
 	tag = get_utag_from_tag(tag);
-	spin_lock_bh(&tag_counter_set_list_lock);
-	tcs = tag_counter_set_tree_search(&tag_counter_set_tree, tag);
+	rcu_read_lock();
+	tcs = tag_counter_set_hash_search(tag);
 	if (tcs)
-		active_set = tcs->active_set;
-	spin_unlock_bh(&tag_counter_set_list_lock);
+		active_set = ACCESS_ONCE(tcs->active_set);
+	rcu_read_unlock();
 	return active_set;
 }
 
 /*
  * Find the entry for tracking the specified interface.
- * Caller must hold iface_stat_list_lock
+ * Caller must hold iface_stat_list_lock or rcu_read_lock().
+ * Entries are never deleted.
  */
 static struct iface_stat *get_iface_entry(const char *ifname)
 {
@@ -762,7 +805,7 @@ static struct iface_stat *get_iface_entry(const char *ifname)
 	}
 
 	/* Iterate over interfaces */
-	list_for_each_entry(iface_entry, &iface_stat_list, list) {
+	list_for_each_entry_rcu(iface_entry, &iface_stat_list, list) {
 		if (!strcmp(ifname, iface_entry->ifname))
 			goto done;
 	}
@@ -789,9 +832,9 @@ static int pp_iface_stat_line(bool header, char *outp,
 			       "tx_other_bytes tx_other_packets\n"
 			);
 	} else {
-		struct data_counters *cnts;
+		struct data_counters counters, *cnts = &counters;
 		int cnt_set = 0;   /* We only use one set for the device */
-		cnts = &iface_entry->totals_via_skb;
+		dc_fold(cnts, iface_entry->totals_via_skb);
 		len = snprintf(
 			outp, char_count,
 			"%s "
@@ -992,8 +1035,15 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 		kfree(new_iface);
 		return NULL;
 	}
+	new_iface->totals_via_skb = data_counters_alloc(GFP_ATOMIC);
+	if (new_iface->totals_via_skb == NULL) {
+		pr_err("qtaguid: iface_stat: create(%s): "
+		       "counters alloc failed\n", net_dev->name);
+		kfree(new_iface->ifname);
+		kfree(new_iface);
+		return NULL;
+	}
 	spin_lock_init(&new_iface->tag_stat_list_lock);
-	new_iface->tag_stat_tree = RB_ROOT;
 	_iface_stat_set_active(new_iface, net_dev, true);
 
 	/*
@@ -1005,6 +1055,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 		pr_err("qtaguid: iface_stat: create(%s): "
 		       "work alloc failed\n", new_iface->ifname);
 		_iface_stat_set_active(new_iface, net_dev, false);
+		kfree(new_iface->totals_via_skb);
 		kfree(new_iface->ifname);
 		kfree(new_iface);
 		return NULL;
@@ -1012,7 +1063,7 @@ static struct iface_stat *iface_alloc(struct net_device *net_dev)
 	isw->iface_entry = new_iface;
 	INIT_WORK(&isw->iface_work, iface_create_proc_worker);
 	schedule_work(&isw->iface_work);
-	list_add(&new_iface->list, &iface_stat_list);
+	list_add_rcu(&new_iface->list, &iface_stat_list);
 	return new_iface;
 }
 
@@ -1190,19 +1241,24 @@ done_put:
 static struct sock_tag *get_sock_stat_nl(const struct sock *sk)
 {
 	MT_DEBUG("qtaguid: get_sock_stat_nl(sk=%p)\n", sk);
-	return sock_tag_tree_search(&sock_tag_tree, sk);
+	return sock_tag_hash_search(sk);
 }
 
-static struct sock_tag *get_sock_stat(const struct sock *sk)
+/*
+ * Look up the tag of a tagged sock, without the lock.
+ * Caller must hold rcu_read_lock().
+ */
+static bool get_sock_tag(const struct sock *sk, tag_t *tag)
 {
 	struct sock_tag *sock_tag_entry;
-	MT_DEBUG("qtaguid: get_sock_stat(sk=%p)\n", sk);
+	MT_DEBUG("qtaguid: get_sock_tag(sk=%p)\n", sk);
 	if (!sk)
-		return NULL;
-	spin_lock_bh(&sock_tag_list_lock);
-	sock_tag_entry = get_sock_stat_nl(sk);
-	spin_unlock_bh(&sock_tag_list_lock);
-	return sock_tag_entry;
+		return false;
+	sock_tag_entry = sock_tag_hash_search(sk);
+	if (!sock_tag_entry)
+		return false;
+	*tag = sock_tag_entry->tag;
+	return true;
 }
 
 static int ipx_proto(const struct sk_buff *skb,
@@ -1226,23 +1282,32 @@ static int ipx_proto(const struct sk_buff *skb,
 	return tproto;
 }
 
+/*
+ * Bump this cpu's copy of the counters.
+ * Called from the match, which ip(6)t_do_table() runs with BHs disabled, so
+ * nothing else can be updating the same copy.
+ */
 static void
-data_counters_update(struct data_counters *dc, int set,
+data_counters_update(struct data_counters_cpu *dcc, int set,
 		     enum ifs_tx_rx direction, int proto, int bytes)
 {
+	struct data_counters_cpu *c = &dcc[smp_processor_id()];
+
+	u64_stats_update_begin(&c->syncp);
 	switch (proto) {
 	case IPPROTO_TCP:
-		dc_add_byte_packets(dc, set, direction, IFS_TCP, bytes, 1);
+		dc_add_byte_packets(&c->dc, set, direction, IFS_TCP, bytes, 1);
 		break;
 	case IPPROTO_UDP:
-		dc_add_byte_packets(dc, set, direction, IFS_UDP, bytes, 1);
+		dc_add_byte_packets(&c->dc, set, direction, IFS_UDP, bytes, 1);
 		break;
 	case IPPROTO_IP:
 	default:
-		dc_add_byte_packets(dc, set, direction, IFS_PROTO_OTHER, bytes,
-				    1);
+		dc_add_byte_packets(&c->dc, set, direction, IFS_PROTO_OTHER,
+				    bytes, 1);
 		break;
 	}
+	u64_stats_update_end(&c->syncp);
 }
 
 /*
@@ -1353,21 +1418,21 @@ static void iface_stat_update_from_skb(const struct sk_buff *skb,
 		 par->hooknum, __func__, el_dev->name, el_dev->type,
 		 par->family, proto, direction);
 
-	spin_lock_bh(&iface_stat_list_lock);
+	rcu_read_lock();
 	entry = get_iface_entry(el_dev->name);
 	if (entry == NULL) {
 		IF_DEBUG("qtaguid[%d]: iface_stat: %s(%s): not tracked\n",
 			 par->hooknum, __func__, el_dev->name);
-		spin_unlock_bh(&iface_stat_list_lock);
+		rcu_read_unlock();
 		return;
 	}
 
 	IF_DEBUG("qtaguid[%d]: %s(%s): entry=%p\n", par->hooknum,  __func__,
 		 el_dev->name, entry);
 
-	data_counters_update(&entry->totals_via_skb, 0, direction, proto,
+	data_counters_update(entry->totals_via_skb, 0, direction, proto,
 			     bytes);
-	spin_unlock_bh(&iface_stat_list_lock);
+	rcu_read_unlock();
 }
 
 static void tag_stat_update(struct tag_stat *tag_entry,
@@ -1379,7 +1444,7 @@ static void tag_stat_update(struct tag_stat *tag_entry,
 		 "dir=%d proto=%d bytes=%d)\n",
 		 tag_entry->tn.tag, get_uid_from_tag(tag_entry->tn.tag),
 		 active_set, direction, proto, bytes);
-	data_counters_update(&tag_entry->counters, active_set, direction,
+	data_counters_update(tag_entry->counters, active_set, direction,
 			     proto, bytes);
 	if (tag_entry->parent_counters)
 		data_counters_update(tag_entry->parent_counters, active_set,
@@ -1388,25 +1453,33 @@ static void tag_stat_update(struct tag_stat *tag_entry,
 
 /*
  * Create a new entry for tracking the specified {acct_tag,uid_tag} within
- * the interface.
+ * the interface, billing it to parent_counters as well if not NULL.
  * iface_entry->tag_stat_list_lock should be held.
  */
 static struct tag_stat *create_if_tag_stat(struct iface_stat *iface_entry,
-					   tag_t tag)
+					   tag_t tag,
+					   struct data_counters_cpu *parent)
 {
 	struct tag_stat *new_tag_stat_entry = NULL;
 	IF_DEBUG("qtaguid: iface_stat: %s(): ife=%p tag=0x%llx"
 		 " (uid=%u)\n", __func__,
 		 iface_entry, tag, get_uid_from_tag(tag));
 	new_tag_stat_entry = kzalloc(sizeof(*new_tag_stat_entry), GFP_ATOMIC);
-	if (!new_tag_stat_entry) {
-		pr_err("qtaguid: iface_stat: tag stat alloc failed\n");
-		goto done;
+	if (!new_tag_stat_entry)
+		goto err;
+	new_tag_stat_entry->counters = data_counters_alloc(GFP_ATOMIC);
+	if (!new_tag_stat_entry->counters) {
+		kfree(new_tag_stat_entry);
+		goto err;
 	}
 	new_tag_stat_entry->tn.tag = tag;
-	tag_stat_tree_insert(new_tag_stat_entry, &iface_entry->tag_stat_tree);
-done:
+	new_tag_stat_entry->parent_counters = parent;
+	/* Lockless readers may find it from here on */
+	tag_stat_hash_insert(new_tag_stat_entry, iface_entry);
 	return new_tag_stat_entry;
+err:
+	pr_err("qtaguid: iface_stat: tag stat alloc failed\n");
+	return NULL;
 }
 
 static void if_tag_stat_update(const char *ifname, uid_t uid,
@@ -1416,20 +1489,19 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	struct tag_stat *tag_stat_entry;
 	tag_t tag, acct_tag;
 	tag_t uid_tag;
-	struct data_counters *uid_tag_counters;
-	struct sock_tag *sock_tag_entry;
+	struct data_counters_cpu *uid_tag_counters;
 	struct iface_stat *iface_entry;
 	struct tag_stat *new_tag_stat = NULL;
 	MT_DEBUG("qtaguid: if_tag_stat_update(ifname=%s "
 		"uid=%u sk=%p dir=%d proto=%d bytes=%d)\n",
 		 ifname, uid, sk, direction, proto, bytes);
 
-
+	rcu_read_lock();
 	iface_entry = get_iface_entry(ifname);
 	if (!iface_entry) {
 		pr_err_ratelimited("qtaguid: tag_stat: stat_update() "
 				   "%s not found\n", ifname);
-		return;
+		goto unlock;
 	}
 	/* It is ok to process data when an iface_entry is inactive */
 
@@ -1440,9 +1512,7 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	 * Look for a tagged sock.
 	 * It will have an acct_uid.
 	 */
-	sock_tag_entry = get_sock_stat(sk);
-	if (sock_tag_entry) {
-		tag = sock_tag_entry->tag;
+	if (get_sock_tag(sk, &tag)) {
 		acct_tag = get_atag_from_tag(tag);
 		uid_tag = get_utag_from_tag(tag);
 	} else {
@@ -1453,40 +1523,51 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 	MT_DEBUG("qtaguid: tag_stat: stat_update(): "
 		 " looking for tag=0x%llx (uid=%u) in ife=%p\n",
 		 tag, get_uid_from_tag(tag), iface_entry);
-	/* Loop over tag list under this interface for {acct_tag,uid_tag} */
-	spin_lock_bh(&iface_entry->tag_stat_list_lock);
 
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      tag);
+	tag_stat_entry = tag_stat_hash_search(iface_entry, tag);
 	if (tag_stat_entry) {
 		/*
 		 * Updating the {acct_tag, uid_tag} entry handles both stats:
 		 * {0, uid_tag} will also get updated.
 		 */
 		tag_stat_update(tag_stat_entry, direction, proto, bytes);
-		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
-		return;
+		goto unlock;
 	}
 
-	/* Loop over tag list under this interface for {0,uid_tag} */
-	tag_stat_entry = tag_stat_tree_search(&iface_entry->tag_stat_tree,
-					      uid_tag);
+	/*
+	 * First packet for this tag on this interface. Creating entries
+	 * needs the lock, and someone may have beaten us to it.
+	 */
+	spin_lock_bh(&iface_entry->tag_stat_list_lock);
+
+	tag_stat_entry = tag_stat_hash_search(iface_entry, tag);
+	if (tag_stat_entry) {
+		tag_stat_update(tag_stat_entry, direction, proto, bytes);
+		goto unlock_tag_stat;
+	}
+
+	/* Look for {0,uid_tag} under this interface */
+	tag_stat_entry = tag_stat_hash_search(iface_entry, uid_tag);
 	if (!tag_stat_entry) {
 		/* Here: the base uid_tag did not exist */
 		/*
 		 * No parent counters. So
 		 *  - No {0, uid_tag} stats and no {acc_tag, uid_tag} stats.
 		 */
-		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag);
-		uid_tag_counters = &new_tag_stat->counters;
+		new_tag_stat = create_if_tag_stat(iface_entry, uid_tag, NULL);
+		if (!new_tag_stat)
+			goto unlock_tag_stat;
+		uid_tag_counters = new_tag_stat->counters;
 	} else {
-		uid_tag_counters = &tag_stat_entry->counters;
+		uid_tag_counters = tag_stat_entry->counters;
 	}
 
 	if (acct_tag) {
 		/* Create the child {acct_tag, uid_tag} and hook up parent. */
-		new_tag_stat = create_if_tag_stat(iface_entry, tag);
-		new_tag_stat->parent_counters = uid_tag_counters;
+		new_tag_stat = create_if_tag_stat(iface_entry, tag,
+						  uid_tag_counters);
+		if (!new_tag_stat)
+			goto unlock_tag_stat;
 	} else {
 		/*
 		 * For new_tag_stat to be still NULL here would require:
@@ -1499,7 +1580,10 @@ static void if_tag_stat_update(const char *ifname, uid_t uid,
 		BUG_ON(!new_tag_stat);
 	}
 	tag_stat_update(new_tag_stat, direction, proto, bytes);
+unlock_tag_stat:
 	spin_unlock_bh(&iface_entry->tag_stat_list_lock);
+unlock:
+	rcu_read_unlock();
 }
 
 static int iface_netdev_event_handler(struct notifier_block *nb,
@@ -1898,7 +1982,8 @@ static void prdebug_full_state(int indent_level, const char *fmt, ...)
 	va_end(args);
 
 	spin_lock_bh(&sock_tag_list_lock);
-	prdebug_sock_tag_tree(indent_level, &sock_tag_tree);
+	prdebug_sock_tag_hash(indent_level, sock_tag_hash,
+			      ARRAY_SIZE(sock_tag_hash));
 	spin_unlock_bh(&sock_tag_list_lock);
 
 	spin_lock_bh(&sock_tag_list_lock);
@@ -1929,11 +2014,12 @@ static int qtaguid_ctrl_proc_read(char *page, char **num_items_returned,
 	char *outp = page;
 	int len;
 	uid_t uid;
-	struct rb_node *node;
+	struct hlist_node *pos;
 	struct sock_tag *sock_tag_entry;
 	int item_index = 0;
 	int indent_level = 0;
 	long f_count;
+	int i;
 
 	if (unlikely(module_passive)) {
 		*eof = 1;
@@ -1949,12 +2035,10 @@ static int qtaguid_ctrl_proc_read(char *page, char **num_items_returned,
 		 page, items_to_skip, char_count, *eof);
 
 	spin_lock_bh(&sock_tag_list_lock);
-	for (node = rb_first(&sock_tag_tree);
-	     node;
-	     node = rb_next(node)) {
+	qtu_hash_for_each_entry(sock_tag_entry, pos, sock_tag_hash, i,
+				sock_node) {
 		if (item_index++ < items_to_skip)
 			continue;
-		sock_tag_entry = rb_entry(node, struct sock_tag, sock_node);
 		uid = get_uid_from_tag(sock_tag_entry->tag);
 		CT_DEBUG("qtaguid: proc_read(): sk=%p tag=0x%llx (uid=%u) "
 			 "pid=%u\n",
@@ -2041,12 +2125,14 @@ static int ctrl_cmd_delete(const char *input)
 	int res, argc;
 	struct iface_stat *iface_entry;
 	struct rb_node *node;
+	struct hlist_node *pos, *next;
 	struct sock_tag *st_entry;
-	struct rb_root st_to_free_tree = RB_ROOT;
+	LIST_HEAD(st_to_free_list);
 	struct tag_stat *ts_entry;
 	struct tag_counter_set *tcs_entry;
 	struct tag_ref *tr_entry;
 	struct uid_tag_data *utd_entry;
+	int i;
 
 	argc = sscanf(input, "%c %llu %u", &cmd, &acct_tag, &uid);
 	CT_DEBUG("qtaguid: ctrl_delete(%s): argc=%d cmd=%c "
@@ -2078,11 +2164,9 @@ static int ctrl_cmd_delete(const char *input)
 
 	/* Delete socket tags */
 	spin_lock_bh(&sock_tag_list_lock);
-	node = rb_first(&sock_tag_tree);
-	while (node) {
-		st_entry = rb_entry(node, struct sock_tag, sock_node);
+	qtu_hash_for_each_entry_safe(st_entry, pos, next, sock_tag_hash, i,
+				     sock_node) {
 		entry_uid = get_uid_from_tag(st_entry->tag);
-		node = rb_next(node);
 		if (entry_uid != uid)
 			continue;
 
@@ -2090,9 +2174,7 @@ static int ctrl_cmd_delete(const char *input)
 			 input, st_entry->tag, entry_uid);
 
 		if (!acct_tag || st_entry->tag == tag) {
-			rb_erase(&st_entry->sock_node, &sock_tag_tree);
-			/* Can't sockfd_put() within spinlock, do it later. */
-			sock_tag_tree_insert(st_entry, &st_to_free_tree);
+			hlist_del_rcu(&st_entry->sock_node);
 			tr_entry = lookup_tag_ref(st_entry->tag, NULL);
 			BUG_ON(tr_entry->num_sock_tags <= 0);
 			tr_entry->num_sock_tags--;
@@ -2105,16 +2187,18 @@ static int ctrl_cmd_delete(const char *input)
 			 */
 			if (st_entry->list.next && st_entry->list.prev)
 				list_del(&st_entry->list);
+			/* Can't sockfd_put() within spinlock, do it later. */
+			list_add(&st_entry->list, &st_to_free_list);
 		}
 	}
 	spin_unlock_bh(&sock_tag_list_lock);
 
-	sock_tag_tree_erase(&st_to_free_tree);
+	sock_tag_list_erase(&st_to_free_list);
 
 	/* Delete tag counter-sets */
 	spin_lock_bh(&tag_counter_set_list_lock);
 	/* Counter sets are only on the uid tag, not full tag */
-	tcs_entry = tag_counter_set_tree_search(&tag_counter_set_tree, tag);
+	tcs_entry = tag_counter_set_hash_search(tag);
 	if (tcs_entry) {
 		CT_DEBUG("qtaguid: ctrl_delete(%s): "
 			 "erase tcs: tag=0x%llx (uid=%u) set=%d\n",
@@ -2122,8 +2206,8 @@ static int ctrl_cmd_delete(const char *input)
 			 tcs_entry->tn.tag,
 			 get_uid_from_tag(tcs_entry->tn.tag),
 			 tcs_entry->active_set);
-		rb_erase(&tcs_entry->tn.node, &tag_counter_set_tree);
-		kfree(tcs_entry);
+		hlist_del_rcu(&tcs_entry->tn.node);
+		kfree_rcu(tcs_entry, tn.rcu);
 	}
 	spin_unlock_bh(&tag_counter_set_list_lock);
 
@@ -2134,11 +2218,10 @@ static int ctrl_cmd_delete(const char *input)
 	spin_lock_bh(&iface_stat_list_lock);
 	list_for_each_entry(iface_entry, &iface_stat_list, list) {
 		spin_lock_bh(&iface_entry->tag_stat_list_lock);
-		node = rb_first(&iface_entry->tag_stat_tree);
-		while (node) {
-			ts_entry = rb_entry(node, struct tag_stat, tn.node);
+		qtu_hash_for_each_entry_safe(ts_entry, pos, next,
+					     iface_entry->tag_stat_hash, i,
+					     tn.node) {
 			entry_uid = get_uid_from_tag(ts_entry->tn.tag);
-			node = rb_next(node);
 
 			CT_DEBUG("qtaguid: ctrl_delete(%s): "
 				 "ts tag=0x%llx (uid=%u)\n",
@@ -2152,9 +2235,13 @@ static int ctrl_cmd_delete(const char *input)
 					 input, iface_entry->ifname,
 					 get_atag_from_tag(ts_entry->tn.tag),
 					 entry_uid);
-				rb_erase(&ts_entry->tn.node,
-					 &iface_entry->tag_stat_tree);
-				kfree(ts_entry);
+				/*
+				 * A {0, uid_tag} parent only goes along with
+				 * all its children, and both wait out the
+				 * same grace period.
+				 */
+				hlist_del_rcu(&ts_entry->tn.node);
+				call_rcu(&ts_entry->tn.rcu, tag_stat_free_rcu);
 			}
 		}
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
@@ -2224,7 +2311,7 @@ static int ctrl_cmd_counter_set(const char *input)
 
 	tag = make_tag_from_uid(uid);
 	spin_lock_bh(&tag_counter_set_list_lock);
-	tcs = tag_counter_set_tree_search(&tag_counter_set_tree, tag);
+	tcs = tag_counter_set_hash_search(tag);
 	if (!tcs) {
 		tcs = kzalloc(sizeof(*tcs), GFP_ATOMIC);
 		if (!tcs) {
@@ -2236,12 +2323,12 @@ static int ctrl_cmd_counter_set(const char *input)
 			goto err;
 		}
 		tcs->tn.tag = tag;
-		tag_counter_set_tree_insert(tcs, &tag_counter_set_tree);
+		tag_counter_set_hash_insert(tcs);
 		CT_DEBUG("qtaguid: ctrl_counterset(%s): added tcs tag=0x%llx "
 			 "(uid=%u) set=%d\n",
 			 input, tag, get_uid_from_tag(tag), counter_set);
 	}
-	tcs->active_set = counter_set;
+	ACCESS_ONCE(tcs->active_set) = counter_set;
 	spin_unlock_bh(&tag_counter_set_list_lock);
 	atomic64_inc(&qtu_events.counter_set_changes);
 	res = 0;
@@ -2320,11 +2407,28 @@ static int ctrl_cmd_tag(const char *input)
 	tag_ref_entry->num_sock_tags++;
 	if (sock_tag_entry) {
 		struct tag_ref *prev_tag_ref_entry;
+		struct sock_tag *new_sock_tag_entry;
 
 		CT_DEBUG("qtaguid: ctrl_tag(%s): retag for sk=%p "
 			 "st@%p ...->f_count=%ld\n",
 			 input, el_socket->sk, sock_tag_entry,
 			 atomic_long_read(&el_socket->file->f_count));
+		/*
+		 * The packet path reads the tag without the lock, and a
+		 * 32bit cpu could see a half written tag_t. So swap in a
+		 * new entry instead of updating this one.
+		 */
+		new_sock_tag_entry = kmemdup(sock_tag_entry,
+					     sizeof(*sock_tag_entry),
+					     GFP_ATOMIC);
+		if (!new_sock_tag_entry) {
+			pr_err("qtaguid: ctrl_tag(%s): "
+			       "socket tag alloc failed\n",
+			       input);
+			spin_unlock_bh(&sock_tag_list_lock);
+			res = -ENOMEM;
+			goto err_tag_unref_put;
+		}
 		/*
 		 * This is a re-tagging, so release the sock_fd that was
 		 * locked at the time of the 1st tagging.
@@ -2337,7 +2441,15 @@ static int ctrl_cmd_tag(const char *input)
 		BUG_ON(IS_ERR_OR_NULL(prev_tag_ref_entry));
 		BUG_ON(prev_tag_ref_entry->num_sock_tags <= 0);
 		prev_tag_ref_entry->num_sock_tags--;
-		sock_tag_entry->tag = full_tag;
+		new_sock_tag_entry->tag = full_tag;
+		hlist_replace_rcu(&sock_tag_entry->sock_node,
+				  &new_sock_tag_entry->sock_node);
+		/* Same hack as in ctrl_cmd_delete() */
+		if (sock_tag_entry->list.next && sock_tag_entry->list.prev)
+			list_replace(&sock_tag_entry->list,
+				     &new_sock_tag_entry->list);
+		kfree_rcu(sock_tag_entry, rcu);
+		sock_tag_entry = new_sock_tag_entry;
 	} else {
 		CT_DEBUG("qtaguid: ctrl_tag(%s): newtag for sk=%p\n",
 			 input, el_socket->sk);
@@ -2376,7 +2488,7 @@ static int ctrl_cmd_tag(const char *input)
 				 &pqd_entry->sock_tag_list);
 		spin_unlock_bh(&uid_tag_data_tree_lock);
 
-		sock_tag_tree_insert(sock_tag_entry, &sock_tag_tree);
+		sock_tag_hash_insert(sock_tag_entry);
 		atomic64_inc(&qtu_events.sockets_tagged);
 	}
 	spin_unlock_bh(&sock_tag_list_lock);
@@ -2442,7 +2554,7 @@ static int ctrl_cmd_untag(const char *input)
 	 * The socket already belongs to the current process
 	 * so it can do whatever it wants to it.
 	 */
-	rb_erase(&sock_tag_entry->sock_node, &sock_tag_tree);
+	hlist_del_rcu(&sock_tag_entry->sock_node);
 
 	tag_ref_entry = lookup_tag_ref(sock_tag_entry->tag, &utd_entry);
 	BUG_ON(!tag_ref_entry);
@@ -2479,7 +2591,7 @@ static int ctrl_cmd_untag(const char *input)
 		 atomic_long_read(&el_socket->file->f_count) - 1);
 	sockfd_put(el_socket);
 
-	kfree(sock_tag_entry);
+	kfree_rcu(sock_tag_entry, rcu);
 	atomic64_inc(&qtu_events.sockets_untagged);
 
 	return 0;
@@ -2566,7 +2678,7 @@ struct proc_print_info {
 static int pp_stats_line(struct proc_print_info *ppi, int cnt_set)
 {
 	int len;
-	struct data_counters *cnts;
+	struct data_counters counters, *cnts = &counters;
 
 	if (!ppi->item_index) {
 		if (ppi->item_index++ < ppi->items_to_skip)
@@ -2597,7 +2709,8 @@ static int pp_stats_line(struct proc_print_info *ppi, int cnt_set)
 		}
 		if (ppi->item_index++ < ppi->items_to_skip)
 			return 0;
-		cnts = &ppi->ts_entry->counters;
+		/* The per-cpu counters only get folded together here */
+		dc_fold(cnts, ppi->ts_entry->counters);
 		len = snprintf(
 			ppi->outp, ppi->char_count,
 			"%d %s 0x%llx %u %u "
@@ -2706,12 +2819,12 @@ static int qtaguid_stats_proc_read(char *page, char **num_items_returned,
 
 	spin_lock_bh(&iface_stat_list_lock);
 	list_for_each_entry(ppi.iface_entry, &iface_stat_list, list) {
-		struct rb_node *node;
+		struct hlist_node *pos;
+		int i;
 		spin_lock_bh(&ppi.iface_entry->tag_stat_list_lock);
-		for (node = rb_first(&ppi.iface_entry->tag_stat_tree);
-		     node;
-		     node = rb_next(node)) {
-			ppi.ts_entry = rb_entry(node, struct tag_stat, tn.node);
+		qtu_hash_for_each_entry(ppi.ts_entry, pos,
+					ppi.iface_entry->tag_stat_hash, i,
+					tn.node) {
 			if (!pp_sets(&ppi)) {
 				spin_unlock_bh(
 					&ppi.iface_entry->tag_stat_list_lock);
@@ -2800,7 +2913,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 	struct proc_qtu_data  *pqd_entry = file->private_data;
 	struct uid_tag_data  *utd_entry = pqd_entry->parent_tag_data;
 	struct sock_tag *st_entry;
-	struct rb_root st_to_free_tree = RB_ROOT;
+	LIST_HEAD(st_to_free_list);
 	struct list_head *entry, *next;
 	struct tag_ref *tr;
 
@@ -2844,10 +2957,9 @@ static int qtudev_release(struct inode *inode, struct file *file)
 		tr->num_sock_tags--;
 		free_tag_ref_from_utd_entry(tr, utd_entry);
 
-		rb_erase(&st_entry->sock_node, &sock_tag_tree);
-		list_del(&st_entry->list);
+		hlist_del_rcu(&st_entry->sock_node);
 		/* Can't sockfd_put() within spinlock, do it later. */
-		sock_tag_tree_insert(st_entry, &st_to_free_tree);
+		list_move(&st_entry->list, &st_to_free_list);
 
 		/*
 		 * Try to free the utd_entry if no other proc_qtu_data is
@@ -2868,7 +2980,7 @@ static int qtudev_release(struct inode *inode, struct file *file)
 	spin_unlock_bh(&sock_tag_list_lock);
 
 
-	sock_tag_tree_erase(&st_to_free_tree);
+	sock_tag_list_erase(&st_to_free_list);
 
 	prdebug_full_state(0, "%s(): pid=%u tgid=%u", __func__,
 			   current->pid, current->tgid);
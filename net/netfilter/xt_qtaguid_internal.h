@@ -11,8 +11,13 @@
 #define __XT_QTAGUID_INTERNAL_H__
 
 #include <linux/types.h>
+#include <linux/cpumask.h>
 #include <linux/rbtree.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
 #include <linux/spinlock_types.h>
+#include <linux/string.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/workqueue.h>
 
 /* Iface handling */
@@ -197,6 +202,52 @@ static inline uint64_t dc_sum_packets(struct data_counters *counters,
 		+ counters->bpc[set][direction][IFS_PROTO_OTHER].packets;
 }
 
+/*
+ * The packet path updates counters without taking any lock: each cpu bumps
+ * its own copy, and readers fold the copies together with dc_fold().
+ * There is no atomic percpu allocator, and tag stats get created from the
+ * packet path, so a set of counters is a plain array of nr_cpu_ids of these.
+ */
+struct data_counters_cpu {
+	struct data_counters dc;
+	/* Lets 32bit readers get untorn 64bit counters */
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
+static inline struct data_counters_cpu *data_counters_alloc(gfp_t gfp)
+{
+	return kcalloc(nr_cpu_ids, sizeof(struct data_counters_cpu), gfp);
+}
+
+/* Sum up the per-cpu copies in dcc into res. */
+static inline void dc_fold(struct data_counters *res,
+			   struct data_counters_cpu *dcc)
+{
+	int cpu, set, dir, proto;
+
+	memset(res, 0, sizeof(*res));
+	for_each_possible_cpu(cpu) {
+		struct data_counters_cpu *c = &dcc[cpu];
+		struct data_counters snap;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin(&c->syncp);
+			snap = c->dc;
+		} while (u64_stats_fetch_retry(&c->syncp, start));
+
+		for (set = 0; set < IFS_MAX_COUNTER_SETS; set++)
+			for (dir = 0; dir < IFS_MAX_DIRECTIONS; dir++)
+				for (proto = 0; proto < IFS_MAX_PROTOS;
+				     proto++) {
+					res->bpc[set][dir][proto].bytes +=
+						snap.bpc[set][dir][proto].bytes;
+					res->bpc[set][dir][proto].packets +=
+					      snap.bpc[set][dir][proto].packets;
+				}
+	}
+}
+
 
 /* Generic X based nodes used as a base for rb_tree ops */
 struct tag_node {
@@ -204,25 +255,51 @@ struct tag_node {
 	tag_t tag;
 };
 
+/*
+ * Generic X based nodes used as a base for the hash tables that the packet
+ * path searches under rcu_read_lock().
+ */
+struct tag_hnode {
+	struct hlist_node node;
+	tag_t tag;
+	struct rcu_head rcu;
+};
+
+/*
+ * Walk all the entries of a fixed size array of hlist_heads.
+ * A "continue" moves on to the next entry, a "break" only to the next bucket.
+ */
+#define qtu_hash_for_each_entry(tpos, pos, table, bkt, member)		\
+	for ((bkt) = 0; (bkt) < ARRAY_SIZE(table); (bkt)++)		\
+		hlist_for_each_entry(tpos, pos, &(table)[bkt], member)
+
+#define qtu_hash_for_each_entry_safe(tpos, pos, n, table, bkt, member)	\
+	for ((bkt) = 0; (bkt) < ARRAY_SIZE(table); (bkt)++)		\
+		hlist_for_each_entry_safe(tpos, pos, n, &(table)[bkt],	\
+					  member)
+
+/* Buckets in each iface's tag_stat_hash */
+#define TAG_STAT_HASH_BITS 6
+
 struct tag_stat {
-	struct tag_node tn;
-	struct data_counters counters;
+	struct tag_hnode tn;
+	struct data_counters_cpu *counters;
 	/*
 	 * If this tag is acct_tag based, we need to count against the
 	 * matching parent uid_tag.
 	 */
-	struct data_counters *parent_counters;
+	struct data_counters_cpu *parent_counters;
 };
 
 struct iface_stat {
-	struct list_head list;  /* in iface_stat_list */
+	struct list_head list;  /* in iface_stat_list, rcu protected */
 	char *ifname;
 	bool active;
 	/* net_dev is only valid for active iface_stat */
 	struct net_device *net_dev;
 
 	struct byte_packet_counters totals_via_dev[IFS_MAX_DIRECTIONS];
-	struct data_counters totals_via_skb;
+	struct data_counters_cpu *totals_via_skb;
 	/*
 	 * We keep the last_known, because some devices reset their counters
 	 * just before NETDEV_UP, while some will reset just before
@@ -237,7 +314,8 @@ struct iface_stat {
 
 	struct proc_dir_entry *proc_ptr;
 
-	struct rb_root tag_stat_tree;
+	/* Readers use rcu, writers also hold tag_stat_list_lock */
+	struct hlist_head tag_stat_hash[1 << TAG_STAT_HASH_BITS];
 	spinlock_t tag_stat_list_lock;
 };
 
@@ -254,7 +332,7 @@ struct iface_stat_work {
  * These structs need to be looked up by sock and pid.
  */
 struct sock_tag {
-	struct rb_node sock_node;
+	struct hlist_node sock_node;  /* in sock_tag_hash */
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;
@@ -262,7 +340,12 @@ struct sock_tag {
 	struct list_head list;   /* in proc_qtu_data.sock_tag_list */
 	pid_t pid;
 
+	/*
+	 * Never changed once the sock_tag is visible, a retag replaces the
+	 * whole entry.
+	 */
 	tag_t tag;
+	struct rcu_head rcu;
 };
 
 struct qtaguid_event_counts {
@@ -299,7 +382,7 @@ struct qtaguid_event_counts {
 
 /* Track the set active_set for the given tag. */
 struct tag_counter_set {
-	struct tag_node tn;
+	struct tag_hnode tn;
 	int active_set;
 };
 
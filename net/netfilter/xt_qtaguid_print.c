@@ -152,8 +152,8 @@ char *pp_tag_ref(struct tag_ref *tr)
 char *pp_tag_stat(struct tag_stat *ts)
 {
 	char *tn_str;
+	struct data_counters counters;
 	char *counters_str;
-	char *parent_counters_str;
 	char *res;
 
 	if (!ts) {
@@ -161,16 +161,17 @@ char *pp_tag_stat(struct tag_stat *ts)
 		_bug_on_err_or_null(res);
 		return res;
 	}
-	tn_str = pp_tag_node(&ts->tn);
-	counters_str = pp_data_counters(&ts->counters, true);
-	parent_counters_str = pp_data_counters(ts->parent_counters, false);
+	tn_str = pp_tag_t(&ts->tn.tag);
+	dc_fold(&counters, ts->counters);
+	counters_str = pp_data_counters(&counters, true);
 	res = kasprintf(GFP_ATOMIC,
-			"tag_stat@%p{%s, counters=%s, parent_counters=%s}",
-			ts, tn_str, counters_str, parent_counters_str);
+			"tag_stat@%p{tag_hnode@%p{tag=%s}, counters=%s, "
+			"parent_counters=%p}",
+			ts, &ts->tn, tn_str, counters_str,
+			ts->parent_counters);
 	_bug_on_err_or_null(res);
 	kfree(tn_str);
 	kfree(counters_str);
-	kfree(parent_counters_str);
 	return res;
 }
 
@@ -180,7 +181,8 @@ char *pp_iface_stat(struct iface_stat *is)
 	if (!is) {
 		res = kasprintf(GFP_ATOMIC, "iface_stat@null{}");
 	} else {
-		struct data_counters *cnts = &is->totals_via_skb;
+		struct data_counters counters, *cnts = &counters;
+		dc_fold(cnts, is->totals_via_skb);
 		res = kasprintf(GFP_ATOMIC, "iface_stat@%p{"
 				"list=list_head{...}, "
 				"ifname=%s, "
@@ -200,7 +202,7 @@ char *pp_iface_stat(struct iface_stat *is)
 				"active=%d, "
 				"net_dev=%p, "
 				"proc_ptr=%p, "
-				"tag_stat_tree=rb_root{...}}",
+				"tag_stat_hash=hlist_head[]{...}}",
 				is,
 				is->ifname,
 				is->totals_via_dev[IFS_RX].bytes,
@@ -236,7 +238,7 @@ char *pp_sock_tag(struct sock_tag *st)
 	}
 	tag_str = pp_tag_t(&st->tag);
 	res = kasprintf(GFP_ATOMIC, "sock_tag@%p{"
-			"sock_node=rb_node{...}, "
+			"sock_node=hlist_node{...}, "
 			"sk=%p socket=%p (f_count=%lu), list=list_head{...}, "
 			"pid=%u, tag=%s}",
 			st, st->sk, st->socket, atomic_long_read(
@@ -288,32 +290,44 @@ char *pp_proc_qtu_data(struct proc_qtu_data *pqd)
 }
 
 /*------------------------------------------*/
-void prdebug_sock_tag_tree(int indent_level,
-			   struct rb_root *sock_tag_tree)
+static bool hash_empty(struct hlist_head *hash, int size)
 {
-	struct rb_node *node;
+	int i;
+
+	for (i = 0; i < size; i++)
+		if (!hlist_empty(&hash[i]))
+			return false;
+	return true;
+}
+
+void prdebug_sock_tag_hash(int indent_level,
+			   struct hlist_head *sock_tag_hash, int size)
+{
+	struct hlist_node *pos;
 	struct sock_tag *sock_tag_entry;
 	char *str;
+	int i;
 
 	if (!unlikely(qtaguid_debug_mask & DDEBUG_MASK))
 		return;
 
-	if (RB_EMPTY_ROOT(sock_tag_tree)) {
-		str = "sock_tag_tree=rb_root{}";
+	if (hash_empty(sock_tag_hash, size)) {
+		str = "sock_tag_hash=hlist_head[]{}";
 		pr_debug("%*d: %s\n", indent_level*2, indent_level, str);
 		return;
 	}
 
-	str = "sock_tag_tree=rb_root{";
+	str = "sock_tag_hash=hlist_head[]{";
 	pr_debug("%*d: %s\n", indent_level*2, indent_level, str);
 	indent_level++;
-	for (node = rb_first(sock_tag_tree);
-	     node;
-	     node = rb_next(node)) {
-		sock_tag_entry = rb_entry(node, struct sock_tag, sock_node);
-		str = pp_sock_tag(sock_tag_entry);
-		pr_debug("%*d: %s,\n", indent_level*2, indent_level, str);
-		kfree(str);
+	for (i = 0; i < size; i++) {
+		hlist_for_each_entry(sock_tag_entry, pos, &sock_tag_hash[i],
+				     sock_node) {
+			str = pp_sock_tag(sock_tag_entry);
+			pr_debug("%*d: %s,\n", indent_level*2, indent_level,
+				 str);
+			kfree(str);
+		}
 	}
 	indent_level--;
 	str = "}";
@@ -461,33 +475,34 @@ void prdebug_uid_tag_data_tree(int indent_level,
 	pr_debug("%*d: %s\n", indent_level*2, indent_level, str);
 }
 
-void prdebug_tag_stat_tree(int indent_level,
-				  struct rb_root *tag_stat_tree)
+void prdebug_tag_stat_hash(int indent_level,
+			   struct hlist_head *tag_stat_hash, int size)
 {
 	char *str;
-	struct rb_node *node;
+	struct hlist_node *pos;
 	struct tag_stat *ts_entry;
+	int i;
 
 	if (!unlikely(qtaguid_debug_mask & DDEBUG_MASK))
 		return;
 
-	if (RB_EMPTY_ROOT(tag_stat_tree)) {
-		str = "tag_stat_tree{}";
+	if (hash_empty(tag_stat_hash, size)) {
+		str = "tag_stat_hash{}";
 		pr_debug("%*d: %s\n", indent_level*2, indent_level, str);
 		return;
 	}
 
-	str = "tag_stat_tree{";
+	str = "tag_stat_hash{";
 	pr_debug("%*d: %s\n", indent_level*2, indent_level, str);
 	indent_level++;
-	for (node = rb_first(tag_stat_tree);
-	     node;
-	     node = rb_next(node)) {
-		ts_entry = rb_entry(node, struct tag_stat, tn.node);
-		str = pp_tag_stat(ts_entry);
-		pr_debug("%*d: %s\n", indent_level*2, indent_level,
-			 str);
-		kfree(str);
+	for (i = 0; i < size; i++) {
+		hlist_for_each_entry(ts_entry, pos, &tag_stat_hash[i],
+				     tn.node) {
+			str = pp_tag_stat(ts_entry);
+			pr_debug("%*d: %s\n", indent_level*2, indent_level,
+				 str);
+			kfree(str);
+		}
 	}
 	indent_level--;
 	str = "}";
@@ -518,10 +533,12 @@ void prdebug_iface_stat_list(int indent_level,
 		kfree(str);
 
 		spin_lock_bh(&iface_entry->tag_stat_list_lock);
-		if (!RB_EMPTY_ROOT(&iface_entry->tag_stat_tree)) {
+		if (!hash_empty(iface_entry->tag_stat_hash,
+				ARRAY_SIZE(iface_entry->tag_stat_hash))) {
 			indent_level++;
-			prdebug_tag_stat_tree(indent_level,
-					      &iface_entry->tag_stat_tree);
+			prdebug_tag_stat_hash(indent_level,
+				iface_entry->tag_stat_hash,
+				ARRAY_SIZE(iface_entry->tag_stat_hash));
 			indent_level--;
 		}
 		spin_unlock_bh(&iface_entry->tag_stat_list_lock);
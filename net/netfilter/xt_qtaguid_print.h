@@ -27,15 +27,15 @@ char *pp_proc_qtu_data(struct proc_qtu_data *pqd);
 /*------------------------------------------*/
 void prdebug_sock_tag_list(int indent_level,
 			   struct list_head *sock_tag_list);
-void prdebug_sock_tag_tree(int indent_level,
-			   struct rb_root *sock_tag_tree);
+void prdebug_sock_tag_hash(int indent_level,
+			   struct hlist_head *sock_tag_hash, int size);
 void prdebug_proc_qtu_data_tree(int indent_level,
 				struct rb_root *proc_qtu_data_tree);
 void prdebug_tag_ref_tree(int indent_level, struct rb_root *tag_ref_tree);
 void prdebug_uid_tag_data_tree(int indent_level,
 			       struct rb_root *uid_tag_data_tree);
-void prdebug_tag_stat_tree(int indent_level,
-			   struct rb_root *tag_stat_tree);
+void prdebug_tag_stat_hash(int indent_level,
+			   struct hlist_head *tag_stat_hash, int size);
 void prdebug_iface_stat_list(int indent_level,
 			     struct list_head *iface_stat_list);
 
@@ -86,8 +86,8 @@ void prdebug_sock_tag_list(int indent_level,
 {
 }
 static inline
-void prdebug_sock_tag_tree(int indent_level,
-			   struct rb_root *sock_tag_tree)
+void prdebug_sock_tag_hash(int indent_level,
+			   struct hlist_head *sock_tag_hash, int size)
 {
 }
 static inline
@@ -105,8 +105,8 @@ void prdebug_uid_tag_data_tree(int indent_level,
 {
 }
 static inline
-void prdebug_tag_stat_tree(int indent_level,
-			   struct rb_root *tag_stat_tree)
+void prdebug_tag_stat_hash(int indent_level,
+			   struct hlist_head *tag_stat_hash, int size)
 {
 }
 static inline
@@ -0,0 +1,447 @@
+/*
+ * binder_bench: multi-process binder ping-pong.
+ *
+ * The parent becomes the context manager and forks N independent
+ * client/server pairs. Each server publishes a node through the
+ * context manager, its client looks it up and then runs synchronous
+ * empty transactions against it as fast as it can. No two pairs share
+ * a process, so with per-process locking in the driver the aggregate
+ * rate should grow with the number of pairs up to the number of CPUs.
+ *
+ * With "rt" the clients run SCHED_FIFO, like an audio thread, and the
+ * servers publish their node with FLAT_BINDER_FLAG_INHERIT_RT. Every
+ * call must then be served at SCHED_FIFO, and the server must be back
+ * to its own policy once it has replied.
+ *
+ * usage: binder_bench <pairs> <round trips/pair> [rt]
+ *
+ * Must run as the only binder context manager (i.e. not on a running
+ * Android system).
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define RT_PRIO		2
+
+static int rt;
+
+enum {
+	CODE_REGISTER = 1,
+	CODE_LOOKUP,
+	CODE_PING,
+	CODE_QUIT,
+};
+
+struct result {
+	long round_trips;
+	double secs;
+	double worst_us;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int binder_open(void)
+{
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0)
+		die("/dev/binder");
+	if (mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+		die("mmap");
+	return fd;
+}
+
+/* Append a command and its payload to a write buffer */
+static void put_cmd(char *buf, size_t *len, uint32_t cmd,
+		    const void *arg, size_t size)
+{
+	memcpy(buf + *len, &cmd, sizeof(cmd));
+	*len += sizeof(cmd);
+	if (size)
+		memcpy(buf + *len, arg, size);
+	*len += size;
+}
+
+static void put_txn(char *buf, size_t *len, uint32_t cmd, uint32_t handle,
+		    uint32_t code, const void *data, size_t data_size,
+		    const size_t *offsets, size_t offsets_size)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = data_size;
+	tr.offsets_size = offsets_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offsets;
+	put_cmd(buf, len, cmd, &tr, sizeof(tr));
+}
+
+static void put_free(char *buf, size_t *len, const void *data)
+{
+	put_cmd(buf, len, BC_FREE_BUFFER, &data, sizeof(data));
+}
+
+static void flush_cmds(int fd, const char *wbuf, size_t wlen)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wlen;
+	if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0)
+		die("BINDER_WRITE_READ");
+}
+
+/*
+ * Issue the pending writes in wbuf, then read until a BR_TRANSACTION
+ * or BR_REPLY arrives. Reference count requests on our own node are
+ * acknowledged on the way. Returns the command received, or 0 if
+ * the transaction failed.
+ */
+static uint32_t transact(int fd, const char *wbuf, size_t wlen,
+			 struct binder_transaction_data *tr)
+{
+	uint32_t rbuf[64];
+	struct binder_write_read bwr;
+
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wlen;
+	bwr.write_consumed = 0;
+	for (;;) {
+		char *p = (char *)rbuf, *end;
+
+		bwr.read_buffer = (unsigned long)rbuf;
+		bwr.read_size = sizeof(rbuf);
+		bwr.read_consumed = 0;
+		if (ioctl(fd, BINDER_WRITE_READ, &bwr) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("BINDER_WRITE_READ");
+		}
+		bwr.write_size = 0;
+
+		end = p + bwr.read_consumed;
+		while (p < end) {
+			uint32_t cmd;
+			struct binder_ptr_cookie pc;
+			char ack[64];
+			size_t alen = 0;
+
+			memcpy(&cmd, p, sizeof(cmd));
+			p += sizeof(cmd);
+			switch (cmd) {
+			case BR_NOOP:
+			case BR_TRANSACTION_COMPLETE:
+			case BR_SPAWN_LOOPER:
+				break;
+			case BR_INCREFS:
+			case BR_ACQUIRE:
+				memcpy(&pc, p, sizeof(pc));
+				p += sizeof(pc);
+				put_cmd(ack, &alen, cmd == BR_INCREFS ?
+					BC_INCREFS_DONE : BC_ACQUIRE_DONE,
+					&pc, sizeof(pc));
+				flush_cmds(fd, ack, alen);
+				break;
+			case BR_RELEASE:
+			case BR_DECREFS:
+				p += sizeof(pc);
+				break;
+			case BR_TRANSACTION:
+			case BR_REPLY:
+				memcpy(tr, p, sizeof(*tr));
+				return cmd;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				return 0;
+			default:
+				fprintf(stderr, "unexpected command 0x%x\n", cmd);
+				exit(1);
+			}
+		}
+	}
+}
+
+static void run_manager(int fd, int pairs)
+{
+	static uint32_t handles[4096];
+	static struct flat_binder_object obj;
+	static size_t offset;
+	struct binder_transaction_data tr;
+	char wbuf[256];
+	size_t wlen = 0;
+	int found = 0;
+
+	while (found < pairs) {
+		const uint32_t *arg;
+
+		if (transact(fd, wbuf, wlen, &tr) != BR_TRANSACTION) {
+			fprintf(stderr, "manager: bad transaction\n");
+			exit(1);
+		}
+		wlen = 0;
+		arg = tr.data.ptr.buffer;
+		switch (tr.code) {
+		case CODE_REGISTER: {
+			const struct flat_binder_object *fp = tr.data.ptr.buffer;
+			uint32_t id = *(const uint32_t *)(fp + 1);
+			uint32_t handle = fp->handle;
+
+			/* keep the ref alive once the buffer is freed */
+			put_cmd(wbuf, &wlen, BC_ACQUIRE, &handle,
+				sizeof(handle));
+			handles[id] = handle;
+			put_free(wbuf, &wlen, tr.data.ptr.buffer);
+			put_txn(wbuf, &wlen, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+		} break;
+		case CODE_LOOKUP:
+			put_free(wbuf, &wlen, tr.data.ptr.buffer);
+			if (handles[*arg]) {
+				memset(&obj, 0, sizeof(obj));
+				obj.type = BINDER_TYPE_HANDLE;
+				obj.handle = handles[*arg];
+				offset = 0;
+				put_txn(wbuf, &wlen, BC_REPLY, 0, 0, &obj,
+					sizeof(obj), &offset, sizeof(offset));
+				found++;
+			} else {
+				put_txn(wbuf, &wlen, BC_REPLY, 0, 0,
+					NULL, 0, NULL, 0);
+			}
+			break;
+		default:
+			fprintf(stderr, "manager: bad code %u\n", tr.code);
+			exit(1);
+		}
+	}
+
+	/* send the last reply */
+	flush_cmds(fd, wbuf, wlen);
+}
+
+static void run_server(uint32_t id)
+{
+	static int node;
+	struct {
+		struct flat_binder_object obj;
+		uint32_t id;
+	} reg;
+	size_t offset = 0;
+	struct binder_transaction_data tr;
+	char wbuf[256];
+	size_t wlen = 0;
+	long not_inherited = 0;
+	int fd = binder_open();
+
+	memset(&reg, 0, sizeof(reg));
+	reg.obj.type = BINDER_TYPE_BINDER;
+	reg.obj.flags = 0x7f;
+	if (rt)
+		reg.obj.flags |= FLAT_BINDER_FLAG_INHERIT_RT;
+	reg.obj.binder = &node;
+	reg.obj.cookie = &node;
+	reg.id = id;
+	put_cmd(wbuf, &wlen, BC_ENTER_LOOPER, NULL, 0);
+	put_txn(wbuf, &wlen, BC_TRANSACTION, 0, CODE_REGISTER, &reg,
+		sizeof(reg), &offset, sizeof(offset));
+	if (transact(fd, wbuf, wlen, &tr) != BR_REPLY) {
+		fprintf(stderr, "server %u: register failed\n", id);
+		exit(1);
+	}
+	wlen = 0;
+	put_free(wbuf, &wlen, tr.data.ptr.buffer);
+
+	for (;;) {
+		if (transact(fd, wbuf, wlen, &tr) != BR_TRANSACTION) {
+			fprintf(stderr, "server %u: bad transaction\n", id);
+			exit(1);
+		}
+		wlen = 0;
+		if (rt && sched_getscheduler(0) != SCHED_FIFO)
+			not_inherited++;
+		put_free(wbuf, &wlen, tr.data.ptr.buffer);
+		put_txn(wbuf, &wlen, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+		if (tr.code == CODE_QUIT)
+			break;
+	}
+	flush_cmds(fd, wbuf, wlen);
+	if (not_inherited) {
+		fprintf(stderr, "server %u: %ld calls not served at "
+			"SCHED_FIFO\n", id, not_inherited);
+		exit(1);
+	}
+	if (rt && sched_getscheduler(0) == SCHED_FIFO) {
+		fprintf(stderr, "server %u: still SCHED_FIFO after reply\n",
+			id);
+		exit(1);
+	}
+	exit(0);
+}
+
+static void run_client(uint32_t id, long round_trips, int out)
+{
+	struct binder_transaction_data tr;
+	struct result res;
+	char wbuf[256];
+	size_t wlen = 0;
+	uint32_t handle = 0;
+	double start, t0, t;
+	long i;
+	int fd = binder_open();
+
+	/* wait for our server to show up */
+	for (;;) {
+		const struct flat_binder_object *fp;
+
+		put_txn(wbuf, &wlen, BC_TRANSACTION, 0, CODE_LOOKUP, &id,
+			sizeof(id), NULL, 0);
+		if (transact(fd, wbuf, wlen, &tr) != BR_REPLY) {
+			fprintf(stderr, "client %u: lookup failed\n", id);
+			exit(1);
+		}
+		wlen = 0;
+		if (tr.data_size) {
+			fp = tr.data.ptr.buffer;
+			handle = fp->handle;
+			put_cmd(wbuf, &wlen, BC_ACQUIRE, &handle,
+				sizeof(handle));
+			put_free(wbuf, &wlen, tr.data.ptr.buffer);
+			break;
+		}
+		put_free(wbuf, &wlen, tr.data.ptr.buffer);
+		usleep(1000);
+	}
+
+	if (rt) {
+		struct sched_param param = { .sched_priority = RT_PRIO };
+
+		if (sched_setscheduler(0, SCHED_FIFO, &param))
+			die("sched_setscheduler");
+	}
+
+	res.worst_us = 0;
+	start = now();
+	t0 = start;
+	for (i = 0; i < round_trips; i++) {
+		put_txn(wbuf, &wlen, BC_TRANSACTION, handle, CODE_PING, &i,
+			sizeof(i), NULL, 0);
+		if (transact(fd, wbuf, wlen, &tr) != BR_REPLY) {
+			fprintf(stderr, "client %u: ping failed\n", id);
+			exit(1);
+		}
+		wlen = 0;
+		put_free(wbuf, &wlen, tr.data.ptr.buffer);
+		t = now();
+		if ((t - t0) * 1e6 > res.worst_us)
+			res.worst_us = (t - t0) * 1e6;
+		t0 = t;
+	}
+	res.secs = now() - start;
+	res.round_trips = round_trips;
+
+	put_txn(wbuf, &wlen, BC_TRANSACTION, handle, CODE_QUIT, NULL, 0,
+		NULL, 0);
+	if (transact(fd, wbuf, wlen, &tr) != BR_REPLY)
+		exit(1);
+
+	if (write(out, &res, sizeof(res)) != sizeof(res))
+		die("write");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	int pairs, fd, p[2], i, status, ret = 0;
+	uint32_t enter = BC_ENTER_LOOPER;
+	long round_trips;
+	double rate = 0, avg_us = 0, worst_us = 0;
+
+	if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "rt"))) {
+		fprintf(stderr, "usage: %s <pairs> <round trips/pair> [rt]\n",
+			argv[0]);
+		return 1;
+	}
+	rt = argc == 4;
+	pairs = atoi(argv[1]);
+	round_trips = atol(argv[2]);
+	if (pairs < 1 || pairs > 4095 || round_trips < 1) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	fd = binder_open();
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	if (pipe(p))
+		die("pipe");
+
+	for (i = 1; i <= pairs; i++) {
+		if (fork() == 0) {
+			close(fd);
+			run_server(i);
+		}
+		if (fork() == 0) {
+			close(fd);
+			close(p[0]);
+			run_client(i, round_trips, p[1]);
+		}
+	}
+	close(p[1]);
+
+	flush_cmds(fd, (const char *)&enter, sizeof(enter));
+	run_manager(fd, pairs);
+
+	for (i = 0; i < pairs; i++) {
+		struct result res;
+
+		if (read(p[0], &res, sizeof(res)) != sizeof(res)) {
+			ret = 1;
+			break;
+		}
+		rate += res.round_trips / res.secs;
+		avg_us += res.secs * 1e6 / res.round_trips;
+		if (res.worst_us > worst_us)
+			worst_us = res.worst_us;
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+	if (ret) {
+		fprintf(stderr, "a pair failed\n");
+		return 1;
+	}
+
+	printf("pairs %d%s: %.0f round trips/s, avg %.1f us, worst %.1f us\n",
+	       pairs, rt ? " (SCHED_FIFO)" : "", rate, avg_us / pairs,
+	       worst_us);
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * iosched_replay: replays a block trace against a block device.
+ *
+ * The trace has one request per line, in the order they were issued:
+ *
+ *	<time in us> <R|W|S> <offset in KB> <size in KB>
+ *
+ * R is a read, W a write and S a write followed by fdatasync().  Each
+ * request is issued with O_DIRECT at its time from the start of the
+ * replay, or as soon as one of the threads is free if it is already
+ * late, so that a slower device shows up as longer completion times
+ * rather than a stretched trace.  Offsets past the end of the device
+ * wrap around.
+ *
+ * Printed are the 50th, 90th and 99th percentile and worst completion
+ * time of the reads and of the sync writes, and the time the whole trace
+ * took, which for a trace of an app launch is the launch time.
+ *
+ * usage: iosched_replay <device> <trace> [threads]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#define MAX_THREADS	64
+#define MAX_KB		1024
+
+struct entry {
+	double t;
+	char op;
+	unsigned long long off;
+	size_t size;
+	double lat;
+};
+
+static const char *dev;
+static struct entry *trace;
+static long nr_entries, next;
+static unsigned long long dev_size;
+static double start;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *worker(void *arg)
+{
+	void *buf;
+	int fd;
+
+	(void)arg;
+	fd = open(dev, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	if (posix_memalign(&buf, 4096, MAX_KB * 1024)) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(buf, 'r', MAX_KB * 1024);
+
+	for (;;) {
+		long i = __sync_fetch_and_add(&next, 1);
+		struct entry *e;
+		double wait, t;
+		ssize_t ret;
+
+		if (i >= nr_entries)
+			break;
+		e = &trace[i];
+		wait = start + e->t - now();
+		if (wait > 0)
+			usleep(wait * 1e6);
+
+		t = now();
+		if (e->op == 'R')
+			ret = pread(fd, buf, e->size, e->off);
+		else
+			ret = pwrite(fd, buf, e->size, e->off);
+		if (ret != (ssize_t)e->size) {
+			perror(e->op == 'R' ? "pread" : "pwrite");
+			exit(1);
+		}
+		if (e->op == 'S' && fdatasync(fd)) {
+			perror("fdatasync");
+			exit(1);
+		}
+		e->lat = now() - t;
+	}
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, char op)
+{
+	double *lat;
+	long i, n = 0;
+
+	lat = malloc(nr_entries * sizeof(*lat));
+	if (!lat) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < nr_entries; i++)
+		if (trace[i].op == op)
+			lat[n++] = trace[i].lat;
+	if (n) {
+		qsort(lat, n, sizeof(*lat), cmp_double);
+		printf("%s: %ld, p50 %.0f us p90 %.0f us p99 %.0f us "
+		       "max %.0f us\n", name, n, lat[n / 2] * 1e6,
+		       lat[n * 9 / 10] * 1e6, lat[n * 99 / 100] * 1e6,
+		       lat[n - 1] * 1e6);
+	}
+	free(lat);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[MAX_THREADS];
+	unsigned long long off, size;
+	long i, alloc = 0;
+	int nthreads = 4, fd;
+	char op, line[256];
+	double t;
+	FILE *f;
+
+	if (argc < 3 || argc > 4) {
+		fprintf(stderr, "usage: %s <device> <trace> [threads]\n",
+			argv[0]);
+		return 1;
+	}
+	dev = argv[1];
+	if (argc == 4)
+		nthreads = atoi(argv[3]);
+	if (nthreads < 1 || nthreads > MAX_THREADS) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &dev_size)) {
+		perror(dev);
+		return 1;
+	}
+	close(fd);
+
+	f = fopen(argv[2], "r");
+	if (!f) {
+		perror(argv[2]);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%lf %c %llu %llu", &t, &op, &off,
+			   &size) != 4 || !strchr("RWS", op) || !size ||
+		    size > MAX_KB || size * 1024 > dev_size) {
+			fprintf(stderr, "bad trace line: %s", line);
+			return 1;
+		}
+		if (nr_entries == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			trace = realloc(trace, alloc * sizeof(*trace));
+			if (!trace) {
+				perror("realloc");
+				return 1;
+			}
+		}
+		size *= 1024;
+		trace[nr_entries].t = t / 1e6;
+		trace[nr_entries].op = op;
+		trace[nr_entries].off = off * 1024 % (dev_size - size + 1) /
+					4096 * 4096;
+		trace[nr_entries].size = size;
+		nr_entries++;
+	}
+	fclose(f);
+
+	start = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	t = now() - start;
+
+	printf("%ld requests in %.0f ms\n", nr_entries, t * 1e3);
+	report("reads", 'R');
+	report("sync writes", 'S');
+
+	return 0;
+}
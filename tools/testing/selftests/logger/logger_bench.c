@@ -0,0 +1,267 @@
+/*
+ * logger_bench: many threads logging to the same /dev/log device.
+ *
+ * Each of N writer threads opens the log for writing, like liblog does,
+ * and sends entries made of a priority byte, a tag and a message with
+ * writev() for a fixed number of seconds. The aggregate rate is printed
+ * in writes/s. With a lock-free logger it should keep rising with the
+ * thread count.
+ *
+ * A reader runs alongside and checks every entry of ours that it sees:
+ * the payload must be intact and each thread's sequence numbers must go
+ * up. Entries the reader misses because it was overrun are fine; torn
+ * or reordered entries are not.
+ *
+ * With "mmap" the reader maps the log and consumes whole batches with
+ * LOGGER_GET_POSITION/LOGGER_SET_POSITION instead of calling read() once
+ * per entry. Either way it reports how many entries it got per syscall.
+ *
+ * usage: logger_bench <device> <threads> <seconds> [read|mmap]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define TAG		"logger_bench"
+#define MAX_THREADS	64
+
+static const char *dev;
+static int nthreads;
+static volatile int stop;
+/* one cache line each, so the counters themselves do not bounce */
+static struct {
+	long n;
+} __attribute__((aligned(64))) writes[MAX_THREADS];
+static long last_seq[MAX_THREADS];
+static long seen, bad, syscalls;
+static int use_mmap;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *writer(void *arg)
+{
+	long id = (long)arg;
+	unsigned char prio = 4;
+	char msg[128];
+	struct iovec vec[3];
+	int fd;
+
+	fd = open(dev, O_WRONLY);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	vec[0].iov_base = &prio;
+	vec[0].iov_len = 1;
+	vec[1].iov_base = TAG;
+	vec[1].iov_len = sizeof(TAG);
+	vec[2].iov_base = msg;
+
+	while (!stop) {
+		int len = snprintf(msg, sizeof(msg), "%ld %ld ", id,
+				   writes[id].n);
+
+		/* pad to a typical message size with a per-thread byte */
+		memset(msg + len, 'a' + id % 26, 80 - len);
+		msg[80] = '\0';
+		vec[2].iov_len = 81;
+		if (writev(fd, vec, 3) < 0) {
+			perror("writev");
+			exit(1);
+		}
+		writes[id].n++;
+	}
+	close(fd);
+	return NULL;
+}
+
+/* returns 0 if 'msg' is a well-formed message from this run */
+static int check_entry(const char *msg, int len)
+{
+	long id, seq;
+	int n, i;
+
+	if (len != 1 + sizeof(TAG) + 81 || msg[0] != 4 ||
+	    memcmp(msg + 1, TAG, sizeof(TAG)))
+		return -1;
+	msg += 1 + sizeof(TAG);
+	if (sscanf(msg, "%ld %ld %n", &id, &seq, &n) != 2 ||
+	    id < 0 || id >= nthreads || seq <= last_seq[id])
+		return -1;
+	for (i = n; i < 80; i++)
+		if (msg[i] != 'a' + id % 26)
+			return -1;
+	if (msg[80] != '\0')
+		return -1;
+	last_seq[id] = seq;
+	return 0;
+}
+
+/* check one entry of the log, read() or mapped */
+static void check(struct logger_entry *entry, pid_t pid)
+{
+	if (entry->pid != pid)
+		return;
+	seen++;
+	if (check_entry((char *)entry + entry->hdr_size, entry->len))
+		bad++;
+}
+
+static void *mmap_reader(void *arg)
+{
+	long saved_seq[MAX_THREADS];
+	struct logger_position p;
+	pid_t pid = getpid();
+	long saved_seen, saved_bad;
+	unsigned int size;
+	char *map;
+	int fd;
+
+	(void)arg;
+	fd = open(dev, O_RDONLY);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	size = ioctl(fd, LOGGER_GET_LOG_BUF_SIZE);
+	map = mmap(NULL, 2 * size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED || ioctl(fd, LOGGER_GET_POSITION, &p)) {
+		perror("mmap");
+		exit(1);
+	}
+	syscalls++;
+	while (!stop) {
+		unsigned int start = p.pos, pos = p.pos, end = p.end;
+
+		if (pos == end) {
+			usleep(1000);
+			if (ioctl(fd, LOGGER_GET_POSITION, &p)) {
+				perror("LOGGER_GET_POSITION");
+				exit(1);
+			}
+			syscalls++;
+			continue;
+		}
+
+		/* the whole batch is dropped if a writer lapped us */
+		memcpy(saved_seq, last_seq, sizeof(saved_seq));
+		saved_seen = seen;
+		saved_bad = bad;
+		while ((int)(end - pos) > 0) {
+			struct logger_entry *entry;
+
+			entry = (struct logger_entry *)(map + (pos & (size - 1)));
+			if (entry->hdr_size)
+				check(entry, pid);
+			pos += sizeof(*entry) + entry->len;
+		}
+
+		p.pos = end;
+		if (ioctl(fd, LOGGER_SET_POSITION, &p)) {
+			perror("LOGGER_SET_POSITION");
+			exit(1);
+		}
+		syscalls++;
+		if ((int)(p.tail - start) > 0) {
+			memcpy(last_seq, saved_seq, sizeof(saved_seq));
+			seen = saved_seen;
+			bad = saved_bad;
+		}
+	}
+	munmap(map, 2 * size);
+	close(fd);
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	char buf[LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)];
+	struct logger_entry *entry = (struct logger_entry *)buf;
+	pid_t pid = getpid();
+	int version = 2;
+	int fd;
+
+	(void)arg;
+	fd = open(dev, O_RDONLY | O_NONBLOCK);
+	if (fd < 0 || ioctl(fd, LOGGER_SET_VERSION, &version)) {
+		perror(dev);
+		exit(1);
+	}
+	while (!stop) {
+		ssize_t ret = read(fd, buf, sizeof(buf));
+
+		syscalls++;
+		if (ret < 0) {
+			usleep(1000);
+			continue;
+		}
+		if (ret != (ssize_t)(entry->hdr_size + entry->len)) {
+			bad++;
+			continue;
+		}
+		check(entry, pid);
+	}
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[MAX_THREADS], rd;
+	double start, secs;
+	long i, total = 0;
+
+	if (argc < 4 || argc > 5) {
+		fprintf(stderr, "usage: %s <device> <threads> <seconds> "
+			"[read|mmap]\n", argv[0]);
+		return 1;
+	}
+	dev = argv[1];
+	nthreads = atoi(argv[2]);
+	secs = atof(argv[3]);
+	if (argc == 5)
+		use_mmap = !strcmp(argv[4], "mmap");
+	if (nthreads < 1 || nthreads > MAX_THREADS || secs <= 0 ||
+	    (argc == 5 && !use_mmap && strcmp(argv[4], "read"))) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+	for (i = 0; i < nthreads; i++)
+		last_seq[i] = -1;
+
+	pthread_create(&rd, NULL, use_mmap ? mmap_reader : reader, NULL);
+	start = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, writer, (void *)i);
+	usleep(secs * 1e6);
+	stop = 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	secs = now() - start;
+	pthread_join(rd, NULL);
+
+	for (i = 0; i < nthreads; i++)
+		total += writes[i].n;
+	printf("threads %d: %.0f writes/s, %s reader checked %ld "
+	       "(%.1f per syscall), bad %ld\n", nthreads, total / secs,
+	       use_mmap ? "mmap" : "read", seen,
+	       syscalls ? (double)seen / syscalls : 0.0, bad);
+
+	return bad ? 1 : 0;
+}
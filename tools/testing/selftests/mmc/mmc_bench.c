@@ -0,0 +1,169 @@
+/*
+ * mmc_bench: O_DIRECT reads or writes against a block device.
+ *
+ * Each of N threads issues requests of a fixed size to the device for a
+ * fixed number of seconds, either walking through its own slice of the
+ * device in order or picking random offsets in it.  The aggregate
+ * throughput is printed in MB/s and IOPS, with the average and worst
+ * completion time of a single request.
+ *
+ * With "sync" each write is followed by fdatasync(), which makes the
+ * MMC block driver flush the device cache.
+ *
+ * It is meant to be run against the emulated eMMC host, mmc_emu, so that
+ * changes to the MMC block driver and the block layer can be compared
+ * without the noise of real flash, but works on any block device.  It
+ * writes over whatever is on the device.
+ *
+ * usage: mmc_bench <device> <read|write> <seq|rand> <bs> <threads>
+ *                  <seconds> [sync]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#define MAX_THREADS	64
+
+static const char *dev;
+static int do_write, do_rand, do_sync, nthreads;
+static size_t bs;
+static unsigned long long dev_size;
+static volatile int stop;
+/* one cache line each, so the counters themselves do not bounce */
+static struct {
+	long n;
+	double total, max;
+} __attribute__((aligned(64))) res[MAX_THREADS];
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	unsigned long long slice = dev_size / nthreads / bs;
+	unsigned long long base = id * slice, i = 0;
+	unsigned int seed = id + 1;
+	void *buf;
+	int fd;
+
+	fd = open(dev, (do_write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+	if (fd < 0) {
+		perror(dev);
+		exit(1);
+	}
+	if (posix_memalign(&buf, 4096, bs)) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(buf, 'a' + id % 26, bs);
+
+	while (!stop) {
+		unsigned long long blk;
+		double start, t;
+		ssize_t ret;
+
+		if (do_rand)
+			blk = base + ((unsigned long long)rand_r(&seed) *
+				      RAND_MAX + rand_r(&seed)) % slice;
+		else
+			blk = base + i++ % slice;
+
+		start = now();
+		if (do_write)
+			ret = pwrite(fd, buf, bs, blk * bs);
+		else
+			ret = pread(fd, buf, bs, blk * bs);
+		if (ret != (ssize_t)bs) {
+			perror(do_write ? "pwrite" : "pread");
+			exit(1);
+		}
+		if (do_sync && do_write && fdatasync(fd)) {
+			perror("fdatasync");
+			exit(1);
+		}
+		t = now() - start;
+
+		res[id].n++;
+		res[id].total += t;
+		if (t > res[id].max)
+			res[id].max = t;
+	}
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[MAX_THREADS];
+	double start, secs, total_t = 0, max_t = 0;
+	long i, total = 0;
+	int fd;
+
+	if (argc < 7 || argc > 8) {
+		fprintf(stderr, "usage: %s <device> <read|write> <seq|rand> "
+			"<bs> <threads> <seconds> [sync]\n", argv[0]);
+		return 1;
+	}
+	dev = argv[1];
+	do_write = !strcmp(argv[2], "write");
+	do_rand = !strcmp(argv[3], "rand");
+	bs = strtoul(argv[4], NULL, 0);
+	nthreads = atoi(argv[5]);
+	secs = atof(argv[6]);
+	do_sync = argc == 8 && !strcmp(argv[7], "sync");
+	if ((!do_write && strcmp(argv[2], "read")) ||
+	    (!do_rand && strcmp(argv[3], "seq")) ||
+	    !bs || bs % 512 || nthreads < 1 || nthreads > MAX_THREADS ||
+	    secs <= 0 || (argc == 8 && !do_sync)) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	fd = open(dev, O_RDONLY);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &dev_size)) {
+		perror(dev);
+		return 1;
+	}
+	close(fd);
+	if (dev_size / nthreads < bs) {
+		fprintf(stderr, "device too small\n");
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, worker, (void *)i);
+	usleep(secs * 1e6);
+	stop = 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	secs = now() - start;
+
+	for (i = 0; i < nthreads; i++) {
+		total += res[i].n;
+		total_t += res[i].total;
+		if (res[i].max > max_t)
+			max_t = res[i].max;
+	}
+	printf("%s %s bs %zu threads %d%s: %.1f MB/s, %.0f IOPS, "
+	       "lat avg %.0f us max %.0f us\n", argv[3], argv[2], bs,
+	       nthreads, do_sync ? " sync" : "", total * bs / secs / 1e6,
+	       total / secs, total ? total_t / total * 1e6 : 0.0,
+	       max_t * 1e6);
+
+	return 0;
+}
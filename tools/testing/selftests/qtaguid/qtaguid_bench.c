@@ -0,0 +1,210 @@
+/*
+ * qtaguid_bench: many threads sending tagged UDP packets over loopback.
+ *
+ * Each of N threads opens a UDP socket, tags it through
+ * /proc/net/xt_qtaguid/ctrl with its own accounting tag, and sends small
+ * datagrams to a socket of its own on 127.0.0.1 for a fixed number of
+ * seconds. The aggregate rate is printed in packets/s.
+ *
+ * The numbers only mean something with iptables rules that use the
+ * owner match loaded, since that is what makes every packet go through
+ * qtaguid_mt(). Run it with and without them: the difference is the
+ * per-packet cost of the accounting, and with per-CPU counters it should
+ * stay flat as threads are added instead of growing with contention.
+ *
+ * With "check" the stats of each tag are read back from
+ * /proc/net/xt_qtaguid/stats before and after the run, and the tx packet
+ * count on "lo" must match what the thread sent. That only holds with the
+ * rules loaded.
+ *
+ * usage: qtaguid_bench <threads> <seconds> [check]
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define CTRL		"/proc/net/xt_qtaguid/ctrl"
+#define STATS		"/proc/net/xt_qtaguid/stats"
+#define MAX_THREADS	64
+#define PAYLOAD		64
+
+static int nthreads;
+static volatile int stop;
+static volatile int ready;
+/* one cache line each, so the counters themselves do not bounce */
+static struct {
+	long n;
+} __attribute__((aligned(64))) sent[MAX_THREADS];
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned long long thread_tag(long id)
+{
+	/* the accounting tag lives in the upper 32 bits */
+	return (unsigned long long)(0x7b00 + id) << 32;
+}
+
+static int ctrl(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static int ctrl(const char *fmt, ...)
+{
+	char cmd[128];
+	va_list ap;
+	FILE *f;
+	int ret;
+
+	va_start(ap, fmt);
+	vsnprintf(cmd, sizeof(cmd), fmt, ap);
+	va_end(ap);
+	f = fopen(CTRL, "w");
+	if (!f)
+		return -1;
+	ret = fputs(cmd, f) < 0 ? -1 : 0;
+	if (fclose(f))
+		ret = -1;
+	return ret;
+}
+
+/* tx packets of each of our tags on "lo" */
+static void read_stats(long *tx)
+{
+	char line[512], iface[32];
+	unsigned long long tag, rx_bytes, rx_packets, tx_bytes, tx_packets;
+	unsigned int uid, set;
+	FILE *f;
+	long i;
+
+	memset(tx, 0, MAX_THREADS * sizeof(*tx));
+	f = fopen(STATS, "r");
+	if (!f) {
+		perror(STATS);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%*d %31s 0x%llx %u %u %llu %llu %llu %llu",
+			   iface, &tag, &uid, &set, &rx_bytes, &rx_packets,
+			   &tx_bytes, &tx_packets) != 8)
+			continue;
+		if (strcmp(iface, "lo") || uid != getuid())
+			continue;
+		for (i = 0; i < nthreads; i++)
+			if (tag == thread_tag(i))
+				tx[i] += tx_packets;
+	}
+	fclose(f);
+}
+
+static void *sender(void *arg)
+{
+	long id = (long)arg;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	char buf[PAYLOAD];
+	int rx, tx;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	rx = socket(AF_INET, SOCK_DGRAM, 0);
+	tx = socket(AF_INET, SOCK_DGRAM, 0);
+	if (rx < 0 || tx < 0 ||
+	    bind(rx, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    getsockname(rx, (struct sockaddr *)&addr, &len) ||
+	    connect(tx, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("socket");
+		exit(1);
+	}
+	if (ctrl("t %d %llu %u", tx, thread_tag(id), getuid())) {
+		perror(CTRL);
+		exit(1);
+	}
+	memset(buf, 'a' + id % 26, sizeof(buf));
+	__sync_fetch_and_add(&ready, 1);
+	while (ready < nthreads)
+		;
+
+	while (!stop) {
+		if (send(tx, buf, sizeof(buf), 0) < 0) {
+			perror("send");
+			exit(1);
+		}
+		sent[id].n++;
+		/* keep the receive queue from filling up and dropping */
+		while (recv(rx, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+			;
+	}
+
+	if (ctrl("u %d", tx)) {
+		perror(CTRL);
+		exit(1);
+	}
+	close(tx);
+	close(rx);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[MAX_THREADS];
+	long before[MAX_THREADS], after[MAX_THREADS];
+	double start, secs;
+	long i, total = 0;
+	int check = 0, bad = 0;
+
+	if (argc < 3 || argc > 4) {
+		fprintf(stderr, "usage: %s <threads> <seconds> [check]\n",
+			argv[0]);
+		return 1;
+	}
+	nthreads = atoi(argv[1]);
+	secs = atof(argv[2]);
+	if (argc == 4)
+		check = !strcmp(argv[3], "check");
+	if (nthreads < 1 || nthreads > MAX_THREADS || secs <= 0 ||
+	    (argc == 4 && !check)) {
+		fprintf(stderr, "bad arguments\n");
+		return 1;
+	}
+
+	if (check)
+		read_stats(before);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, sender, (void *)i);
+	while (ready < nthreads)
+		usleep(1000);
+	start = now();
+	usleep(secs * 1e6);
+	stop = 1;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	secs = now() - start;
+
+	for (i = 0; i < nthreads; i++)
+		total += sent[i].n;
+	printf("threads %d: %.0f packets/s", nthreads, total / secs);
+	if (check) {
+		read_stats(after);
+		for (i = 0; i < nthreads; i++)
+			if (after[i] - before[i] != sent[i].n)
+				bad++;
+		printf(", %d of %d tags miscounted", bad, nthreads);
+	}
+	printf("\n");
+
+	return bad ? 1 : 0;
+}
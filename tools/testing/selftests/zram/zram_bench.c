@@ -0,0 +1,141 @@
+/*
+ * zram_bench: fio-like parallel write/read load on a zram device.
+ *
+ * Each of N threads owns a disjoint region of the device and writes
+ * it with O_DIRECT page-sized I/O, the way swap-out does, then reads
+ * it back. Page contents are half random, half repeated bytes so
+ * that they compress roughly 2:1, like typical anonymous memory.
+ *
+ * With mode "write" only the write pass runs; with "read" only the
+ * read pass runs and every page is checked against what "write" put
+ * there, so data can be verified after e.g. zram writeback. "holes"
+ * overwrites every other page with zeroes, which frees its storage.
+ *
+ * usage: zram_bench <device> <threads> <MB/thread> [rw|write|read|holes]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define PAGE	4096
+
+static const char *dev;
+static long pages_per_thread;
+static int do_write = 1, do_read = 1, verify, holes;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void fill_page(unsigned char *p, unsigned int seed)
+{
+	int i;
+
+	for (i = 0; i < PAGE / 2; i++)
+		p[i] = rand_r(&seed);
+	memset(p + PAGE / 2, seed & 0xff, PAGE / 2);
+}
+
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	off_t base = id * pages_per_thread * PAGE;
+	unsigned char *buf, expect[PAGE];
+	long i;
+	int fd;
+
+	fd = open(dev, O_RDWR | O_DIRECT);
+	if (fd < 0 || posix_memalign((void **)&buf, PAGE, PAGE)) {
+		perror(dev);
+		exit(1);
+	}
+
+	for (i = 0; do_write && i < pages_per_thread; i++) {
+		if (holes && (i & 1))
+			continue;
+		if (holes)
+			memset(buf, 0, PAGE);
+		else
+			fill_page(buf, id * pages_per_thread + i);
+		if (pwrite(fd, buf, PAGE, base + i * PAGE) != PAGE) {
+			perror("pwrite");
+			exit(1);
+		}
+	}
+
+	for (i = 0; do_read && i < pages_per_thread; i++) {
+		if (pread(fd, buf, PAGE, base + i * PAGE) != PAGE) {
+			perror("pread");
+			exit(1);
+		}
+		if (!verify)
+			continue;
+		fill_page(expect, id * pages_per_thread + i);
+		if (memcmp(buf, expect, PAGE)) {
+			fprintf(stderr, "data mismatch at page %ld\n",
+				id * pages_per_thread + i);
+			exit(1);
+		}
+	}
+
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads;
+	long i, nr_threads;
+	double start, elapsed;
+
+	if (argc != 4 && argc != 5) {
+		fprintf(stderr,
+			"usage: %s <device> <threads> <MB/thread> "
+			"[rw|write|read|holes]\n",
+			argv[0]);
+		return 1;
+	}
+	if (argc == 5 && !strcmp(argv[4], "write")) {
+		do_read = 0;
+	} else if (argc == 5 && !strcmp(argv[4], "read")) {
+		do_write = 0;
+		verify = 1;
+	} else if (argc == 5 && !strcmp(argv[4], "holes")) {
+		do_read = 0;
+		holes = 1;
+	} else if (argc == 5 && strcmp(argv[4], "rw")) {
+		fprintf(stderr, "unknown mode %s\n", argv[4]);
+		return 1;
+	}
+	dev = argv[1];
+	nr_threads = atol(argv[2]);
+	pages_per_thread = atol(argv[3]) * (1024 * 1024 / PAGE);
+	if (nr_threads < 1 || pages_per_thread < 1)
+		return 1;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	start = now();
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i], NULL, worker, (void *)i);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = now() - start;
+
+	printf("threads=%ld total=%ldMB time=%.2fs throughput=%.1fMB/s\n",
+		nr_threads, nr_threads * pages_per_thread * PAGE >> 20,
+		elapsed,
+		(do_write + do_read) * nr_threads * pages_per_thread * PAGE /
+		elapsed / 1e6);
+	return 0;
+}